@@ -0,0 +1,354 @@
+#ifndef CERTGOSSIP_H
+#define CERTGOSSIP_H
+
+#include "ChordNode.hpp"
+#include "Crc32.hpp"
+#include "Log.hpp"
+#include "Sha1.hpp"
+#include "Transport.hpp"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+constexpr uint64_t CERT_GOSSIP_INTERVAL_MS = 1000;
+constexpr uint16_t CERT_GOSSIP_TIMEOUT_MS = 1000;
+constexpr uint16_t CERT_CHUNK_TIMEOUT_MS = 5000;  // a full window on a slow link takes a while
+constexpr int CERT_FETCH_WINDOW = 4;       // chunk requests in flight per transfer
+constexpr int CERT_RECORDS_PER_ROUND = 4;  // full-size transfers a node starts serving per interval
+
+/**
+* Spreads the certificate record through the ring by gossip. Every interval a node sends
+* the digest of its record (version, hash and length) to a random routing table entry,
+* which answers with its own digest. Whichever side turns out to be behind fetches the
+* newer record from the other, so equal versions cost two small messages and a record
+* only travels to a node that misses it. Fingers span the ring at doubling distances, so
+* a new version reaches all N nodes in O(log N) rounds. A node that adopts a newer record
+* passes it on at once instead of waiting for its turn.
+*
+* Records of up to CERT_MAX_LEN are fetched in chunks of CERT_CHUNK_LEN, with a window
+* of CERT_FETCH_WINDOW requests in flight. Each chunk carries a CRC-32 and goes out in
+* one sendmsg straight from the sender's record, the receiver copies it into place. A
+* transfer that is cut off keeps the chunks it has, and the next peer with the same
+* version is only asked for the rest. The whole record is checked against its SHA-1
+* before it replaces ours. A node starts serving at most CERT_RECORDS_PER_ROUND
+* records of CERT_MAX_LEN per interval however many peers ask, the others retry in a
+* later round. Smaller records count by their size, at least one chunk each, so after a
+* cold start the first node hands a small certificate to everyone joining at once.
+*/
+class CertGossip {
+public:
+    CertGossip(ChordNode& node, Transport& transport)
+        : node(node), transport(transport), in_flight(false), serve_budget(SERVE_BUDGET), records_sent(0),
+          chunks_fetched(0) {
+        std::memset(&record, 0, sizeof(record));
+        last_round = transport.nowMs();
+        budget_start = last_round;
+        std::memcpy(&rng, node.getMyself().id.bytes, sizeof(rng));
+        rng ^= last_round;
+        if (rng == 0) rng = 1;
+    }
+
+    /**
+    * Replaces our record if version and data are newer than what we hold. Returns false
+    * if they are not, or if data is longer than CERT_MAX_LEN.
+    */
+    bool setCertificate(const uint8_t* data, uint32_t len, uint64_t version) {
+        if (len > CERT_MAX_LEN) return false;
+        CertPayload fresh;
+        fresh.version = version;
+        fresh.hash = sha1(data, len);
+        fresh.cert_len = len;
+        if (!newer(fresh, record)) return false;
+        adopt(fresh, std::vector<uint8_t>(data, data + len));
+        return true;
+    }
+
+    uint64_t version() const { return record.version; }
+    const uint8_t* data() const { return content.data(); }
+    uint32_t length() const { return record.cert_len; }
+
+    // Transfers served and chunks received since the start, the bandwidth the gossip costs.
+    uint64_t recordsSent() const { return records_sent; }
+    uint64_t chunksFetched() const { return chunks_fetched; }
+
+    // Bytes of a newer record received so far, 0 if none is being fetched.
+    uint32_t fetchProgress() const { return fetch ? fetch->received_bytes : 0; }
+
+    /**
+    * Serves certificate requests, returns false for message types it does not handle.
+    */
+    bool handleRequest(const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+        if (hdr.type == MSG_GET_CERT) {
+            IoSlice slices[2] = {{&record, sizeof(record)}, {content.data(), std::min(record.cert_len, CERT_CHUNK_LEN)}};
+            transport.replyv(from, MSG_CERT_RESPONSE, slices, 2);
+        }
+        else if (hdr.type == MSG_CERT_DIGEST) {
+            if (hdr.payload_len < sizeof(CertDigestPayload)) return true;
+            CertDigestPayload mine = digest();
+            transport.reply(from, MSG_CERT_DIGEST, &mine, sizeof(mine));
+            const CertDigestPayload* theirs = (const CertDigestPayload*)payload;
+            fetchFrom(theirs->sender, *theirs);
+        }
+        else if (hdr.type == MSG_CERT_CHUNK) {
+            if (hdr.payload_len < sizeof(CertChunkRequestPayload)) return true;
+            serveChunk(from, *(const CertChunkRequestPayload*)payload);
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    // Starts a gossip round when one is due. Never blocks.
+    void tick() {
+        uint64_t now = transport.nowMs();
+        if (now - budget_start >= CERT_GOSSIP_INTERVAL_MS) {
+            budget_start = now;
+            serve_budget = SERVE_BUDGET;
+        }
+        if (in_flight || node.isAlone() || now - last_round < CERT_GOSSIP_INTERVAL_MS) return;
+        NodeInfo peer;
+        if (!pickPeer(&peer)) return;
+        last_round = now;
+        exchange(peer);
+    }
+
+    // One digest exchange with peer, e.g. right after joining through it.
+    void exchange(const NodeInfo& peer) {
+        if (in_flight) return;
+        in_flight = true;
+        CertDigestPayload mine = digest();
+        transport.call(peer, MSG_CERT_DIGEST, &mine, sizeof(mine), CERT_GOSSIP_TIMEOUT_MS,
+            [this, peer](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                in_flight = false;
+                if (!ok || h.type != MSG_CERT_DIGEST || h.payload_len < sizeof(CertDigestPayload)) return;
+                fetchFrom(peer, *(const CertDigestPayload*)payload);
+            });
+    }
+
+private:
+    static const uint64_t SERVE_BUDGET = (uint64_t)CERT_RECORDS_PER_ROUND * CERT_MAX_LEN;
+
+    // A newer record on its way in, kept across peers until it is complete.
+    struct Fetch {
+        CertPayload record;
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> state;  // per chunk: CHUNK_MISSING, CHUNK_REQUESTED or CHUNK_DONE
+        uint32_t received_bytes;
+        uint32_t next;               // no missing chunk below it
+        int in_flight;
+        bool active;                 // a peer is being asked
+        bool failed;                 // that peer stopped serving, no new requests to it
+        NodeInfo peer;
+    };
+
+    enum { CHUNK_MISSING = 0, CHUNK_REQUESTED = 1, CHUNK_DONE = 2 };
+
+    static bool newer(const CertPayload& a, const CertPayload& b) {
+        if (a.version != b.version) return a.version > b.version;
+        return b.hash < a.hash;
+    }
+
+    static bool sameRecord(const CertPayload& a, const CertPayload& b) {
+        return a.version == b.version && a.hash == b.hash && a.cert_len == b.cert_len;
+    }
+
+    CertDigestPayload digest() const {
+        CertDigestPayload d;
+        d.sender = node.getMyself();
+        d.version = record.version;
+        d.hash = record.hash;
+        d.cert_len = record.cert_len;
+        return d;
+    }
+
+    void serveChunk(const ReplyTo& from, const CertChunkRequestPayload& req) {
+        CertChunkPayload resp;
+        std::memset(&resp, 0, sizeof(resp));
+        resp.offset = req.offset;
+        if (req.version != record.version || req.hash != record.hash) {
+            resp.status = CERT_CHUNK_GONE;
+        } else if (req.offset % CERT_CHUNK_LEN != 0 || req.offset >= record.cert_len) {
+            resp.status = CERT_CHUNK_BAD_OFFSET;
+        } else if (req.offset == 0 && !spendRecord()) {
+            // Only the start of a transfer counts, one that resumes is nearly done.
+            resp.status = CERT_CHUNK_BUSY;
+        } else {
+            if (req.offset == 0) ++records_sent;
+            resp.status = CERT_CHUNK_OK;
+            resp.chunk_len = std::min(CERT_CHUNK_LEN, record.cert_len - req.offset);
+            resp.crc = chunk_crcs[req.offset / CERT_CHUNK_LEN];
+        }
+        IoSlice slices[2] = {{&resp, sizeof(resp)}, {nullptr, resp.chunk_len}};
+        if (resp.chunk_len > 0) slices[1].data = content.data() + req.offset;
+        transport.replyv(from, MSG_CERT_CHUNK_RESPONSE, slices, resp.chunk_len > 0 ? 2 : 1);
+    }
+
+    bool spendRecord() {
+        uint64_t cost = std::max(record.cert_len, CERT_CHUNK_LEN);
+        if (serve_budget < cost) return false;
+        serve_budget -= cost;
+        return true;
+    }
+
+    /**
+    * Fetches the record theirs describes from peer if it is newer than ours. Continues a
+    * fetch of the same record where it stopped, and drops one of an older record.
+    */
+    void fetchFrom(const NodeInfo& peer, const CertDigestPayload& theirs) {
+        CertPayload rec;
+        rec.version = theirs.version;
+        rec.hash = theirs.hash;
+        rec.cert_len = theirs.cert_len;
+        if (!newer(rec, record) || rec.cert_len > CERT_MAX_LEN || peer.ip == 0 || peer.id == node.getMyself().id) return;
+        if (fetch && !sameRecord(fetch->record, rec)) {
+            if (!newer(rec, fetch->record)) return;
+            fetch.reset();  // its requests in flight see that it is gone
+        }
+        if (!fetch) {
+            fetch = std::make_shared<Fetch>();
+            fetch->record = rec;
+            fetch->data.resize(rec.cert_len);
+            fetch->state.assign((rec.cert_len + CERT_CHUNK_LEN - 1) / CERT_CHUNK_LEN, (uint8_t)CHUNK_MISSING);
+            fetch->received_bytes = 0;
+            fetch->next = 0;
+            fetch->in_flight = 0;
+            fetch->active = false;
+            fetch->failed = false;
+        }
+        if (fetch->active) return;
+        if (fetch->received_bytes > 0) {
+            LOG_INFO("[SECURITY] Resuming certificate version " << rec.version << " at " << fetch->received_bytes << " of "
+                     << rec.cert_len << " bytes");
+        }
+        fetch->active = true;
+        fetch->failed = false;
+        fetch->peer = peer;
+        pump(fetch);
+    }
+
+    // Keeps the window of chunk requests full, and finishes the fetch once all arrived.
+    void pump(const std::shared_ptr<Fetch>& f) {
+        while (!f->failed && f->in_flight < CERT_FETCH_WINDOW) {
+            while (f->next < f->state.size() && f->state[f->next] != CHUNK_MISSING) ++f->next;
+            if (f->next >= f->state.size()) break;
+            requestChunk(f, f->next);
+        }
+        if (f->in_flight > 0) return;
+        if (f->received_bytes == f->record.cert_len) {
+            finish(f);
+        } else {
+            // Cut off, the next digest from a peer with this record resumes it.
+            f->active = false;
+            f->next = 0;
+        }
+    }
+
+    void requestChunk(const std::shared_ptr<Fetch>& f, uint32_t chunk, bool retry = false) {
+        f->state[chunk] = CHUNK_REQUESTED;
+        ++f->in_flight;
+        CertChunkRequestPayload req;
+        req.version = f->record.version;
+        req.hash = f->record.hash;
+        req.offset = chunk * CERT_CHUNK_LEN;
+        transport.call(f->peer, MSG_CERT_CHUNK, &req, sizeof(req), CERT_CHUNK_TIMEOUT_MS,
+            [this, f, chunk, retry](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                --f->in_flight;
+                f->state[chunk] = CHUNK_MISSING;
+                if (f != fetch) return;
+                if (!ok && !retry && !f->failed) {
+                    // One lost message is no reason to give up on the peer, ask once more.
+                    requestChunk(f, chunk, true);
+                    return;
+                }
+                if (ok && storeChunk(*f, chunk, h, payload)) f->state[chunk] = CHUNK_DONE;
+                else f->failed = true;
+                pump(f);
+            });
+    }
+
+    // Copies a received chunk into place, false if it is not the one asked for or corrupt.
+    bool storeChunk(Fetch& f, uint32_t chunk, const PacketHeader& h, const uint8_t* payload) {
+        if (h.type != MSG_CERT_CHUNK_RESPONSE || h.payload_len < sizeof(CertChunkPayload)) return false;
+        const CertChunkPayload* resp = (const CertChunkPayload*)payload;
+        uint32_t offset = chunk * CERT_CHUNK_LEN;
+        uint32_t expected = std::min(CERT_CHUNK_LEN, f.record.cert_len - offset);
+        if (resp->status != CERT_CHUNK_OK || resp->offset != offset || resp->chunk_len != expected ||
+            h.payload_len - sizeof(CertChunkPayload) < expected) return false;
+        const uint8_t* data = payload + sizeof(CertChunkPayload);
+        if (crc32(data, expected) != resp->crc) {
+            LOG_WARN("[SECURITY] Certificate chunk at " << offset << " failed its checksum");
+            return false;
+        }
+        std::memcpy(f.data.data() + offset, data, expected);
+        f.received_bytes += expected;
+        ++chunks_fetched;
+        return true;
+    }
+
+    void finish(const std::shared_ptr<Fetch>& f) {
+        fetch.reset();
+        if (sha1(f->data.data(), f->data.size()) != f->record.hash) {
+            LOG_WARN("[SECURITY] Certificate version " << f->record.version << " dropped, its content does not match its hash");
+            return;
+        }
+        if (newer(f->record, record)) adopt(f->record, std::move(f->data));
+    }
+
+    void adopt(const CertPayload& fresh, std::vector<uint8_t>&& data) {
+        record = fresh;
+        content = std::move(data);
+        chunk_crcs.clear();
+        for (uint32_t off = 0; off < record.cert_len; off += CERT_CHUNK_LEN) {
+            chunk_crcs.push_back(crc32(content.data() + off, std::min(CERT_CHUNK_LEN, record.cert_len - off)));
+        }
+        if (fetch && !newer(fetch->record, record)) fetch.reset();
+        LOG_INFO("[SECURITY] Certificate version " << record.version << " adopted, " << record.cert_len << " bytes, hash " << record.hash);
+        // Pass it on right away, the next tick starts a round.
+        last_round = transport.nowMs() - CERT_GOSSIP_INTERVAL_MS;
+    }
+
+    // A random distinct entry of the successor list, the fingers and the predecessor.
+    bool pickPeer(NodeInfo* out) {
+        NodeInfo candidates[SUCLIST_SIZE + ID_BITS + 1];
+        int n = 0;
+        const Sha1ID& me = node.getMyself().id;
+        auto add = [&](const NodeInfo& c) {
+            if (c.ip == 0 || c.id == me) return;
+            for (int i = 0; i < n; ++i) {
+                if (candidates[i].id == c.id) return;
+            }
+            candidates[n++] = c;
+        };
+        NodeInfo sucs[SUCLIST_SIZE];
+        uint8_t count = 0;
+        node.getMySuccessorList(sucs, &count);
+        for (int i = 0; i < count; ++i) add(sucs[i]);
+        for (int i = 0; i < ID_BITS; ++i) add(node.getFinger(i));
+        if (node.hasPredecessor()) add(node.getPredecessor());
+        if (n == 0) return false;
+        // xorshift64, seeded per node so that simulated runs stay reproducible.
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        *out = candidates[rng % n];
+        return true;
+    }
+
+    ChordNode& node;
+    Transport& transport;
+    CertPayload record;
+    std::vector<uint8_t> content;
+    std::vector<uint32_t> chunk_crcs;  // CRC-32 of each chunk of content, sent with it
+    std::shared_ptr<Fetch> fetch;
+    bool in_flight;
+    uint64_t last_round;
+    uint64_t budget_start;
+    uint64_t serve_budget;  // bytes of transfers we may still start this interval
+    uint64_t records_sent;
+    uint64_t chunks_fetched;
+    uint64_t rng;
+};
+
+#endif
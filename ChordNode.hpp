@@ -1,27 +1,121 @@
 #ifndef CHORDNODE_H
 #define CHORDNODE_H
 
+#include "Log.hpp"
+#include "Net.h"
 #include "Protocol.h"
+#include "Rcu.hpp"
+#include "Sha1.hpp"
 #include <array>
-#include <iostream>
 
-class ChordNode {
+/**
+* What a node knows about the ring, and the routing decisions made from it. ChordNode
+* owns the live table. Threads other than the event loop route from immutable copies
+* that ChordNode::publish() hands out.
+*/
+struct RoutingTable {
+    NodeInfo myself;
+    NodeInfo predecessor;
+    bool predecessor_valid;
+    NodeInfo successor_list[SUCLIST_SIZE];
+    NodeInfo fingers[ID_BITS];
+    bool has_bootstrap;
+    NodeInfo bootstrap;
+
+    /**
+    * One routing step for target_id. Sets *is_owner if the returned node is responsible
+    * for the target, otherwise the returned node is the closest preceding node we know.
+    */
+    NodeInfo findSuccessorNextHop(const Sha1ID& target_id, bool* is_owner) const {
+        if (predecessor_valid && in_interval(target_id, predecessor.id, myself.id)) {
+            *is_owner = true;
+            return myself;
+        }
+        if (in_interval(target_id, myself.id, successor_list[0].id)) {
+            *is_owner = true;
+            return successor_list[0];
+        }
+        *is_owner = false;
+        return closestPrecedingNode(target_id);
+    }
+
+    /**
+    * Routing step as answered to others. A node still waiting for its own join knows no
+    * ring yet, claiming every key would hand joiners an arbitrary successor that
+    * stabilize then walks back node by node. It points to its bootstrap instead.
+    */
+    NodeInfo nextHop(const Sha1ID& target_id, bool* is_owner) const {
+        if (isAlone() && has_bootstrap) {
+            *is_owner = false;
+            return bootstrap;
+        }
+        return findSuccessorNextHop(target_id, is_owner);
+    }
+
+    NodeInfo closestPrecedingNode(const Sha1ID& target_id) const {
+        NodeInfo best = successor_list[0];
+        for(int i = ID_BITS-1; i >= 0; --i) {
+            if (in_open_interval(fingers[i].id, myself.id, target_id)) {
+                best = fingers[i];
+                break;
+            }
+        }
+        // The successor list may be fresher than the fingers.
+        for(int i = 0; i < SUCLIST_SIZE; ++i) {
+            if (in_open_interval(successor_list[i].id, best.id, target_id)) {
+                best = successor_list[i];
+            }
+        }
+        return best;
+    }
+
+    /**
+    * True if key falls into (predecessor, myself]. Without a known predecessor only a
+    * lonely node can be sure.
+    */
+    bool isResponsibleFor(const Sha1ID& key) const {
+        if (isAlone()) return true;
+        return predecessor_valid && in_interval(key, predecessor.id, myself.id);
+    }
+
+    bool isAlone() const {
+        return successor_list[0].id == myself.id;
+    }
+
+    void getMySuccessorList(NodeInfo* out, uint8_t* out_count) const {
+        *out_count = SUCLIST_SIZE;
+        for(int i=0; i<SUCLIST_SIZE; ++i) out[i] = successor_list[i];
+    }
+};
+
+class ChordNode : private RoutingTable {
 public:
-    ChordNode(uint32_t my_ip, uint16_t my_port) {
+    using RoutingTable::findSuccessorNextHop;
+    using RoutingTable::nextHop;
+    using RoutingTable::closestPrecedingNode;
+    using RoutingTable::isResponsibleFor;
+    using RoutingTable::isAlone;
+    using RoutingTable::getMySuccessorList;
+
+    ChordNode(uint32_t my_ip, uint16_t my_port) : revision(0), published_revision(0) {
         myself.ip = my_ip;
         myself.port = my_port;
 
-        std::memset(myself.id.bytes, 0, 20);
-        std::memcpy(&myself.id.bytes[16], &my_ip, 4);
+        myself.id = nodeIdFor(my_ip, my_port);
 
         for(int i = 0; i < SUCLIST_SIZE; ++i) {
             successor_list[i] = myself;
         }
+        for(int i = 0; i < ID_BITS; ++i) {
+            fingers[i] = myself;
+        }
+        next_finger = 0;
 
+        predecessor = myself;  // not valid until set, but never read uninitialized
         predecessor_valid = false;
-		my_cert_len = 0;
-		has_cert = false;
-        std::cout << "[NODE] Init ID: " << (int)myself.id.toTinyID() << std::endl;
+        has_bootstrap = false;
+        std::memset(&bootstrap, 0, sizeof(bootstrap));
+        LOG_INFO("[NODE] Init ID: " << myself.id);
     }
 
     NodeInfo getSuccessor() const { return successor_list[0]; }
@@ -29,35 +123,85 @@ public:
     bool hasPredecessor() const { return predecessor_valid; }
     NodeInfo getMyself() const { return myself; }
 
+    // The live table, only for the thread that runs the node.
+    const RoutingTable& table() const { return *this; }
+
+    /**
+    * The table as last published, for other threads inside an RCU read section. Null
+    * until the first publish().
+    */
+    const RoutingTable* snapshot() const { return published.read(); }
+
+    // Hands out a copy of the table if it changed since the last call.
+    void publish(RcuDomain& rcu) {
+        if (published.read() && revision == published_revision) return;
+        published.publish(rcu, new RoutingTable(table()));
+        published_revision = revision;
+    }
+
+    // Node answered to lookups while we have not joined yet.
+    void setBootstrap(const NodeInfo& node) {
+        bootstrap = node;
+        has_bootstrap = true;
+        ++revision;
+    }
+
     void setSuccessor(const NodeInfo& new_suc) {
+        ++revision;
         for(int i=0; i<SUCLIST_SIZE; ++i) {
             successor_list[i] = new_suc;
         }
-        std::cout << "[UPDATE] Successor set to " << new_suc.id << " (List Reset)" << std::endl;
+        LOG_INFO("[UPDATE] Successor set to " << new_suc.id << " (List Reset)");
     }
 
     void invalidatePredecessor() {
+        ++revision;
         predecessor_valid = false;
         std::memset(predecessor.id.bytes, 0, 20);
         predecessor.ip = 0;
     }
 
     void handleSuccessorFailure() {
-        std::cout << "[FAILOVER] Successor " << successor_list[0].id << " unreachable!" << std::endl;
+        LOG_WARN("[FAILOVER] Successor " << successor_list[0].id << " unreachable!");
+        NodeInfo dead = successor_list[0];
+        ++revision;
 
         for(int i=0; i < SUCLIST_SIZE-1; ++i) {
             successor_list[i] = successor_list[i+1];
         }
         successor_list[SUCLIST_SIZE-1] = myself;
 
-        std::cout << "[FAILOVER] New Successor is " << successor_list[0].id << std::endl;
-
         invalidatePredecessor();
+        removeNode(dead);
+
+        // All backups are gone, continue with the closest finger past the gap.
+        // Stabilize walks back from there to the true successor.
+        if (successor_list[0].id == myself.id) {
+            for (int i = 0; i < ID_BITS; ++i) {
+                if (fingers[i].id != myself.id) {
+                    successor_list[0] = fingers[i];
+                    break;
+                }
+            }
+        }
+
+        LOG_WARN("[FAILOVER] New Successor is " << successor_list[0].id);
     }
 
     /**
-    * At the moment no O(log N) implementation of the finger table.
+    * Drops a dead node from the finger table. Every finger pointing to it falls back
+    * to the next higher finger, which still succeeds the finger start.
     */
+    void removeNode(const NodeInfo& dead) {
+        if (dead.id == myself.id) return;
+        ++revision;
+        for(int i = ID_BITS-1; i >= 0; --i) {
+            if (fingers[i].id == dead.id) {
+                fingers[i] = (i == ID_BITS-1) ? successor_list[0] : fingers[i+1];
+            }
+        }
+    }
+
     void updateSuccessorList(const NodeInfo* received_list, int count) {
         bool changed = false;
 
@@ -69,70 +213,95 @@ public:
         }
 
         if (changed) {
-            // std::cout << "[INFO] Backup-List updated." << std::endl;
+            ++revision;
         }
     }
 
-    void getMySuccessorList(NodeInfo* out, uint8_t* out_count) {
-        *out_count = SUCLIST_SIZE;
-        for(int i=0; i<SUCLIST_SIZE; ++i) out[i] = successor_list[i];
-    }
-
     void handleStabilizeResponse(const NodeInfo& x) {
         if (in_interval(x.id, myself.id, successor_list[0].id)) {
 
             if (x.id == successor_list[0].id) return;
 
-            std::cout << "[STABILIZE] Found closer successor: " << inet_ntoa(*(in_addr*)&x.ip) << std::endl;
+            LOG_INFO("[STABILIZE] Found closer successor: " << inet_ntoa(*(in_addr*)&x.ip));
+            // Keep the old successor as first backup, x may be a dead node the successor
+            // has not dropped as predecessor yet.
+            for (int i = SUCLIST_SIZE-1; i > 0; --i) successor_list[i] = successor_list[i-1];
             successor_list[0] = x;
+            ++revision;
         }
     }
 
-    void handleNotify(const NodeInfo& potential_pred) {
+    /**
+    * Returns true if potential_pred became our predecessor, *old_pred is set to the one
+    * it replaced (predecessor_valid false if there was none).
+    */
+    bool handleNotify(const NodeInfo& potential_pred, NodeInfo* old_pred = nullptr, bool* had_pred = nullptr) {
+        if (predecessor_valid && potential_pred.id == predecessor.id) return false;
         if (!predecessor_valid || in_interval(potential_pred.id, predecessor.id, myself.id)) {
+            if (old_pred) *old_pred = predecessor;
+            if (had_pred) *had_pred = predecessor_valid;
             predecessor = potential_pred;
             predecessor_valid = true;
+            ++revision;
+            return true;
         }
+        return false;
     }
 
-    NodeInfo findSuccessorNextHop(const Sha1ID& target_id) {
-        if (in_interval(target_id, myself.id, successor_list[0].id)) {
-            return successor_list[0];
+    /**
+    * A neighbour left the ring on purpose, replacement is the node that takes its place
+    * next to us. Unlike a failure there is nothing to wait for.
+    */
+    void handleLeave(const NodeInfo& leaving, const NodeInfo& replacement) {
+        ++revision;
+        if (predecessor_valid && predecessor.id == leaving.id) {
+            if (replacement.ip != 0 && replacement.id != myself.id) predecessor = replacement;
+            else invalidatePredecessor();
+        }
+        if (successor_list[0].id == leaving.id) {
+            for (int i = 0; i < SUCLIST_SIZE-1; ++i) successor_list[i] = successor_list[i+1];
+            successor_list[SUCLIST_SIZE-1] = myself;
+            if (replacement.ip != 0 && successor_list[0].id != replacement.id) successor_list[0] = replacement;
+            LOG_INFO("[LEAVE] " << leaving.id << " left, new successor is " << successor_list[0].id);
         }
-        return successor_list[0];
+        removeNode(leaving);
     }
 
+    Sha1ID fingerStart(int i) const { return myself.id.addPowerOfTwo(i); }
+    NodeInfo getFinger(int i) const { return fingers[i]; }
+    int getNextFingerToFix() const { return next_finger; }
+
+    /**
+    * Stores the successor of fingerStart(i). All following fingers whose start also
+    * falls into (myself, suc] share the same node, so they are skipped in one step.
+    */
+    void updateFinger(int i, const NodeInfo& suc) {
+        ++revision;
+        fingers[i] = suc;
+        int j = i + 1;
+        while (j < ID_BITS && in_interval(fingerStart(j), myself.id, suc.id) && suc.id != myself.id) {
+            fingers[j] = suc;
+            ++j;
+        }
+        next_finger = (j >= ID_BITS) ? 0 : j;
+    }
+
+    void skipFinger(int i) { next_finger = (i + 1) % ID_BITS; }
+
     void handleSetSuccessor(const NodeInfo& new_suc) {
         setSuccessor(new_suc);
     }
     void handleSetPredecessor(const NodeInfo& new_pred) {
+        ++revision;
         predecessor = new_pred;
         predecessor_valid = true;
     }
 
-    void setCertificate(const uint8_t* data, uint32_t len) {
-        if (len > 2048) len = 2048;
-        std::memcpy(my_cert, data, len);
-        my_cert_len = len;
-        has_cert = true;
-    }
-
-    bool isAlone() const {
-        return successor_list[0].id == myself.id;
-    }
-
-    bool needsCertificate() const { return !has_cert; }
-    const uint8_t* getCertData() const { return my_cert; }
-    uint32_t getCertLen() const { return my_cert_len; }
-
 private:
-    NodeInfo myself;
-    NodeInfo predecessor;
-    bool predecessor_valid;
-    NodeInfo successor_list[SUCLIST_SIZE];
-    uint8_t my_cert[2048];
-    uint32_t my_cert_len = 0;
-    bool has_cert = false;
+    int next_finger;
+    uint64_t revision;  // bumped by every change of the table
+    uint64_t published_revision;
+    RcuPtr<RoutingTable> published;
 };
 
 #endif
\ No newline at end of file
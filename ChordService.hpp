@@ -0,0 +1,905 @@
+#ifndef CHORDSERVICE_H
+#define CHORDSERVICE_H
+
+#include "CertGossip.hpp"
+#include "ChordNode.hpp"
+#include "FailureDetector.hpp"
+#include "Handoff.hpp"
+#include "KVStore.hpp"
+#include "Metrics.hpp"
+#include "ReadCache.hpp"
+#include "Transport.hpp"
+#include "Replicator.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+* Chord protocol on top of a transport: answers inbound requests and runs join, stabilize
+* and fix-fingers as non-blocking RPC chains. At most one instance of each maintenance
+* step is in flight, a slow peer delays only its own step.
+*/
+class ChordService {
+public:
+    typedef std::function<void(bool ok, const NodeInfo& owner)> LookupCallback;
+    // ok[i] and owners[i] belong to the i-th target of the batch.
+    typedef std::function<void(const std::vector<uint8_t>& ok, const std::vector<NodeInfo>& owners)> BatchLookupCallback;
+
+    /**
+    * Iterative: we ask every hop ourselves, one round trip each. Recursive: each hop passes
+    * the request on and the owner answers us directly, one message per hop plus the answer.
+    */
+    enum LookupMode { LOOKUP_ITERATIVE, LOOKUP_RECURSIVE };
+
+    ChordService(ChordNode& node, Transport& transport, KVStore& store, Replicator& replicator, Handoff& handoff, CertGossip& certs)
+        : node(node), transport(transport), store(store), replicator(replicator), handoff(handoff), certs(certs), cache(nullptr), has_bootstrap(false),
+          join_pending(0), join_retry_ms(JOIN_RETRY_MIN_MS), stabilize_in_flight(false), fix_in_flight(false), check_pred_in_flight(false),
+          lookup_mode(LOOKUP_ITERATIVE), fix_interval_ms(MIN_FIX_INTERVAL_MS),
+          fix_pass_changed(false) {
+        uint64_t now = transport.nowMs();
+        started_ms = now;
+        next_lookup_id = (uint32_t)now;
+        last_join_attempt = 0;
+        last_stabilize = now;
+        last_fix_fingers = now;
+        last_check_pred = now;
+        last_successor = node.getSuccessor().id;
+        last_predecessor = node.getPredecessor().id;
+        transport.onRequest([this](const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+            handleRequest(from, hdr, payload);
+        });
+    }
+
+    void setBootstrap(const NodeInfo& bootstrap_node) {
+        bootstraps.assign(1, bootstrap_node);
+        has_bootstrap = true;
+        node.setBootstrap(bootstrap_node);
+    }
+
+    // Another node to ask in parallel with the bootstrap when joining.
+    void addBootstrap(const NodeInfo& alternative) {
+        if (!has_bootstrap) setBootstrap(alternative);
+        else bootstraps.push_back(alternative);
+    }
+
+    /**
+    * Counts uptime and the startup timeline from start_ms on the transport clock, the
+    * start of the process, instead of from the construction of the service. The time in
+    * between was spent on discovery.
+    */
+    void setStartTime(uint64_t start_ms) {
+        started_ms = start_ms;
+        metrics.discovered_ms.store(std::max<uint64_t>(1, transport.nowMs() - start_ms), std::memory_order_relaxed);
+    }
+
+    // Mode of the lookups we start ourselves, for fix fingers and store routing.
+    void setLookupMode(LookupMode mode) { lookup_mode = mode; }
+
+    // Answer relayed reads from cache while their copy is fresh, nullptr turns it off.
+    // The cache may be shared by the virtual nodes of a host.
+    void setReadCache(ReadCache* read_cache) { cache = read_cache; }
+
+    // Heartbeat statistics of our neighbours, and the phi at which they count as failed.
+    const FailureDetector& failureDetector() const { return health; }
+    void setPhiThreshold(double phi) { health.setThreshold(phi); }
+
+    /**
+    * Answers the requests that only read the routing table, from table and through via.
+    * Returns false for everything else. Worker threads call it with a published copy of
+    * the table, it touches nothing but the table and atomic counters.
+    */
+    bool serveFromTable(const RoutingTable& table, Transport& via, const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+        if (hdr.type == MSG_FIND_SUCCESSOR) {
+            metrics.lookups_served.fetch_add(1, std::memory_order_relaxed);
+            const FindSuccessorPayload* req = (const FindSuccessorPayload*)payload;
+            bool is_owner = false;
+            FindSuccessorResponsePayload resp;
+            resp.node = table.nextHop(req->target_id, &is_owner);
+            resp.is_owner = is_owner ? 1 : 0;
+            via.reply(from, MSG_FIND_SUCCESSOR_RESPONSE, &resp, sizeof(resp));
+        }
+        else if (hdr.type == MSG_FIND_SUCCESSOR_BATCH && hdr.payload_len > 0 && !(((const FindSuccessorBatchPayload*)payload)->flags & LOOKUP_FLAG_RESOLVE)) {
+            const FindSuccessorBatchPayload* req = (const FindSuccessorBatchPayload*)payload;
+            uint32_t header_len = offsetof(FindSuccessorBatchPayload, targets);
+            if (hdr.payload_len < header_len || req->count > MAX_BATCH_TARGETS || hdr.payload_len - header_len < req->count * sizeof(Sha1ID)) return true;
+            metrics.lookups_served.fetch_add(req->count, std::memory_order_relaxed);
+            FindSuccessorBatchResponsePayload resp;
+            resp.count = req->count;
+            for (uint16_t i = 0; i < req->count; ++i) {
+                bool is_owner = false;
+                resp.results[i].node = table.nextHop(req->targets[i], &is_owner);
+                resp.results[i].is_owner = is_owner ? 1 : 0;
+            }
+            via.reply(from, MSG_FIND_SUCCESSOR_BATCH_RESPONSE, &resp,
+                      offsetof(FindSuccessorBatchResponsePayload, results) + resp.count * sizeof(FindSuccessorResponsePayload));
+        }
+        else if (hdr.type == MSG_GET_PREDECESSOR) {
+            if (table.predecessor_valid) {
+                NodeInfoPayload resp; resp.node = table.predecessor;
+                via.reply(from, MSG_GET_PREDECESSOR_RESPONSE, &resp, sizeof(resp));
+            } else {
+                via.reply(from, MSG_GET_PREDECESSOR, nullptr, 0);
+            }
+        }
+        else if (hdr.type == MSG_GET_SUCLIST) {
+            NodeListPayload resp;
+            table.getMySuccessorList(resp.nodes, &resp.count);
+            via.reply(from, MSG_GET_SUCLIST_RESPONSE, &resp, sizeof(resp));
+        }
+        else if (hdr.type == MSG_PING) {
+            via.reply(from, MSG_PING, nullptr, 0);
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    void handleRequest(const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+        if (serveFromTable(node.table(), transport, from, hdr, payload)) {
+            return;
+        }
+        else if (hdr.type == MSG_STABILIZE) {
+            if (hdr.payload_len < sizeof(NodeInfoPayload)) return;
+            // Answered as of before the notify, like the GET_PREDECESSOR it replaces.
+            const NodeInfo& asker = ((const NodeInfoPayload*)payload)->node;
+            StabilizeResponsePayload resp;
+            resp.has_predecessor = node.hasPredecessor() ? 1 : 0;
+            resp.predecessor = node.getPredecessor();
+            if (closerNotifier(asker, &resp.predecessor)) resp.has_predecessor = 1;
+            node.getMySuccessorList(resp.nodes, &resp.count);
+            transport.reply(from, MSG_STABILIZE_RESPONSE, &resp, sizeof(resp));
+            handleNotify(asker);
+        }
+        else if (hdr.type == MSG_NOTIFY) {
+            handleNotify(((const NodeInfoPayload*)payload)->node);
+        }
+        else if (hdr.type == MSG_LEAVE) {
+            if (hdr.payload_len < sizeof(LeavePayload)) return;
+            const LeavePayload* leave = (const LeavePayload*)payload;
+            node.handleLeave(leave->leaving, leave->replacement);
+        }
+        else if (hdr.type == MSG_GET_STATS) {
+            uint8_t format = hdr.payload_len >= sizeof(StatsRequestPayload) ? ((const StatsRequestPayload*)payload)->format : STATS_FORMAT_BINARY;
+            StatsPayload stats;
+            uint32_t len = fillStats(metrics, transport.rpcMetrics(), transport.nowMs() - started_ms, &stats);
+            if (format == STATS_FORMAT_TEXT) {
+                std::string text = formatPrometheus(stats);
+                transport.reply(from, MSG_GET_STATS_RESPONSE, text.data(), (uint32_t)text.size());
+            } else {
+                transport.reply(from, MSG_GET_STATS_RESPONSE, &stats, len);
+            }
+        }
+        else if (hdr.type == MSG_FIND_SUCCESSOR_RECURSIVE) {
+            if (hdr.payload_len < sizeof(RecursiveLookupPayload)) return;
+            metrics.lookups_served.fetch_add(1, std::memory_order_relaxed);
+            // Acknowledged before routing it on, so the sender only waits for one hop.
+            transport.reply(from, MSG_FIND_SUCCESSOR_RECURSIVE_ACK, nullptr, 0);
+            routeRecursive(*(const RecursiveLookupPayload*)payload);
+        }
+        else if (hdr.type == MSG_LOOKUP_RESULT) {
+            if (hdr.payload_len < sizeof(LookupResultPayload)) return;
+            const LookupResultPayload* res = (const LookupResultPayload*)payload;
+            completeLookup(res->lookup_id, res->node);
+        }
+        else if (hdr.type == MSG_FIND_SUCCESSOR_BATCH) {
+            handleFindSuccessorBatch(from, payload, hdr.payload_len);
+        }
+        else if (hdr.type == MSG_PUT || hdr.type == MSG_GET || hdr.type == MSG_DELETE) {
+            handleStoreRequest(from, hdr.type, payload, hdr.payload_len);
+        }
+        else if (!handoff.handleRequest(from, hdr, payload) && !certs.handleRequest(from, hdr, payload)) {
+            replicator.handleRequest(from, hdr, payload);
+        }
+    }
+
+    /**
+    * Runs the periodic maintenance steps that are due. Never blocks, results arrive
+    * through transport callbacks.
+    */
+    void tick() {
+        uint64_t now = transport.nowMs();
+
+        if (node.isAlone() && has_bootstrap && join_pending == 0 && (last_join_attempt == 0 || now - last_join_attempt > join_retry_ms)) {
+            last_join_attempt = now;
+            join();
+        }
+        if (metrics.joined_ms.load(std::memory_order_relaxed) == 0 && (!node.isAlone() || !has_bootstrap)) {
+            uint64_t ms = std::max<uint64_t>(1, now - started_ms);
+            metrics.joined_ms.store(ms, std::memory_order_relaxed);
+            LOG_INFO("[STARTUP] " << (has_bootstrap ? "Joined the ring " : "Started the ring ") << ms << " ms after start");
+        }
+        if (metrics.cert_ms.load(std::memory_order_relaxed) == 0 && certs.version() != 0) {
+            uint64_t ms = std::max<uint64_t>(1, now - started_ms);
+            metrics.cert_ms.store(ms, std::memory_order_relaxed);
+            LOG_INFO("[STARTUP] Certificate version " << certs.version() << " held " << ms << " ms after start");
+        }
+
+        if (!stabilize_in_flight && now - last_stabilize > STABILIZE_INTERVAL_MS) {
+            last_stabilize = now;
+            stabilize();
+        }
+
+        // New neighbours mean nodes are joining or failing, fingers elsewhere move too.
+        if (node.getSuccessor().id != last_successor || node.getPredecessor().id != last_predecessor) {
+            last_successor = node.getSuccessor().id;
+            last_predecessor = node.getPredecessor().id;
+            fix_interval_ms = MIN_FIX_INTERVAL_MS;
+            fix_pass_changed = true;
+        }
+        if (!fix_in_flight && now - last_fix_fingers > fix_interval_ms) {
+            last_fix_fingers = now;
+            fixFingers();
+        }
+
+        if (!check_pred_in_flight && now - last_check_pred > CHECK_PRED_INTERVAL_MS) {
+            last_check_pred = now;
+            checkPredecessor();
+        }
+
+        expireLookups();
+        replicator.tick();
+        certs.tick();
+    }
+
+    /**
+    * Recursive lookups without an answer in time are started again iteratively, the
+    * request or the answer may have been lost on any hop.
+    */
+    void expireLookups() {
+        uint64_t now = transport.nowMs();
+        for (auto it = pending_lookups.begin(); it != pending_lookups.end();) {
+            if (now < it->second.deadline) {
+                ++it;
+                continue;
+            }
+            PendingLookup expired = it->second;
+            it = pending_lookups.erase(it);
+            findSuccessor(expired.target_id, LOOKUP_ITERATIVE, expired.cb);
+        }
+    }
+
+    /**
+    * Graceful shutdown: streams our range to the successor, then tells both neighbours
+    * to link up with each other. done is called when that is finished or failed.
+    */
+    void leave(std::function<void()> done) {
+        if (node.isAlone()) {
+            done();
+            return;
+        }
+        NodeInfo suc = node.getSuccessor();
+        if (!node.hasPredecessor()) {
+            sendLeaveNotices();
+            done();
+            return;
+        }
+        handoff.pushRange(suc, node.getPredecessor().id, node.getMyself().id, [this, done](bool) {
+            sendLeaveNotices();
+            done();
+        });
+    }
+
+    void findSuccessor(const Sha1ID& target_id, LookupCallback cb) {
+        findSuccessor(target_id, lookup_mode, cb);
+    }
+
+    /**
+    * Lookup starting at our own routing table, mode chosen per call.
+    */
+    void findSuccessor(const Sha1ID& target_id, LookupMode mode, LookupCallback cb) {
+        bool is_owner = false;
+        NodeInfo hop = nextHop(target_id, &is_owner);
+        if (is_owner) {
+            cb(true, hop);
+            return;
+        }
+        if (mode == LOOKUP_ITERATIVE) {
+            findSuccessorFrom(hop, target_id, 200, cb);
+            return;
+        }
+
+        RecursiveLookupPayload req;
+        req.target_id = target_id;
+        req.origin = node.getMyself();
+        req.lookup_id = next_lookup_id++;
+        req.hops = 1;
+        PendingLookup& pending = pending_lookups[req.lookup_id];
+        pending.target_id = target_id;
+        pending.deadline = transport.nowMs() + RECURSIVE_LOOKUP_TIMEOUT_MS;
+        pending.cb = cb;
+        forwardLookup(hop, req);
+    }
+
+    /**
+    * Resolves many keys at once. Targets that share the next hop travel to it in one
+    * MSG_FIND_SUCCESSOR_BATCH, so a bulk lookup costs about one RPC per distinct hop
+    * instead of one per key and hop. cb is called once all targets are resolved or failed.
+    */
+    void findSuccessors(const std::vector<Sha1ID>& targets, BatchLookupCallback cb) {
+        std::shared_ptr<BatchLookup> batch(new BatchLookup());
+        batch->targets = targets;
+        batch->ok.assign(targets.size(), 0);
+        batch->owners.resize(targets.size());
+        batch->in_flight = 0;
+        batch->cb = cb;
+
+        std::vector<size_t> all(targets.size());
+        for (size_t i = 0; i < all.size(); ++i) all[i] = i;
+        routeBatch(batch, all, MAX_LOOKUP_HOPS);
+        if (batch->in_flight == 0) cb(batch->ok, batch->owners);
+    }
+
+    // Load counters for the distribution report: FIND_SUCCESSOR requests answered and
+    // store requests served as owner.
+    uint64_t lookupsServed() const { return metrics.lookups_served.load(std::memory_order_relaxed); }
+    uint64_t storeOpsServed() const { return metrics.store_ops_served.load(std::memory_order_relaxed); }
+
+    const ChordMetrics& chordMetrics() const { return metrics; }
+
+    /**
+    * Asks start for target_id and follows the next-hop replies until a node answers as
+    * owner. Unreachable hops are dropped from the finger table.
+    */
+    void findSuccessorFrom(const NodeInfo& start, const Sha1ID& target_id, uint16_t timeout_ms, LookupCallback cb) {
+        lookupStep(start, target_id, timeout_ms, MAX_LOOKUP_HOPS, cb);
+    }
+
+private:
+    static const uint32_t STABILIZE_INTERVAL_MS = 200;
+    static const uint16_t JOIN_TIMEOUT_MS = 1000;
+    static const uint32_t JOIN_RETRY_MIN_MS = 250;
+    static const uint32_t JOIN_RETRY_MAX_MS = 4000;
+    static const size_t MAX_RECENT_NOTIFIERS = 1024;
+    static const uint32_t NOTIFIER_TTL_MS = 5000;
+    static const uint32_t CHECK_PRED_INTERVAL_MS = 500;
+    static const uint32_t MIN_FIX_INTERVAL_MS = 50;
+    static const uint32_t MAX_FIX_INTERVAL_MS = 500;
+    static const uint32_t RECURSIVE_LOOKUP_TIMEOUT_MS = 1000;
+
+    struct RecentNotifier {
+        NodeInfo node;
+        uint64_t heard;
+    };
+
+    struct PendingLookup {
+        Sha1ID target_id;
+        uint64_t deadline;
+        LookupCallback cb;
+    };
+
+    // Routing step from our table, see RoutingTable::nextHop().
+    NodeInfo nextHop(const Sha1ID& target_id, bool* is_owner) {
+        return node.nextHop(target_id, is_owner);
+    }
+
+    /**
+    * One step of a recursive lookup: answer the originator if we know the owner, otherwise
+    * pass the request to the closest preceding node.
+    */
+    void routeRecursive(RecursiveLookupPayload req) {
+        bool is_owner = false;
+        NodeInfo hop = nextHop(req.target_id, &is_owner);
+        if (is_owner) {
+            if (req.origin.id == node.getMyself().id) {
+                completeLookup(req.lookup_id, hop);
+                return;
+            }
+            LookupResultPayload res;
+            res.lookup_id = req.lookup_id;
+            res.node = hop;
+            res.hops = req.hops;
+            transport.send(req.origin, MSG_LOOKUP_RESULT, &res, sizeof(res));
+            return;
+        }
+        if (req.hops >= MAX_LOOKUP_HOPS) return;  // the originator times out
+        ++req.hops;
+        forwardLookup(hop, req);
+    }
+
+    void forwardLookup(const NodeInfo& hop, const RecursiveLookupPayload& req) {
+        transport.call(hop, MSG_FIND_SUCCESSOR_RECURSIVE, &req, sizeof(req), 200,
+            [this, hop, req](bool ok, const PacketHeader&, const uint8_t*) {
+                if (ok) return;
+                // Route around the dead hop, the hop count still bounds the retries.
+                node.removeNode(hop);
+                routeRecursive(req);
+            });
+    }
+
+    void completeLookup(uint32_t lookup_id, const NodeInfo& owner) {
+        auto it = pending_lookups.find(lookup_id);
+        if (it == pending_lookups.end()) return;  // expired, or not ours
+        LookupCallback cb = it->second.cb;
+        pending_lookups.erase(it);
+        cb(true, owner);
+    }
+
+    struct BatchLookup {
+        std::vector<Sha1ID> targets;
+        std::vector<uint8_t> ok;
+        std::vector<NodeInfo> owners;
+        int in_flight;
+        BatchLookupCallback cb;
+    };
+
+    // Batches with LOOKUP_FLAG_RESOLVE, the others are answered by serveFromTable().
+    void handleFindSuccessorBatch(const ReplyTo& from, const uint8_t* payload, uint32_t len) {
+        const FindSuccessorBatchPayload* req = (const FindSuccessorBatchPayload*)payload;
+        uint32_t header_len = offsetof(FindSuccessorBatchPayload, targets);
+        if (len < header_len || req->count > MAX_BATCH_TARGETS || len - header_len < req->count * sizeof(Sha1ID)) return;
+        metrics.lookups_served.fetch_add(req->count, std::memory_order_relaxed);
+
+        std::vector<Sha1ID> targets(req->targets, req->targets + req->count);
+        findSuccessors(targets, [this, from](const std::vector<uint8_t>& ok, const std::vector<NodeInfo>& owners) {
+            FindSuccessorBatchResponsePayload resp;
+            resp.count = (uint16_t)owners.size();
+            for (size_t i = 0; i < owners.size(); ++i) {
+                resp.results[i].node = owners[i];
+                resp.results[i].is_owner = ok[i];
+            }
+            transport.reply(from, MSG_FIND_SUCCESSOR_BATCH_RESPONSE, &resp,
+                            offsetof(FindSuccessorBatchResponsePayload, results) + resp.count * sizeof(FindSuccessorResponsePayload));
+        });
+    }
+
+    /**
+    * Resolves what our own table can answer and sends the rest, grouped by next hop, as
+    * sub-batches of at most MAX_BATCH_TARGETS.
+    */
+    void routeBatch(const std::shared_ptr<BatchLookup>& batch, const std::vector<size_t>& indices, int hops_left) {
+        std::map<Sha1ID, std::pair<NodeInfo, std::vector<size_t>>> groups;
+        for (size_t i : indices) {
+            bool is_owner = false;
+            NodeInfo hop = nextHop(batch->targets[i], &is_owner);
+            if (is_owner) {
+                batch->ok[i] = 1;
+                batch->owners[i] = hop;
+                continue;
+            }
+            std::pair<NodeInfo, std::vector<size_t>>& g = groups[hop.id];
+            g.first = hop;
+            g.second.push_back(i);
+        }
+        for (auto& g : groups) sendBatch(batch, g.second.first, g.second.second, hops_left);
+    }
+
+    void sendBatch(const std::shared_ptr<BatchLookup>& batch, const NodeInfo& hop, const std::vector<size_t>& indices, int hops_left) {
+        if (hops_left == 0) return;  // the targets stay failed
+        for (size_t off = 0; off < indices.size(); off += MAX_BATCH_TARGETS) {
+            std::vector<size_t> chunk(indices.begin() + off, indices.begin() + std::min(indices.size(), off + MAX_BATCH_TARGETS));
+            FindSuccessorBatchPayload req;
+            req.flags = 0;
+            req.count = (uint16_t)chunk.size();
+            for (size_t k = 0; k < chunk.size(); ++k) req.targets[k] = batch->targets[chunk[k]];
+
+            ++batch->in_flight;
+            transport.call(hop, MSG_FIND_SUCCESSOR_BATCH, &req, offsetof(FindSuccessorBatchPayload, targets) + req.count * sizeof(Sha1ID), 1000,
+                [this, batch, hop, chunk, hops_left](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                    const FindSuccessorBatchResponsePayload* resp = (const FindSuccessorBatchResponsePayload*)payload;
+                    uint32_t header_len = offsetof(FindSuccessorBatchResponsePayload, results);
+                    if (!ok) {
+                        // Route around the dead hop from our own table.
+                        node.removeNode(hop);
+                        routeBatch(batch, chunk, hops_left - 1);
+                    } else if (h.type == MSG_FIND_SUCCESSOR_BATCH_RESPONSE && h.payload_len >= header_len && resp->count == chunk.size() &&
+                               h.payload_len - header_len >= resp->count * sizeof(FindSuccessorResponsePayload)) {
+                        std::map<Sha1ID, std::pair<NodeInfo, std::vector<size_t>>> groups;
+                        for (size_t k = 0; k < chunk.size(); ++k) {
+                            const FindSuccessorResponsePayload& r = resp->results[k];
+                            if (r.is_owner) {
+                                batch->ok[chunk[k]] = 1;
+                                batch->owners[chunk[k]] = r.node;
+                            } else if (r.node.id != hop.id) {
+                                std::pair<NodeInfo, std::vector<size_t>>& g = groups[r.node.id];
+                                g.first = r.node;
+                                g.second.push_back(chunk[k]);
+                            }
+                        }
+                        for (auto& g : groups) sendBatch(batch, g.second.first, g.second.second, hops_left - 1);
+                    }
+                    if (--batch->in_flight == 0) batch->cb(batch->ok, batch->owners);
+                });
+        }
+    }
+
+    /**
+    * Serves a store request if the key is ours, otherwise looks up the owner and relays
+    * the request and its response. With a read cache, a GET is answered from a fresh
+    * cached copy and the values the owner returns are kept, a relayed write drops the copy.
+    */
+    void handleStoreRequest(const ReplyTo& from, uint8_t type, const uint8_t* payload, uint32_t len) {
+        if (len < sizeof(KeyPayload)) {
+            replyStatus(from, type + 1, STORE_BAD_REQUEST);
+            return;
+        }
+        const KeyPayload* req = (const KeyPayload*)payload;
+        if ((req->flags & STORE_FLAG_FORWARDED) || node.isResponsibleFor(req->key)) {
+            serveStoreRequest(from, type, payload, len);
+            return;
+        }
+        if (cache && type == MSG_GET) {
+            ValuePayload resp;
+            if (cache->get(req->key, transport.nowMs(), resp.data, MAX_VALUE_LEN, &resp.value_len, &resp.version)) {
+                metrics.cache_hits.fetch_add(1, std::memory_order_relaxed);
+                resp.status = STORE_OK;
+                transport.reply(from, MSG_GET_RESPONSE, &resp, offsetof(ValuePayload, data) + resp.value_len);
+                return;
+            }
+            metrics.cache_misses.fetch_add(1, std::memory_order_relaxed);
+        } else if (cache) {
+            cache->invalidate(req->key);
+        }
+
+        Sha1ID key = req->key;
+        std::vector<uint8_t> request(payload, payload + len);
+        request[offsetof(KeyPayload, flags)] |= STORE_FLAG_FORWARDED;
+        findSuccessor(key, [this, from, type, key, request](bool ok, const NodeInfo& owner) {
+            if (!ok) {
+                replyStatus(from, type + 1, STORE_UNREACHABLE);
+                return;
+            }
+            if (owner.id == node.getMyself().id) {
+                serveStoreRequest(from, type, request.data(), request.size());
+                return;
+            }
+            transport.call(owner, type, request.data(), request.size(), 500, [this, from, type, key](bool ok, const PacketHeader& h, const uint8_t* resp) {
+                if (!ok) {
+                    replyStatus(from, type + 1, STORE_UNREACHABLE);
+                    return;
+                }
+                const ValuePayload* value = (const ValuePayload*)resp;
+                if (cache && h.type == MSG_GET_RESPONSE && h.payload_len >= offsetof(ValuePayload, data) && value->status == STORE_OK &&
+                    value->value_len <= MAX_VALUE_LEN && h.payload_len - offsetof(ValuePayload, data) >= value->value_len) {
+                    cache->insert(key, value->data, value->value_len, value->version, transport.nowMs());
+                }
+                transport.reply(from, h.type, resp, h.payload_len);
+            });
+        });
+    }
+
+    void serveStoreRequest(const ReplyTo& from, uint8_t type, const uint8_t* payload, uint32_t len) {
+        const KeyPayload* req = (const KeyPayload*)payload;
+        metrics.store_ops_served.fetch_add(1, std::memory_order_relaxed);
+        if (type == MSG_PUT) {
+            const PutPayload* put = (const PutPayload*)payload;
+            uint32_t header_len = offsetof(PutPayload, data);
+            if (len < header_len || put->value_len > MAX_VALUE_LEN || len - header_len < put->value_len) {
+                replyStatus(from, MSG_PUT_RESPONSE, STORE_BAD_REQUEST);
+                return;
+            }
+            StoreStatus st = store.put(put->key, put->data, put->value_len, wallClockMs());
+            if (st == STORE_OK) replicator.replicate(put->key);
+            replyStatus(from, MSG_PUT_RESPONSE, st);
+        }
+        else if (type == MSG_GET) {
+            ValuePayload resp;
+            resp.value_len = 0;
+            resp.version = 0;
+            resp.status = store.get(req->key, resp.data, MAX_VALUE_LEN, &resp.value_len, &resp.version);
+            transport.reply(from, MSG_GET_RESPONSE, &resp, offsetof(ValuePayload, data) + resp.value_len);
+        }
+        else if (type == MSG_DELETE) {
+            StoreStatus st = store.remove(req->key, wallClockMs());
+            if (st == STORE_OK) replicator.replicate(req->key);
+            replyStatus(from, MSG_DELETE_RESPONSE, st);
+        }
+    }
+
+    void sendLeaveNotices() {
+        NodeInfo suc = node.getSuccessor();
+        LeavePayload msg;
+        msg.leaving = node.getMyself();
+        if (node.hasPredecessor()) {
+            msg.replacement = node.getPredecessor();
+        } else {
+            std::memset(&msg.replacement, 0, sizeof(msg.replacement));
+        }
+        transport.send(suc, MSG_LEAVE, &msg, sizeof(msg));
+        if (node.hasPredecessor()) {
+            msg.replacement = suc;
+            transport.send(node.getPredecessor(), MSG_LEAVE, &msg, sizeof(msg));
+        }
+    }
+
+    void replyStatus(const ReplyTo& from, uint8_t type, uint8_t status) {
+        StatusPayload resp; resp.status = status;
+        transport.reply(from, type, &resp, sizeof(resp));
+    }
+
+    void lookupStep(const NodeInfo& hop, const Sha1ID& target_id, uint16_t timeout_ms, int hops_left, LookupCallback cb, bool retry = false) {
+        NodeInfo none;
+        std::memset(&none, 0, sizeof(none));
+        if (hops_left == 0) {
+            cb(false, none);
+            return;
+        }
+
+        FindSuccessorPayload req; req.target_id = target_id;
+        transport.call(hop, MSG_FIND_SUCCESSOR, &req, sizeof(req), timeout_ms,
+            [this, hop, target_id, timeout_ms, hops_left, cb, none, retry](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                if (!ok && !retry) {
+                    // One lost message is no reason to drop the hop, ask once more.
+                    lookupStep(hop, target_id, timeout_ms, hops_left, cb, true);
+                    return;
+                }
+                if (!ok) {
+                    node.removeNode(hop);
+                    // Route around the dead hop from our own table, as batches do. Not while
+                    // joining, our table knows only ourselves then.
+                    bool is_owner = false;
+                    NodeInfo next = node.findSuccessorNextHop(target_id, &is_owner);
+                    if (node.isAlone() || next.id == hop.id) cb(false, none);
+                    else if (is_owner) cb(true, next);
+                    else lookupStep(next, target_id, timeout_ms, hops_left - 1, cb);
+                    return;
+                }
+                if (h.type != MSG_FIND_SUCCESSOR_RESPONSE || h.payload_len < sizeof(NodeInfoPayload)) {
+                    cb(false, none);
+                    return;
+                }
+                const FindSuccessorResponsePayload* resp = (const FindSuccessorResponsePayload*)payload;
+                if (h.payload_len < sizeof(FindSuccessorResponsePayload) || resp->is_owner) {
+                    cb(true, resp->node);
+                    return;
+                }
+                if (resp->node.id == hop.id) {
+                    cb(false, none);
+                    return;
+                }
+                lookupStep(resp->node, target_id, timeout_ms, hops_left - 1, cb);
+            });
+    }
+
+    /**
+    * Asks all bootstrap candidates at once, the first answer wins. A candidate that went
+    * away or is slow costs nothing while another one answers. When all fail the next
+    * attempt waits twice as long as the last one, so a crowd of nodes started together
+    * does not hammer a bootstrap that is not up yet.
+    */
+    void join() {
+        join_pending = (int)bootstraps.size();
+        metrics.join_attempts.fetch_add(1, std::memory_order_relaxed);
+        for (const NodeInfo& candidate : bootstraps) {
+            findSuccessorFrom(candidate, node.getMyself().id, JOIN_TIMEOUT_MS, [this](bool ok, const NodeInfo& suc) {
+                --join_pending;
+                if (ok && node.isAlone()) {
+                    joined(suc);
+                } else if (join_pending == 0 && node.isAlone()) {
+                    join_retry_ms = std::min<uint32_t>(join_retry_ms * 2, (uint32_t)JOIN_RETRY_MAX_MS);
+                }
+            });
+        }
+    }
+
+    void joined(const NodeInfo& suc) {
+        join_retry_ms = JOIN_RETRY_MIN_MS;
+        metrics.joins.fetch_add(1, std::memory_order_relaxed);
+
+        node.setSuccessor(suc);
+        LOG_INFO("[JOIN] Successor found: " << inet_ntoa(*(in_addr*)&suc.ip));
+
+        // Fetches the certificate, or hands on a newer one we were started with.
+        certs.exchange(suc);
+    }
+
+    void stabilize() {
+        NodeInfo suc = node.getSuccessor();
+        NodeInfo myself = node.getMyself();
+        if (suc.id == myself.id) {
+            // Only the first node closes the ring with whoever joined it. A node still
+            // waiting for its own join would form a second ring with its joiners.
+            if (!has_bootstrap && node.hasPredecessor() && node.getPredecessor().id != myself.id) {
+                node.setSuccessor(node.getPredecessor());
+            }
+            return;
+        }
+
+        // One exchange: our notify goes out, the successor's predecessor and list come back.
+        stabilize_in_flight = true;
+        uint64_t sent = transport.nowMs();
+        NodeInfoPayload me; me.node = myself;
+        transport.call(suc, MSG_STABILIZE, &me, sizeof(me), health.timeoutFor(suc), [this, suc, sent](bool ok, const PacketHeader& h, const uint8_t* payload) {
+            stabilize_in_flight = false;
+            if (node.getSuccessor().id != suc.id) return;
+            uint64_t now = transport.nowMs();
+            if (!ok) {
+                if (!suspect("Successor", suc)) {
+                    // Ask again one timeout from now. A refused connection fails at once,
+                    // retrying right away would spin.
+                    last_stabilize = now - STABILIZE_INTERVAL_MS + health.timeoutFor(suc);
+                    return;
+                }
+                transport.evict(suc);
+                node.handleSuccessorFailure();
+                metrics.successor_failovers.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            health.onReply(suc, now - sent, now);
+            if (h.type != MSG_STABILIZE_RESPONSE || h.payload_len < sizeof(StabilizeResponsePayload)) return;
+            const StabilizeResponsePayload* resp = (const StabilizeResponsePayload*)payload;
+            if (resp->has_predecessor) node.handleStabilizeResponse(resp->predecessor);
+            if (node.getSuccessor().id != suc.id) {
+                metrics.stabilize_changes.fetch_add(1, std::memory_order_relaxed);
+                // Closer successor found, ask it right away instead of waiting a full period.
+                // A node that joined far behind its place walks back one node per round.
+                stabilize();
+                return;
+            }
+            node.updateSuccessorList(resp->nodes, std::min<int>(resp->count, SUCLIST_SIZE));
+        });
+    }
+
+    /**
+    * Drops a dead predecessor. Otherwise stabilize of the node before it would keep
+    * adopting the dead node as successor, and the predecessor range stays unowned.
+    * A predecessor that stabilized with us since the last check is known to be alive,
+    * only a quiet one is probed.
+    */
+    void checkPredecessor() {
+        if (!node.hasPredecessor()) return;
+        NodeInfo pred = node.getPredecessor();
+        if (pred.id == node.getMyself().id) return;
+        uint64_t sent = transport.nowMs();
+        const PeerHealth* ph = health.get(pred);
+        if (ph && ph->misses == 0 && sent - ph->last_heard < CHECK_PRED_INTERVAL_MS) return;
+
+        check_pred_in_flight = true;
+        transport.probe(pred, health.timeoutFor(pred), [this, pred, sent](bool ok, const PacketHeader&, const uint8_t*) {
+            check_pred_in_flight = false;
+            if (!node.hasPredecessor() || node.getPredecessor().id != pred.id) return;
+            uint64_t now = transport.nowMs();
+            if (ok) {
+                health.onReply(pred, now - sent, now);
+                return;
+            }
+            if (!suspect("Predecessor", pred)) {
+                last_check_pred = now - CHECK_PRED_INTERVAL_MS + health.timeoutFor(pred);
+                return;
+            }
+            LOG_WARN("[FAILOVER] Predecessor " << pred.id << " unreachable!");
+            transport.evict(pred);
+            node.invalidatePredecessor();
+            node.removeNode(pred);
+            metrics.predecessor_failovers.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+
+    /**
+    * Finds a node that notified us recently and lies after asker but before our
+    * predecessor, the better answer to its stabilize. Nodes that join through us at the
+    * same time all start with us as successor and notify us. Offered only our predecessor
+    * each of them walks back one node per round, on a cold start of N nodes N rounds.
+    * All notifiers of the last seconds are kept: offered only some of them, the nodes
+    * they skip can close into a second ring interleaved with the first one, which
+    * stabilize never repairs.
+    */
+    bool closerNotifier(const NodeInfo& asker, NodeInfo* out) const {
+        NodeInfo bound = node.getMyself();
+        if (node.hasPredecessor() && in_interval(node.getPredecessor().id, asker.id, bound.id)) bound = node.getPredecessor();
+        bool found = false;
+        uint64_t now = transport.nowMs();
+        for (const RecentNotifier& n : notifiers) {
+            if (now - n.heard > NOTIFIER_TTL_MS || n.node.id == bound.id) continue;
+            if (in_interval(n.node.id, asker.id, bound.id)) {
+                bound = n.node;
+                found = true;
+            }
+        }
+        if (found) *out = bound;
+        return found;
+    }
+
+    void rememberNotifier(const NodeInfo& n) {
+        uint64_t now = transport.nowMs();
+        notifiers.erase(std::remove_if(notifiers.begin(), notifiers.end(), [now](const RecentNotifier& r) {
+            return now - r.heard > NOTIFIER_TTL_MS;
+        }), notifiers.end());
+        size_t oldest = 0;
+        for (size_t i = 0; i < notifiers.size(); ++i) {
+            if (notifiers[i].node.id == n.id) {
+                notifiers[i].heard = now;
+                return;
+            }
+            if (notifiers[i].heard < notifiers[oldest].heard) oldest = i;
+        }
+        RecentNotifier fresh;
+        fresh.node = n;
+        fresh.heard = now;
+        if (notifiers.size() < MAX_RECENT_NOTIFIERS) notifiers.push_back(fresh);
+        else notifiers[oldest] = fresh;
+    }
+
+    void handleNotify(const NodeInfo& joiner) {
+        if (joiner.id != node.getMyself().id) rememberNotifier(joiner);
+        NodeInfo old_pred;
+        bool had_pred = false;
+        // A node between our old predecessor and us takes over that part of our range.
+        if (node.handleNotify(joiner, &old_pred, &had_pred) && had_pred && joiner.id != node.getMyself().id &&
+            old_pred.id != joiner.id) {
+            handoff.pushRange(joiner, old_pred.id, joiner.id, Handoff::DoneCallback());
+        }
+        // Our predecessor notifies us every stabilize round, that is its heartbeat.
+        if (node.hasPredecessor() && node.getPredecessor().id == joiner.id) health.onHeartbeat(joiner, transport.nowMs());
+    }
+
+    /**
+    * Records a missed heartbeat of a neighbour. Returns true if it is now considered
+    * failed, otherwise the caller retries it.
+    */
+    bool suspect(const char* role, const NodeInfo& peer) {
+        uint64_t now = transport.nowMs();
+        health.onTimeout(peer, now);
+        if (health.isFailed(peer, now)) {
+            LOG_WARN("[HEALTH] " << role << " " << peer.id << " failed after " << health.get(peer)->misses
+                                 << " missed heartbeats, phi " << health.phi(peer, now));
+            // Its entry stays: if a neighbour still lists it, the next miss fails at once.
+            return true;
+        }
+        if (health.get(peer)->misses == 1) {
+            LOG_WARN("[HEALTH] " << role << " " << peer.id << " suspected, phi " << health.phi(peer, now) << ", retrying");
+        }
+        return false;
+    }
+
+    /**
+    * Refreshes one finger. After a full pass over the table that changed nothing the
+    * ring is stable and the next pass runs at MAX_FIX_INTERVAL_MS. A changed finger or
+    * a failed lookup means the ring moved, refreshing goes back to full speed.
+    */
+    void fixFingers() {
+        if (node.isAlone()) return;
+        int i = node.getNextFingerToFix();
+        fix_in_flight = true;
+        findSuccessor(node.fingerStart(i), [this, i](bool ok, const NodeInfo& suc) {
+            fix_in_flight = false;
+            if (!ok || suc.id != node.getFinger(i).id) {
+                fix_pass_changed = true;
+                fix_interval_ms = MIN_FIX_INTERVAL_MS;
+            }
+            // On failure move on, retrying the same finger could stall all others.
+            if (ok) node.updateFinger(i, suc);
+            else node.skipFinger(i);
+            if (node.getNextFingerToFix() <= i) {
+                if (!fix_pass_changed) fix_interval_ms = MAX_FIX_INTERVAL_MS;
+                fix_pass_changed = false;
+            }
+        });
+    }
+
+    ChordNode& node;
+    Transport& transport;
+    KVStore& store;
+    Replicator& replicator;
+    Handoff& handoff;
+    CertGossip& certs;
+    ReadCache* cache;                   // nullptr: relayed reads always go to the owner
+    std::vector<NodeInfo> bootstraps;  // the preferred one first
+    bool has_bootstrap;
+    int join_pending;                   // join lookups in flight
+    uint32_t join_retry_ms;
+    bool stabilize_in_flight;
+    bool fix_in_flight;
+    bool check_pred_in_flight;
+    uint64_t last_join_attempt;
+    uint64_t last_stabilize;
+    uint64_t last_fix_fingers;
+    uint64_t last_check_pred;
+    uint64_t started_ms;
+    ChordMetrics metrics;
+    LookupMode lookup_mode;
+    uint32_t next_lookup_id;
+    std::map<uint32_t, PendingLookup> pending_lookups;
+    std::vector<RecentNotifier> notifiers;  // at most MAX_RECENT_NOTIFIERS, see closerNotifier()
+    FailureDetector health;
+    uint32_t fix_interval_ms;
+    bool fix_pass_changed;
+    Sha1ID last_successor;
+    Sha1ID last_predecessor;
+};
+
+#endif
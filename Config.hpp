@@ -0,0 +1,124 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "FailureDetector.hpp"
+#include "KVStore.hpp"
+#include "Log.hpp"
+#include "Net.h"
+#include "Rcu.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+constexpr int MAX_VNODES = 16;
+constexpr int MAX_WORKER_THREADS = RcuDomain::MAX_READERS;
+
+/**
+* Command line options. The only positional argument is an optional bootstrap IP, which
+* skips the broadcast discovery.
+*/
+struct NodeConfig {
+    uint32_t bootstrap_ip;
+    StoreConfig store;
+    int replicas;
+    std::string data_dir;  // empty: keys are kept in memory only
+    int vnodes;            // ring positions of this host, on consecutive ports
+    bool recursive_lookups;
+    double phi_threshold;  // suspicion at which a neighbour counts as failed
+    bool udp_heartbeat;
+    int log_level;         // LOG_LEVEL_*, lines below it are dropped
+    int workers;           // threads serving inbound connections, 0: all on the main thread
+    std::string cert_file; // empty: the first node uses the built-in root certificate
+    uint64_t cert_version; // a higher version replaces the certificate on all nodes
+    StoreConfig cache;     // read cache of relayed values, max_keys 0: off
+    uint32_t cache_ttl_ms; // how long a cached copy is served
+
+    NodeConfig() : bootstrap_ip(0), replicas(2), vnodes(1), recursive_lookups(false), phi_threshold(DEFAULT_PHI_THRESHOLD),
+                   udp_heartbeat(false), log_level(LOG_LEVEL_INFO), workers(0), cert_version(1), cache_ttl_ms(1000) {
+        cache.max_keys = 0;
+        cache.arena_bytes = 1024 * 1024;
+    }
+};
+
+inline void printUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [BOOTSTRAP_IP] [options]\n"
+              << "  --store-keys=N   maximum number of stored keys (default 4096)\n"
+              << "  --store-kb=N     value memory budget in KiB (default 8192)\n"
+              << "  --evict          evict least recently used keys when full instead of rejecting\n"
+              << "  --replicas=N     copies kept on successors, 0-" << SUCLIST_SIZE << " (default 2)\n"
+              << "  --data-dir=PATH  persist the store in PATH/store.log and reload it on restart\n"
+              << "  --vnodes=N       virtual nodes on ports 5000..5000+N-1, 1-" << MAX_VNODES << " (default 1)\n"
+              << "  --lookup=MODE    iterative or recursive routing of our own lookups (default iterative)\n"
+              << "  --phi=X          suspicion at which a neighbour counts as failed, higher is slower\n"
+              << "                   but survives longer hiccups (default " << DEFAULT_PHI_THRESHOLD << ")\n"
+              << "  --udp-heartbeat  probe quiet neighbours over UDP port 5002 instead of their connection\n"
+              << "  --log-level=L    debug, info, warn or error (default info)\n"
+              << "  --workers=N      threads answering lookups next to the main thread, 0-" << MAX_WORKER_THREADS << " (default 0)\n"
+              << "  --cert=PATH      certificate to spread through the ring, at most " << CERT_MAX_LEN << " bytes\n"
+              << "  --cert-version=N version of --cert, rotate by starting a node with a higher one (default 1)\n"
+              << "  --cache-keys=N   cache up to N values read through this node from other owners (default 0, off)\n"
+              << "  --cache-kb=N     value memory budget of the read cache in KiB (default 1024)\n"
+              << "  --cache-ttl-ms=N how long a cached value is served before the owner is asked again (default 1000)"
+              << std::endl;
+}
+
+inline bool parseArgs(int argc, char* argv[], NodeConfig* cfg) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strncmp(arg, "--store-keys=", 13) == 0) {
+            cfg->store.max_keys = (uint32_t)std::strtoul(arg + 13, nullptr, 10);
+        } else if (std::strncmp(arg, "--store-kb=", 11) == 0) {
+            cfg->store.arena_bytes = (uint32_t)std::strtoul(arg + 11, nullptr, 10) * 1024;
+        } else if (std::strcmp(arg, "--evict") == 0) {
+            cfg->store.eviction = EVICT_CLOCK;
+        } else if (std::strncmp(arg, "--replicas=", 11) == 0) {
+            cfg->replicas = std::atoi(arg + 11);
+        } else if (std::strncmp(arg, "--data-dir=", 11) == 0) {
+            cfg->data_dir = arg + 11;
+        } else if (std::strncmp(arg, "--vnodes=", 9) == 0) {
+            cfg->vnodes = std::atoi(arg + 9);
+        } else if (std::strcmp(arg, "--lookup=iterative") == 0) {
+            cfg->recursive_lookups = false;
+        } else if (std::strcmp(arg, "--lookup=recursive") == 0) {
+            cfg->recursive_lookups = true;
+        } else if (std::strncmp(arg, "--phi=", 6) == 0) {
+            cfg->phi_threshold = std::atof(arg + 6);
+        } else if (std::strcmp(arg, "--udp-heartbeat") == 0) {
+            cfg->udp_heartbeat = true;
+        } else if (std::strncmp(arg, "--log-level=", 12) == 0) {
+            const char* names[] = {"debug", "info", "warn", "error"};
+            cfg->log_level = -1;
+            for (int l = 0; l < 4; ++l) {
+                if (std::strcmp(arg + 12, names[l]) == 0) cfg->log_level = l;
+            }
+        } else if (std::strncmp(arg, "--workers=", 10) == 0) {
+            cfg->workers = std::atoi(arg + 10);
+        } else if (std::strncmp(arg, "--cert=", 7) == 0) {
+            cfg->cert_file = arg + 7;
+        } else if (std::strncmp(arg, "--cert-version=", 15) == 0) {
+            cfg->cert_version = std::strtoull(arg + 15, nullptr, 10);
+        } else if (std::strncmp(arg, "--cache-keys=", 13) == 0) {
+            cfg->cache.max_keys = (uint32_t)std::strtoul(arg + 13, nullptr, 10);
+        } else if (std::strncmp(arg, "--cache-kb=", 11) == 0) {
+            cfg->cache.arena_bytes = (uint32_t)std::strtoul(arg + 11, nullptr, 10) * 1024;
+        } else if (std::strncmp(arg, "--cache-ttl-ms=", 15) == 0) {
+            cfg->cache_ttl_ms = (uint32_t)std::strtoul(arg + 15, nullptr, 10);
+        } else if (arg[0] != '-' && cfg->bootstrap_ip == 0) {
+            cfg->bootstrap_ip = inet_addr(arg);
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+    if (cfg->store.max_keys == 0 || cfg->replicas < 0 || cfg->replicas > SUCLIST_SIZE ||
+        cfg->vnodes < 1 || cfg->vnodes > MAX_VNODES || cfg->phi_threshold <= 0 || cfg->log_level < 0 ||
+        cfg->workers < 0 || cfg->workers > MAX_WORKER_THREADS || cfg->cert_version == 0 ||
+        (cfg->cache.max_keys > 0 && (cfg->cache.arena_bytes == 0 || cfg->cache_ttl_ms == 0))) {
+        printUsage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef FAILUREDETECTOR_H
+#define FAILUREDETECTOR_H
+
+#include "Protocol.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+constexpr double DEFAULT_PHI_THRESHOLD = 8.0;
+constexpr uint16_t DEFAULT_RPC_TIMEOUT_MS = 200;  // peers we have no RTT for
+constexpr uint16_t MIN_RPC_TIMEOUT_MS = 50;
+constexpr uint16_t MAX_RPC_TIMEOUT_MS = 1000;
+// Until two heartbeats were seen, assume about one per stabilize round.
+constexpr double INITIAL_HEARTBEAT_INTERVAL_MS = 250;
+// Floor of the interval deviation, otherwise a peer that answered like clockwork would
+// be declared dead after a few ms of delay.
+constexpr double MIN_HEARTBEAT_DEVIATION_MS = 100;
+
+/**
+* What we know about how a peer answers: smoothed RTT and its variation (as in TCP, RFC
+* 6298) and the mean and variation of the time between two heartbeat replies.
+*/
+struct PeerHealth {
+    double srtt_ms;
+    double rttvar_ms;
+    double interval_mean_ms;
+    double interval_var_ms;  // mean deviation, not squared
+    uint64_t last_heard;     // last heartbeat reply, or when we started to watch
+    uint32_t heartbeats;
+    uint32_t rtt_samples;
+    uint32_t misses;         // timeouts since the last reply
+};
+
+/**
+* Phi accrual failure detector (Hayashibara et al.). Instead of declaring a peer dead
+* after one lost reply, phi grows with the time since its last heartbeat, measured
+* against the intervals seen so far: phi 1 means a 10% chance that the peer is still
+* alive and just late, phi 8 one in 10^8. Timeouts of single RPCs only decide when to
+* retry, they adapt to the RTT of the peer.
+*/
+class FailureDetector {
+public:
+    explicit FailureDetector(double threshold = DEFAULT_PHI_THRESHOLD) : threshold(threshold) {}
+
+    void setThreshold(double phi) { threshold = phi; }
+    double getThreshold() const { return threshold; }
+
+    /**
+    * A heartbeat reply arrived rtt_ms after its request.
+    */
+    void onReply(const NodeInfo& peer, uint64_t rtt_ms, uint64_t now) {
+        PeerHealth& h = watch(peer, now);
+        if (h.rtt_samples == 0) {
+            h.srtt_ms = (double)rtt_ms;
+            h.rttvar_ms = rtt_ms / 2.0;
+        } else {
+            h.rttvar_ms += (std::fabs(h.srtt_ms - rtt_ms) - h.rttvar_ms) / 4;
+            h.srtt_ms += (rtt_ms - h.srtt_ms) / 8;
+        }
+        ++h.rtt_samples;
+        heard(h, now);
+    }
+
+    /**
+    * A request from peer arrived, proof of life without an RTT. The predecessor's
+    * stabilize requests are its heartbeat.
+    */
+    void onHeartbeat(const NodeInfo& peer, uint64_t now) {
+        heard(watch(peer, now), now);
+    }
+
+    void onTimeout(const NodeInfo& peer, uint64_t now) {
+        PeerHealth& h = watch(peer, now);
+        // A peer we have not asked for a while, e.g. a former neighbour: its silence so
+        // far says nothing, count from this miss on.
+        if (!wasProbing(h, now)) h.last_heard = now;
+        ++h.misses;
+    }
+
+    // RPC timeout for peer, long enough for nearly all of its replies.
+    uint16_t timeoutFor(const NodeInfo& peer) const {
+        auto it = peers.find(peer.id);
+        if (it == peers.end() || it->second.rtt_samples == 0) return DEFAULT_RPC_TIMEOUT_MS;
+        double t = it->second.srtt_ms + 4 * it->second.rttvar_ms;
+        return (uint16_t)std::max<double>(MIN_RPC_TIMEOUT_MS, std::min<double>(MAX_RPC_TIMEOUT_MS, t));
+    }
+
+    double phi(const NodeInfo& peer, uint64_t now) const {
+        auto it = peers.find(peer.id);
+        if (it == peers.end()) return 0;
+        return phiOf(it->second, now);
+    }
+
+    /**
+    * True once peer missed a reply and phi reached the threshold. A peer that answers
+    * late is suspected, and retried, long before that.
+    */
+    bool isFailed(const NodeInfo& peer, uint64_t now) const {
+        auto it = peers.find(peer.id);
+        return it != peers.end() && it->second.misses > 0 && phiOf(it->second, now) >= threshold;
+    }
+
+    const PeerHealth* get(const NodeInfo& peer) const {
+        auto it = peers.find(peer.id);
+        return it == peers.end() ? nullptr : &it->second;
+    }
+
+private:
+    static const size_t PRUNE_SIZE = 64;
+    static const uint64_t PRUNE_AGE_MS = 60000;
+
+    PeerHealth& watch(const NodeInfo& peer, uint64_t now) {
+        auto it = peers.find(peer.id);
+        if (it != peers.end()) return it->second;
+        if (peers.size() >= PRUNE_SIZE) prune(now);
+        PeerHealth& h = peers[peer.id];
+        h.srtt_ms = 0;
+        h.rttvar_ms = 0;
+        h.interval_mean_ms = INITIAL_HEARTBEAT_INTERVAL_MS;
+        h.interval_var_ms = MIN_HEARTBEAT_DEVIATION_MS;
+        h.last_heard = now;
+        h.heartbeats = 0;
+        h.rtt_samples = 0;
+        h.misses = 0;
+        return h;
+    }
+
+    void heard(PeerHealth& h, uint64_t now) {
+        if (h.heartbeats > 0 && wasProbing(h, now)) {
+            double interval = (double)(now - h.last_heard);
+            if (h.heartbeats == 1) {
+                h.interval_mean_ms = interval;
+                h.interval_var_ms = interval / 2;
+            } else {
+                h.interval_var_ms += (std::fabs(h.interval_mean_ms - interval) - h.interval_var_ms) / 4;
+                h.interval_mean_ms += (interval - h.interval_mean_ms) / 8;
+            }
+        }
+        h.last_heard = now;
+        ++h.heartbeats;
+        h.misses = 0;
+    }
+
+    // A silence longer than a heartbeat interval and a full RPC timeout, without a
+    // miss, means we did not ask.
+    static bool wasProbing(const PeerHealth& h, uint64_t now) {
+        return h.misses > 0 || now - h.last_heard <= h.interval_mean_ms + MAX_RPC_TIMEOUT_MS;
+    }
+
+    // Drops peers we have not heard of for a while, former neighbours.
+    void prune(uint64_t now) {
+        for (auto it = peers.begin(); it != peers.end();) {
+            if (now - it->second.last_heard > PRUNE_AGE_MS) it = peers.erase(it);
+            else ++it;
+        }
+    }
+
+    /**
+    * -log10 of the probability that a heartbeat comes even later than now, with the
+    * intervals taken as normally distributed. Uses the logistic approximation of the
+    * normal CDF, as Akka and Cassandra do.
+    */
+    static double phiOf(const PeerHealth& h, uint64_t now) {
+        double elapsed = (double)(now - h.last_heard);
+        // The mean deviation of a normal distribution is about 0.8 standard deviations.
+        double sigma = std::max<double>(MIN_HEARTBEAT_DEVIATION_MS, h.interval_var_ms * 1.25);
+        double y = (elapsed - h.interval_mean_ms) / sigma;
+        double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+        double p_later = elapsed > h.interval_mean_ms ? e / (1.0 + e) : 1.0 - 1.0 / (1.0 + e);
+        if (p_later < 1e-300) return 300;
+        return -std::log10(p_later);
+    }
+
+    double threshold;
+    std::map<Sha1ID, PeerHealth> peers;
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "KVStore.hpp"
+#include "Log.hpp"
+#include "Transport.hpp"
+#include <functional>
+#include <memory>
+#include <vector>
+
+constexpr int TRANSFER_WINDOW = 4;         // batches in flight per transfer
+constexpr uint16_t TRANSFER_TIMEOUT_MS = 5000;
+
+/**
+* Bulk transfer of a key range to another node, used when a joining node takes over part
+* of our range and when we leave the ring. Items are packed into MSG_TRANSFER_BATCH frames
+* of up to TRANSFER_BATCH_BYTES, values are gathered straight from the store arena, and a
+* small window of batches is kept in flight on one connection.
+*/
+class Handoff {
+public:
+    typedef std::function<void(bool ok)> DoneCallback;
+
+    Handoff(Transport& transport, KVStore& store) : transport(transport), store(store), active(0) {}
+
+    /**
+    * Streams every item in (start, end], tombstones included, to peer. done is called
+    * once all batches are acknowledged or the first one failed.
+    */
+    void pushRange(const NodeInfo& peer, const Sha1ID& start, const Sha1ID& end, DoneCallback done) {
+        std::shared_ptr<Session> session(new Session());
+        session->peer = peer;
+        session->next = 0;
+        session->in_flight = 0;
+        session->failed = false;
+        session->items = 0;
+        session->bytes = 0;
+        session->started = transport.nowMs();
+        session->done = done;
+        store.forEach([&](const Sha1ID& key, uint64_t, bool) {
+            if (in_interval(key, start, end)) session->keys.push_back(key);
+        });
+
+        ++active;
+        pump(session);
+    }
+
+    /**
+    * Applies a received batch, returns false for message types it does not handle.
+    */
+    bool handleRequest(const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+        if (hdr.type != MSG_TRANSFER_BATCH) return false;
+
+        StatusPayload resp;
+        resp.status = STORE_OK;
+        uint32_t off = 0;
+        while (off < hdr.payload_len) {
+            TransferItemHeader item;
+            if (hdr.payload_len - off < sizeof(item)) { resp.status = STORE_BAD_REQUEST; break; }
+            std::memcpy(&item, payload + off, sizeof(item));
+            off += sizeof(item);
+            if (item.value_len > MAX_VALUE_LEN || hdr.payload_len - off < item.value_len) { resp.status = STORE_BAD_REQUEST; break; }
+
+            StoreStatus st = store.apply(item.key, payload + off, item.value_len, item.version, item.tombstone != 0, wallClockMs());
+            if (st != STORE_OK) resp.status = st;
+            off += item.value_len;
+        }
+        transport.reply(from, MSG_TRANSFER_BATCH_RESPONSE, &resp, sizeof(resp));
+        return true;
+    }
+
+    // Number of transfers still running.
+    int activeTransfers() const { return active; }
+
+private:
+    struct Session {
+        NodeInfo peer;
+        std::vector<Sha1ID> keys;  // snapshot of the range, values are read when sent
+        size_t next;
+        int in_flight;
+        bool failed;
+        uint64_t items;
+        uint64_t bytes;
+        uint64_t started;
+        DoneCallback done;
+    };
+
+    void pump(const std::shared_ptr<Session>& session) {
+        while (!session->failed && session->in_flight < TRANSFER_WINDOW && session->next < session->keys.size()) {
+            sendBatch(session);
+        }
+        if (session->in_flight > 0 || (!session->failed && session->next < session->keys.size())) return;
+
+        uint64_t ms = transport.nowMs() - session->started;
+        if (session->items > 0 || session->failed) {
+            LOG_INFO("[HANDOFF] " << (session->failed ? "Aborted" : "Sent") << " " << session->items << " keys ("
+                                  << session->bytes / 1024 << " KiB) to " << inet_ntoa(*(in_addr*)&session->peer.ip) << " in " << ms << " ms");
+        }
+        --active;
+        if (session->done) session->done(!session->failed);
+    }
+
+    void sendBatch(const std::shared_ptr<Session>& session) {
+        std::vector<TransferItemHeader> headers;
+        std::vector<IoSlice> slices;
+        headers.reserve(TRANSFER_BATCH_BYTES / sizeof(TransferItemHeader));
+        uint32_t batch_bytes = 0;
+
+        while (session->next < session->keys.size()) {
+            const Sha1ID& key = session->keys[session->next];
+            uint64_t version = 0;
+            bool tombstone = false;
+            uint32_t len = 0;
+            if (!store.getMeta(key, &version, &tombstone, &len)) {  // purged or evicted meanwhile
+                ++session->next;
+                continue;
+            }
+            if (!headers.empty() && batch_bytes + sizeof(TransferItemHeader) + len > TRANSFER_BATCH_BYTES) break;
+            if (headers.size() == headers.capacity()) break;  // slices point into headers
+
+            TransferItemHeader h;
+            h.key = key;
+            h.version = version;
+            h.tombstone = tombstone ? 1 : 0;
+            h.value_len = len;
+            headers.push_back(h);
+
+            IoSlice hs;
+            hs.data = &headers.back();
+            hs.len = sizeof(TransferItemHeader);
+            slices.push_back(hs);
+            store.readChunks(key, [&](const uint8_t* data, uint32_t n) {
+                IoSlice vs;
+                vs.data = data;
+                vs.len = n;
+                slices.push_back(vs);
+            });
+
+            batch_bytes += sizeof(TransferItemHeader) + len;
+            ++session->next;
+        }
+        if (headers.empty()) return;
+
+        session->items += headers.size();
+        session->bytes += batch_bytes;
+        ++session->in_flight;
+        transport.callv(session->peer, MSG_TRANSFER_BATCH, slices.data(), (int)slices.size(), TRANSFER_TIMEOUT_MS,
+            [this, session](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                --session->in_flight;
+                if (!ok || h.type != MSG_TRANSFER_BATCH_RESPONSE || h.payload_len < sizeof(StatusPayload) ||
+                    ((const StatusPayload*)payload)->status != STORE_OK) {
+                    session->failed = true;
+                }
+                pump(session);
+            });
+    }
+
+    Transport& transport;
+    KVStore& store;
+    int active;
+};
+
+#endif
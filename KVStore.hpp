@@ -0,0 +1,340 @@
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+#include "Protocol.h"
+#include <chrono>
+#include <vector>
+
+constexpr uint32_t STORE_BLOCK_SIZE = 256;
+constexpr uint32_t STORE_NO_BLOCK = 0xFFFFFFFF;
+
+enum EvictionPolicy : uint8_t {
+    EVICT_NONE = 0,  // a full store rejects new keys with STORE_FULL
+    EVICT_CLOCK = 1  // a full store drops the least recently touched key (CLOCK)
+};
+
+struct StoreConfig {
+    uint32_t max_keys;
+    uint32_t arena_bytes;
+    EvictionPolicy eviction;
+
+    StoreConfig() : max_keys(4096), arena_bytes(8 * 1024 * 1024), eviction(EVICT_NONE) {}
+};
+
+// Item versions come from the wall clock, so they are comparable across nodes.
+inline uint64_t wallClockMs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/**
+* Receives every change of a KVStore, e.g. to persist it. Called after the change was
+* applied to the in-memory table.
+*/
+class StoreJournal {
+public:
+    virtual ~StoreJournal() {}
+    virtual void recordWrite(const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t version, bool tombstone, uint64_t modified_ms) = 0;
+    virtual void recordErase(const Sha1ID& key) = 0;
+};
+
+/**
+* Fixed-capacity key/value store keyed by Sha1ID. The index is an open-addressing hash table
+* with linear probing and backward-shift deletion, values live in a preallocated arena of
+* STORE_BLOCK_SIZE blocks chained per value. All memory is allocated in the constructor,
+* put/get/remove never touch the heap.
+*
+* Every item carries a version so replicas can tell newer from older copies. A removed key
+* stays as a tombstone until purgeTombstones(), otherwise replicas would resurrect it.
+*/
+class KVStore {
+public:
+    explicit KVStore(const StoreConfig& cfg) : config(cfg), count(0), clock_hand(0), mutations(0), journal(nullptr) {
+        uint32_t table_size = 16;
+        while (table_size < (uint64_t)cfg.max_keys * 4 / 3) table_size <<= 1;
+        slots.resize(table_size);
+        mask = table_size - 1;
+        for (uint32_t i = 0; i < table_size; ++i) slots[i].used = 0;
+
+        uint32_t num_blocks = cfg.arena_bytes / STORE_BLOCK_SIZE;
+        arena.resize((size_t)num_blocks * STORE_BLOCK_SIZE);
+        next_block.resize(num_blocks);
+        for (uint32_t i = 0; i < num_blocks; ++i) next_block[i] = (i + 1 < num_blocks) ? i + 1 : STORE_NO_BLOCK;
+        free_head = num_blocks > 0 ? 0 : STORE_NO_BLOCK;
+        free_count = num_blocks;
+    }
+
+    /**
+    * Local write on the owner, the version is derived from the previous one and the clock.
+    */
+    StoreStatus put(const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t now_ms, uint64_t* out_version = nullptr) {
+        uint64_t version = nextVersion(key, now_ms);
+        StoreStatus st = write(key, data, len, version, false, now_ms);
+        if (st == STORE_OK && out_version) *out_version = version;
+        return st;
+    }
+
+    StoreStatus get(const Sha1ID& key, uint8_t* out, uint32_t max_len, uint32_t* out_len, uint64_t* out_version = nullptr) {
+        uint32_t idx = 0;
+        if (!findSlot(key, &idx) || slots[idx].tombstone) return STORE_NOT_FOUND;
+        Slot& s = slots[idx];
+        if (s.len > max_len) return STORE_TOO_LARGE;
+        s.referenced = 1;
+        copyChain(s.first_block, out, s.len);
+        *out_len = s.len;
+        if (out_version) *out_version = s.version;
+        return STORE_OK;
+    }
+
+    StoreStatus remove(const Sha1ID& key, uint64_t now_ms, uint64_t* out_version = nullptr) {
+        uint32_t idx = 0;
+        if (!findSlot(key, &idx) || slots[idx].tombstone) return STORE_NOT_FOUND;
+        uint64_t version = nextVersion(key, now_ms);
+        StoreStatus st = write(key, nullptr, 0, version, true, now_ms);
+        if (st == STORE_OK && out_version) *out_version = version;
+        return st;
+    }
+
+    /**
+    * Applies a replicated item, older or equal versions are ignored.
+    */
+    StoreStatus apply(const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t version, bool tombstone, uint64_t now_ms) {
+        uint32_t idx = 0;
+        if (findSlot(key, &idx) && slots[idx].version >= version) return STORE_OK;
+        return write(key, data, len, version, tombstone, now_ms);
+    }
+
+    /**
+    * Version and tombstone flag of key, false if the key is unknown.
+    */
+    bool getMeta(const Sha1ID& key, uint64_t* version, bool* tombstone, uint32_t* len = nullptr) const {
+        uint32_t idx = 0;
+        if (!findSlot(key, &idx)) return false;
+        *version = slots[idx].version;
+        *tombstone = slots[idx].tombstone != 0;
+        if (len) *len = slots[idx].len;
+        return true;
+    }
+
+    // Time of the last write of key, 0 if unknown.
+    uint64_t modifiedAt(const Sha1ID& key) const {
+        uint32_t idx = 0;
+        return findSlot(key, &idx) ? slots[idx].modified_ms : 0;
+    }
+
+    /**
+    * Calls f(data, len) for each arena block of the value of key, in order. Lets callers
+    * send a value without copying it, the pointers are valid until the next write.
+    */
+    template <typename F>
+    bool readChunks(const Sha1ID& key, F f) const {
+        uint32_t idx = 0;
+        if (!findSlot(key, &idx)) return false;
+        uint32_t b = slots[idx].first_block;
+        for (uint32_t off = 0; off < slots[idx].len; off += STORE_BLOCK_SIZE) {
+            f(&arena[(size_t)b * STORE_BLOCK_SIZE], std::min(STORE_BLOCK_SIZE, slots[idx].len - off));
+            b = next_block[b];
+        }
+        return true;
+    }
+
+    // Removes key without leaving a tombstone, used when replaying a journal.
+    void drop(const Sha1ID& key) {
+        uint32_t idx = 0;
+        if (findSlot(key, &idx)) eraseSlot(idx);
+    }
+
+    // Drops tombstones written before older_than_ms.
+    void purgeTombstones(uint64_t older_than_ms) {
+        for (uint32_t i = 0; i <= mask; ) {
+            if (slots[i].used && slots[i].tombstone && slots[i].modified_ms < older_than_ms) {
+                eraseSlot(i); // backward shift may move another entry into i
+                continue;
+            }
+            ++i;
+        }
+    }
+
+    /**
+    * Calls f(key, version, tombstone) for every item, including tombstones.
+    */
+    template <typename F>
+    void forEach(F f) const {
+        for (uint32_t i = 0; i <= mask; ++i) {
+            if (slots[i].used) f(slots[i].key, slots[i].version, slots[i].tombstone != 0);
+        }
+    }
+
+    // Changes with every write, cheap check whether derived data (Merkle trees) is stale.
+    uint64_t mutationCount() const { return mutations; }
+
+    bool contains(const Sha1ID& key) const {
+        uint32_t idx = 0;
+        return findSlot(key, &idx);
+    }
+
+    uint32_t size() const { return count; }
+    uint32_t maxKeys() const { return config.max_keys; }
+    uint32_t freeBytes() const { return free_count * STORE_BLOCK_SIZE; }
+    uint32_t usedBytes() const { return ((uint32_t)next_block.size() - free_count) * STORE_BLOCK_SIZE; }
+
+    // Every later change is reported to journal, nullptr detaches it.
+    void attachJournal(StoreJournal* j) { journal = j; }
+
+    // IDs may differ only in a few bytes, so all of them are mixed into the hash.
+    static uint64_t hashKey(const Sha1ID& key) {
+        uint64_t a, b; uint32_t c;
+        std::memcpy(&a, key.bytes, 8);
+        std::memcpy(&b, key.bytes + 8, 8);
+        std::memcpy(&c, key.bytes + 16, 4);
+        uint64_t h = a ^ (b * 0x9E3779B97F4A7C15ULL) ^ ((uint64_t)c * 0xC2B2AE3D27D4EB4FULL);
+        h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL; h ^= h >> 33;
+        return h;
+    }
+
+private:
+    struct Slot {
+        Sha1ID key;
+        uint64_t version;
+        uint64_t modified_ms;
+        uint32_t len;
+        uint32_t first_block;
+        uint8_t used;
+        uint8_t tombstone;
+        uint8_t referenced;
+    };
+
+    static uint32_t blocksFor(uint32_t len) { return (len + STORE_BLOCK_SIZE - 1) / STORE_BLOCK_SIZE; }
+
+    StoreStatus write(const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t version, bool tombstone, uint64_t now_ms) {
+        uint32_t needed = blocksFor(len);
+        if (needed > next_block.size()) return STORE_TOO_LARGE;
+
+        uint32_t idx = 0;
+        bool exists = findSlot(key, &idx);
+        while (free_count + (exists ? blocksFor(slots[idx].len) : 0) < needed || (!exists && count >= config.max_keys)) {
+            if (config.eviction == EVICT_NONE || !evictOne(key)) return STORE_FULL;
+            exists = findSlot(key, &idx);
+        }
+
+        if (exists) {
+            freeChain(slots[idx].first_block);
+        } else {
+            slots[idx].used = 1;
+            slots[idx].key = key;
+            ++count;
+        }
+        slots[idx].len = len;
+        slots[idx].version = version;
+        slots[idx].modified_ms = now_ms;
+        slots[idx].tombstone = tombstone ? 1 : 0;
+        slots[idx].referenced = 1;
+        slots[idx].first_block = allocChain(data, len);
+        ++mutations;
+        if (journal) journal->recordWrite(key, data, len, version, tombstone, now_ms);
+        return STORE_OK;
+    }
+
+    uint64_t nextVersion(const Sha1ID& key, uint64_t now_ms) const {
+        uint32_t idx = 0;
+        if (findSlot(key, &idx) && slots[idx].version >= now_ms) return slots[idx].version + 1;
+        return now_ms;
+    }
+
+    /**
+    * Returns true and the slot of key if present, otherwise false and the empty slot where
+    * key would be inserted.
+    */
+    bool findSlot(const Sha1ID& key, uint32_t* out_idx) const {
+        uint32_t idx = (uint32_t)hashKey(key) & mask;
+        while (slots[idx].used) {
+            if (slots[idx].key == key) { *out_idx = idx; return true; }
+            idx = (idx + 1) & mask;
+        }
+        *out_idx = idx;
+        return false;
+    }
+
+    // Backward-shift deletion keeps probe sequences intact without tombstones.
+    void eraseSlot(uint32_t idx) {
+        if (journal) journal->recordErase(slots[idx].key);
+        freeChain(slots[idx].first_block);
+        slots[idx].used = 0;
+        --count;
+        ++mutations;
+
+        uint32_t hole = idx;
+        uint32_t cur = (idx + 1) & mask;
+        while (slots[cur].used) {
+            uint32_t home = (uint32_t)hashKey(slots[cur].key) & mask;
+            if (((cur - home) & mask) >= ((cur - hole) & mask)) {
+                slots[hole] = slots[cur];
+                slots[cur].used = 0;
+                hole = cur;
+            }
+            cur = (cur + 1) & mask;
+        }
+    }
+
+    bool evictOne(const Sha1ID& keep) {
+        if (count == 0 || (count == 1 && contains(keep))) return false;
+        while (true) {
+            Slot& s = slots[clock_hand];
+            if (s.used && s.key != keep) {
+                if (s.referenced) {
+                    s.referenced = 0;
+                } else {
+                    eraseSlot(clock_hand);
+                    return true;
+                }
+            }
+            clock_hand = (clock_hand + 1) & mask;
+        }
+    }
+
+    uint32_t allocChain(const uint8_t* data, uint32_t len) {
+        uint32_t first = STORE_NO_BLOCK;
+        uint32_t* link = &first;
+        for (uint32_t off = 0; off < len; off += STORE_BLOCK_SIZE) {
+            uint32_t b = free_head;
+            free_head = next_block[b];
+            --free_count;
+            std::memcpy(&arena[(size_t)b * STORE_BLOCK_SIZE], data + off, std::min(STORE_BLOCK_SIZE, len - off));
+            *link = b;
+            link = &next_block[b];
+        }
+        *link = STORE_NO_BLOCK;
+        return first;
+    }
+
+    void freeChain(uint32_t b) {
+        while (b != STORE_NO_BLOCK) {
+            uint32_t next = next_block[b];
+            next_block[b] = free_head;
+            free_head = b;
+            ++free_count;
+            b = next;
+        }
+    }
+
+    void copyChain(uint32_t b, uint8_t* out, uint32_t len) const {
+        for (uint32_t off = 0; off < len; off += STORE_BLOCK_SIZE) {
+            std::memcpy(out + off, &arena[(size_t)b * STORE_BLOCK_SIZE], std::min(STORE_BLOCK_SIZE, len - off));
+            b = next_block[b];
+        }
+    }
+
+    StoreConfig config;
+    std::vector<Slot> slots;
+    uint32_t mask;
+    uint32_t count;
+    uint32_t clock_hand;
+    std::vector<uint8_t> arena;
+    std::vector<uint32_t> next_block;
+    uint32_t free_head;
+    uint32_t free_count;
+    uint64_t mutations;
+    StoreJournal* journal;
+};
+
+#endif
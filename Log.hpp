@@ -0,0 +1,189 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <ostream>
+#include <streambuf>
+#include <thread>
+
+// Severities. Lines below LOG_MIN_LEVEL are compiled out, e.g. -DLOG_MIN_LEVEL=2 keeps only
+// warnings and errors.
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+constexpr size_t LOG_LINE_MAX = 240;   // longer lines are cut
+constexpr size_t LOG_RING_SIZE = 512;  // lines, power of two
+
+/**
+* Writes log lines from a background thread so the event loop never waits on a slow
+* console. Producers format into their own stack buffer and copy the line into a
+* preallocated ring (Vyukov's bounded queue, one CAS per line, no locks). A full ring
+* drops the line and counts it instead of blocking. Until start() is called lines are
+* written at once, which keeps tools and the simulator free of threads.
+*/
+class Logger {
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger() { stop(); }
+
+    // Lines below level are skipped at runtime, on top of LOG_MIN_LEVEL.
+    void setLevel(int level) { min_level.store(level, std::memory_order_relaxed); }
+    bool enabled(int level) const { return level >= min_level.load(std::memory_order_relaxed); }
+
+    // Starts the writer thread. Errors go to err, everything else to out.
+    void start(FILE* out = stdout, FILE* err = stderr) {
+        if (running.load()) return;
+        out_file = out;
+        err_file = err;
+        running.store(true);
+        writer = std::thread([this]() { writeLoop(); });
+    }
+
+    // Writes what is still queued and ends the writer thread.
+    void stop() {
+        if (!running.exchange(false)) return;
+        writer.join();
+        drain();
+        reportDropped();
+    }
+
+    // Lines lost to a full ring since the start.
+    uint64_t dropped() const { return dropped_lines.load(std::memory_order_relaxed); }
+
+    void write(int level, const char* text, size_t len) {
+        if (len > LOG_LINE_MAX) len = LOG_LINE_MAX;
+        if (!running.load(std::memory_order_relaxed)) {
+            std::ostream& os = level >= LOG_LEVEL_ERROR ? std::cerr : std::cout;
+            os.write(text, (std::streamsize)len);
+            os << std::endl;
+            return;
+        }
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &slots[pos & (LOG_RING_SIZE - 1)];
+            uint64_t seq = slot->seq.load(std::memory_order_acquire);
+            int64_t diff = (int64_t)(seq - pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                dropped_lines.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->level = (uint8_t)level;
+        slot->len = (uint16_t)len;
+        std::memcpy(slot->text, text, len);
+        slot->seq.store(pos + 1, std::memory_order_release);
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;  // pos: free for the producer at pos, pos + 1: filled
+        uint8_t level;
+        uint16_t len;
+        char text[LOG_LINE_MAX];
+    };
+
+    Logger() : min_level(LOG_LEVEL_INFO), running(false), tail(0), head(0), dropped_lines(0), reported_drops(0),
+               out_file(stdout), err_file(stderr) {
+        for (size_t i = 0; i < LOG_RING_SIZE; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void writeLoop() {
+        while (running.load()) {
+            if (!drain()) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            reportDropped();
+        }
+    }
+
+    // Writes all filled slots, returns false if there were none. Only the writer calls it.
+    bool drain() {
+        bool any = false;
+        bool wrote_out = false, wrote_err = false;
+        while (true) {
+            Slot& slot = slots[head & (LOG_RING_SIZE - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != head + 1) break;
+            FILE* f = slot.level >= LOG_LEVEL_ERROR ? err_file : out_file;
+            std::fwrite(slot.text, 1, slot.len, f);
+            std::fputc('\n', f);
+            (f == err_file ? wrote_err : wrote_out) = true;
+            slot.seq.store(head + LOG_RING_SIZE, std::memory_order_release);
+            ++head;
+            any = true;
+        }
+        // One flush per batch instead of one per line.
+        if (wrote_out) std::fflush(out_file);
+        if (wrote_err) std::fflush(err_file);
+        return any;
+    }
+
+    void reportDropped() {
+        uint64_t now = dropped_lines.load(std::memory_order_relaxed);
+        if (now == reported_drops) return;
+        std::fprintf(err_file, "[LOG] %llu lines dropped, the console is too slow\n", (unsigned long long)(now - reported_drops));
+        std::fflush(err_file);
+        reported_drops = now;
+    }
+
+    std::atomic<int> min_level;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> tail;  // next position to claim
+    uint64_t head;               // next position to write, writer only
+    std::atomic<uint64_t> dropped_lines;
+    uint64_t reported_drops;
+    FILE* out_file;
+    FILE* err_file;
+    std::thread writer;
+    Slot slots[LOG_RING_SIZE];
+};
+
+/**
+* Formats one line into a stack buffer, handed to the logger when it goes out of scope.
+* Output beyond LOG_LINE_MAX is discarded.
+*/
+class LogLine : private std::streambuf, public std::ostream {
+public:
+    explicit LogLine(int level) : std::ostream(this), level(level) { setp(buf, buf + LOG_LINE_MAX); }
+    ~LogLine() { Logger::instance().write(level, buf, (size_t)(pptr() - buf)); }
+
+private:
+    int overflow(int c) override { return c; }
+
+    int level;
+    char buf[LOG_LINE_MAX];
+};
+
+#define LOG_AT(level, expr)                                                          \
+    do {                                                                             \
+        if ((level) >= LOG_MIN_LEVEL && Logger::instance().enabled(level)) {        \
+            LogLine log_line_(level);                                                \
+            log_line_ << expr;                                                       \
+        }                                                                            \
+    } while (0)
+
+#define LOG_DEBUG(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+#define LOG_INFO(expr) LOG_AT(LOG_LEVEL_INFO, expr)
+#define LOG_WARN(expr) LOG_AT(LOG_LEVEL_WARN, expr)
+#define LOG_ERROR(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+
+#endif
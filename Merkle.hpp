@@ -0,0 +1,81 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include "KVStore.hpp"
+#include "Protocol.h"
+
+constexpr uint32_t MERKLE_LEAVES = MERKLE_FANOUT * MERKLE_FANOUT * MERKLE_FANOUT;
+
+/**
+* Hash tree over the items of one key range. Items are bucketed into leaves by key hash, a
+* leaf hash is the XOR of its item digests and inner nodes hash their children. Two nodes
+* holding the same items in a range get the same tree, so comparing top-down only descends
+* into subtrees that differ.
+*/
+class MerkleTree {
+public:
+    MerkleTree() : valid(false), built_mutations(0) {}
+
+    /**
+    * Rebuilds the tree for (start, end] unless it is already current for that range.
+    */
+    void build(const KVStore& store, const Sha1ID& start, const Sha1ID& end) {
+        if (valid && start == range_start && end == range_end && built_mutations == store.mutationCount()) return;
+
+        std::memset(nodes, 0, sizeof(nodes));
+        uint64_t* leaves = &nodes[levelOffset(MERKLE_DEPTH)];
+        store.forEach([&](const Sha1ID& key, uint64_t version, bool tombstone) {
+            if (!in_interval(key, start, end)) return;
+            leaves[leafOf(key)] ^= itemDigest(key, version, tombstone);
+        });
+
+        for (int level = MERKLE_DEPTH - 1; level >= 0; --level) {
+            uint32_t width = levelWidth(level);
+            for (uint32_t i = 0; i < width; ++i) {
+                uint64_t h = 0;
+                for (int c = 0; c < MERKLE_FANOUT; ++c) {
+                    h = mix(h ^ hash(level + 1, i * MERKLE_FANOUT + c));
+                }
+                nodes[levelOffset(level) + i] = h;
+            }
+        }
+
+        range_start = start;
+        range_end = end;
+        built_mutations = store.mutationCount();
+        valid = true;
+    }
+
+    // Level 0 is the root, level MERKLE_DEPTH are the leaves.
+    uint64_t hash(int level, uint32_t index) const { return nodes[levelOffset(level) + index]; }
+
+    static uint32_t levelWidth(int level) {
+        uint32_t w = 1;
+        for (int i = 0; i < level; ++i) w *= MERKLE_FANOUT;
+        return w;
+    }
+
+    static uint32_t leafOf(const Sha1ID& key) { return (uint32_t)(KVStore::hashKey(key) >> 40) & (MERKLE_LEAVES - 1); }
+
+    static uint64_t itemDigest(const Sha1ID& key, uint64_t version, bool tombstone) {
+        return mix(KVStore::hashKey(key) ^ mix(version) ^ (tombstone ? 0x5bd1e995ULL : 0));
+    }
+
+private:
+    static uint32_t levelOffset(int level) { return (levelWidth(level) - 1) / (MERKLE_FANOUT - 1); }
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    uint64_t nodes[(MERKLE_LEAVES * MERKLE_FANOUT - 1) / (MERKLE_FANOUT - 1)];
+    Sha1ID range_start;
+    Sha1ID range_end;
+    bool valid;
+    uint64_t built_mutations;
+};
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "Protocol.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Index of the highest set bit, v > 0.
+inline int highestBit(uint64_t v) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(v);
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return (int)i;
+#else
+    int i = 0;
+    while (v >>= 1) ++i;
+    return i;
+#endif
+}
+
+/**
+* Latency histogram in fixed memory, log-linear like HdrHistogram: every power of two is
+* split into 16 buckets, so a percentile is off by at most 1/16 of its value. Values are
+* microseconds up to about 71 minutes. Recording is a few relaxed atomic increments, any
+* thread may record or read at any time. A reader sees each counter consistent on its own,
+* count and buckets may be a few records apart.
+*/
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BIT = 31;
+    static const int BUCKETS = (MAX_BIT - SUB_BITS + 2) * SUB_BUCKETS;
+
+    LatencyHistogram() {
+        for (int i = 0; i < BUCKETS; ++i) buckets[i].store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum_us.store(0, std::memory_order_relaxed);
+        max_us.store(0, std::memory_order_relaxed);
+    }
+
+    void record(uint64_t us) {
+        if (us >> (MAX_BIT + 1)) us = (1ull << (MAX_BIT + 1)) - 1;
+        buckets[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+        uint64_t seen = max_us.load(std::memory_order_relaxed);
+        while (us > seen && !max_us.compare_exchange_weak(seen, us, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t sumUs() const { return sum_us.load(std::memory_order_relaxed); }
+    uint64_t maxUs() const { return max_us.load(std::memory_order_relaxed); }
+
+    /**
+    * Smallest value that q (0..1) of all records do not exceed, rounded up to the end of
+    * its bucket. 0 without records.
+    */
+    uint64_t percentile(double q) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(q * n + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) return std::min(bucketEnd(i), maxUs());
+        }
+        return maxUs();
+    }
+
+    static int bucketOf(uint64_t us) {
+        if (us < (uint64_t)SUB_BUCKETS) return (int)us;
+        int shift = highestBit(us) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (int)((us >> shift) - SUB_BUCKETS);
+    }
+
+    // Largest value that falls into bucket i.
+    static uint64_t bucketEnd(int i) {
+        if (i < SUB_BUCKETS) return (uint64_t)i;
+        int shift = i / SUB_BUCKETS - 1;
+        uint64_t start = (uint64_t)(SUB_BUCKETS + i % SUB_BUCKETS) << shift;
+        return start + (1ull << shift) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum_us;
+    std::atomic<uint64_t> max_us;
+};
+
+/**
+* Message counters and RPC latencies of one transport, shared by all virtual nodes on it.
+* Requests are counted by type, responses belong to their request.
+*/
+struct RpcMetrics {
+    std::atomic<uint64_t> requests_in[256];   // requests served, including UDP probes
+    std::atomic<uint64_t> requests_out[256];  // RPCs and one-way messages sent
+    std::atomic<uint64_t> rpc_failures;       // RPCs that timed out or lost their connection
+    LatencyHistogram handle_us;               // inbound: time in the request handler
+    LatencyHistogram rpc_us;                  // outbound: request sent until response read
+
+    RpcMetrics() {
+        for (int i = 0; i < 256; ++i) {
+            requests_in[i].store(0, std::memory_order_relaxed);
+            requests_out[i].store(0, std::memory_order_relaxed);
+        }
+        rpc_failures.store(0, std::memory_order_relaxed);
+    }
+};
+
+// Ring events of one virtual node.
+struct ChordMetrics {
+    std::atomic<uint64_t> lookups_served;     // FIND_SUCCESSOR requests answered, per target
+    std::atomic<uint64_t> store_ops_served;   // store requests served as owner
+    std::atomic<uint64_t> successor_failovers;
+    std::atomic<uint64_t> predecessor_failovers;
+    std::atomic<uint64_t> stabilize_changes;  // closer successors found by stabilize
+    std::atomic<uint64_t> join_attempts;
+    std::atomic<uint64_t> joins;
+    std::atomic<uint64_t> cache_hits;         // relayed GETs answered from the read cache
+    std::atomic<uint64_t> cache_misses;       // relayed GETs sent on to the owner with the cache on
+    // Startup timeline, ms after the process started, 0 while pending.
+    std::atomic<uint64_t> discovered_ms;
+    std::atomic<uint64_t> joined_ms;
+    std::atomic<uint64_t> cert_ms;
+
+    ChordMetrics() {
+        std::atomic<uint64_t>* all[] = {&lookups_served, &store_ops_served, &successor_failovers, &predecessor_failovers,
+                                        &stabilize_changes, &join_attempts, &joins, &cache_hits, &cache_misses, &discovered_ms, &joined_ms, &cert_ms};
+        for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) all[i]->store(0, std::memory_order_relaxed);
+    }
+};
+
+inline void fillLatencySummary(const LatencyHistogram& h, LatencySummary* out) {
+    out->count = h.count();
+    out->sum_us = h.sumUs();
+    out->p50_us = (uint32_t)h.percentile(0.5);
+    out->p90_us = (uint32_t)h.percentile(0.9);
+    out->p99_us = (uint32_t)h.percentile(0.99);
+    out->p999_us = (uint32_t)h.percentile(0.999);
+    out->max_us = (uint32_t)h.maxUs();
+}
+
+/**
+* Snapshot for MSG_GET_STATS_RESPONSE. rpc may be null for a transport without metrics,
+* the type list is then empty. Returns the payload length to send.
+*/
+inline uint32_t fillStats(const ChordMetrics& chord, const RpcMetrics* rpc, uint64_t uptime_ms, StatsPayload* out) {
+    std::memset(out, 0, sizeof(*out));
+    out->uptime_ms = uptime_ms;
+    out->lookups_served = chord.lookups_served.load(std::memory_order_relaxed);
+    out->store_ops_served = chord.store_ops_served.load(std::memory_order_relaxed);
+    out->successor_failovers = chord.successor_failovers.load(std::memory_order_relaxed);
+    out->predecessor_failovers = chord.predecessor_failovers.load(std::memory_order_relaxed);
+    out->stabilize_changes = chord.stabilize_changes.load(std::memory_order_relaxed);
+    out->join_attempts = chord.join_attempts.load(std::memory_order_relaxed);
+    out->joins = chord.joins.load(std::memory_order_relaxed);
+    out->cache_hits = chord.cache_hits.load(std::memory_order_relaxed);
+    out->cache_misses = chord.cache_misses.load(std::memory_order_relaxed);
+    out->discovered_ms = (uint32_t)chord.discovered_ms.load(std::memory_order_relaxed);
+    out->joined_ms = (uint32_t)chord.joined_ms.load(std::memory_order_relaxed);
+    out->cert_ms = (uint32_t)chord.cert_ms.load(std::memory_order_relaxed);
+    if (rpc) {
+        out->rpc_failures = rpc->rpc_failures.load(std::memory_order_relaxed);
+        fillLatencySummary(rpc->handle_us, &out->handle);
+        fillLatencySummary(rpc->rpc_us, &out->rpc);
+        for (int t = 0; t < 256 && out->count < MAX_STATS_TYPES; ++t) {
+            uint64_t in = rpc->requests_in[t].load(std::memory_order_relaxed);
+            uint64_t sent = rpc->requests_out[t].load(std::memory_order_relaxed);
+            if (in == 0 && sent == 0) continue;
+            MessageCount& c = out->types[out->count++];
+            c.type = (uint8_t)t;
+            c.received = in;
+            c.sent = sent;
+        }
+    }
+    return (uint32_t)(sizeof(*out) - sizeof(out->types) + out->count * sizeof(MessageCount));
+}
+
+inline const char* messageTypeName(uint8_t type) {
+    switch (type) {
+        case MSG_PING: return "ping";
+        case MSG_FIND_SUCCESSOR: return "find_successor";
+        case MSG_NOTIFY: return "notify";
+        case MSG_GET_PREDECESSOR: return "get_predecessor";
+        case MSG_SET_SUCCESSOR: return "set_successor";
+        case MSG_SET_PREDECESSOR: return "set_predecessor";
+        case MSG_GET_SUCLIST: return "get_suclist";
+        case MSG_GET_CERT: return "get_cert";
+        case MSG_PUT: return "put";
+        case MSG_GET: return "get";
+        case MSG_DELETE: return "delete";
+        case MSG_REPLICATE: return "replicate";
+        case MSG_FETCH_ITEM: return "fetch_item";
+        case MSG_MERKLE_NODES: return "merkle_nodes";
+        case MSG_MERKLE_LEAVES: return "merkle_leaves";
+        case MSG_TRANSFER_BATCH: return "transfer_batch";
+        case MSG_LEAVE: return "leave";
+        case MSG_FIND_SUCCESSOR_BATCH: return "find_successor_batch";
+        case MSG_FIND_SUCCESSOR_RECURSIVE: return "find_successor_recursive";
+        case MSG_LOOKUP_RESULT: return "lookup_result";
+        case MSG_STABILIZE: return "stabilize";
+        case MSG_GET_STATS: return "get_stats";
+        case MSG_CERT_DIGEST: return "cert_digest";
+        case MSG_CERT_CHUNK: return "cert_chunk";
+        default: return nullptr;
+    }
+}
+
+inline void appendMetric(std::string& out, const char* name, const char* labels, double value) {
+    char line[160];
+    std::snprintf(line, sizeof(line), "%s%s %.9g\n", name, labels, value);
+    out += line;
+}
+
+inline void appendLatency(std::string& out, const char* name, const char* help, const LatencySummary& s) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " summary\n";
+    const char* quantiles[] = {"{quantile=\"0.5\"}", "{quantile=\"0.9\"}", "{quantile=\"0.99\"}", "{quantile=\"0.999\"}",
+                               "{quantile=\"1\"}"};
+    uint32_t values[] = {s.p50_us, s.p90_us, s.p99_us, s.p999_us, s.max_us};
+    for (int i = 0; i < 5; ++i) appendMetric(out, name, quantiles[i], values[i] / 1e6);
+    appendMetric(out, (std::string(name) + "_sum").c_str(), "", s.sum_us / 1e6);
+    appendMetric(out, (std::string(name) + "_count").c_str(), "", (double)s.count);
+}
+
+/**
+* The snapshot in the Prometheus text exposition format, one sample per line.
+*/
+inline std::string formatPrometheus(const StatsPayload& s) {
+    struct Counter { const char* name; const char* help; uint64_t value; };
+    const Counter counters[] = {
+        {"chord_lookups_served_total", "Lookup targets answered.", s.lookups_served},
+        {"chord_store_requests_served_total", "Store requests served as owner.", s.store_ops_served},
+        {"chord_successor_failovers_total", "Successors declared failed.", s.successor_failovers},
+        {"chord_predecessor_failovers_total", "Predecessors declared failed.", s.predecessor_failovers},
+        {"chord_stabilize_changes_total", "Closer successors found by stabilize.", s.stabilize_changes},
+        {"chord_join_attempts_total", "Join lookups started.", s.join_attempts},
+        {"chord_joins_total", "Successful joins.", s.joins},
+        {"chord_rpc_failures_total", "Outbound RPCs that timed out or lost their connection.", s.rpc_failures},
+        {"chord_cache_hits_total", "Relayed reads answered from the read cache.", s.cache_hits},
+        {"chord_cache_misses_total", "Relayed reads the read cache could not answer.", s.cache_misses},
+    };
+    std::string out;
+    out += "# HELP chord_uptime_seconds Time since the node started.\n# TYPE chord_uptime_seconds gauge\n";
+    appendMetric(out, "chord_uptime_seconds", "", s.uptime_ms / 1e3);
+    out += "# HELP chord_startup_seconds Time from the start until a startup step completed, absent while pending.\n"
+           "# TYPE chord_startup_seconds gauge\n";
+    const char* steps[] = {"{step=\"discovered\"}", "{step=\"joined\"}", "{step=\"certificate\"}"};
+    uint32_t step_ms[] = {s.discovered_ms, s.joined_ms, s.cert_ms};
+    for (int i = 0; i < 3; ++i) {
+        if (step_ms[i] != 0) appendMetric(out, "chord_startup_seconds", steps[i], step_ms[i] / 1e3);
+    }
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i) {
+        out += std::string("# HELP ") + counters[i].name + " " + counters[i].help + "\n# TYPE " + counters[i].name + " counter\n";
+        appendMetric(out, counters[i].name, "", (double)counters[i].value);
+    }
+
+    const char* directions[] = {"chord_requests_received_total", "chord_requests_sent_total"};
+    for (int d = 0; d < 2; ++d) {
+        out += std::string("# TYPE ") + directions[d] + " counter\n";
+        for (int i = 0; i < s.count && i < MAX_STATS_TYPES; ++i) {
+            char labels[48];
+            const char* name = messageTypeName(s.types[i].type);
+            if (name) std::snprintf(labels, sizeof(labels), "{type=\"%s\"}", name);
+            else std::snprintf(labels, sizeof(labels), "{type=\"0x%02x\"}", s.types[i].type);
+            appendMetric(out, directions[d], labels, (double)(d == 0 ? s.types[i].received : s.types[i].sent));
+        }
+    }
+
+    appendLatency(out, "chord_request_handling_seconds", "Time spent serving an inbound request.", s.handle);
+    appendLatency(out, "chord_rpc_latency_seconds", "Round trip of outbound RPCs that were answered.", s.rpc);
+    return out;
+}
+
+#endif
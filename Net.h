@@ -0,0 +1,115 @@
+#ifndef NET_H
+#define NET_H
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <netdb.h>
+#define SOCKET int
+#define INVALID_SOCKET -1
+#define SOCKET_ERROR -1
+#define closesocket close
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+inline void setNonBlocking(SOCKET sock, bool enabled) {
+#ifdef _WIN32
+    u_long mode = enabled ? 1 : 0; ioctlsocket(sock, FIONBIO, &mode);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+#endif
+}
+
+inline bool lastErrorWouldBlock() {
+#ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS;
+#endif
+}
+
+/**
+* Persistent connections carry small request/response packets, Nagle plus delayed ACKs
+* would hold every second segment back for tens of milliseconds.
+*/
+inline void setNoDelay(SOCKET sock) {
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&opt, sizeof(opt));
+}
+
+struct IoSlice {
+    const void* data;
+    size_t len;
+};
+
+/**
+* Gathers all slices into one send call (sendmsg/WSASend), the caller's buffers are not
+* copied. Returns the number of bytes written, 0 if the socket would block, -1 on error.
+*/
+inline long sendVector(SOCKET sock, const IoSlice* slices, int count) {
+#ifdef _WIN32
+    WSABUF bufs[64];
+    long total = 0;
+    for (int off = 0; off < count; off += 64) {
+        int n = count - off < 64 ? count - off : 64;
+        for (int i = 0; i < n; ++i) {
+            bufs[i].buf = (char*)slices[off + i].data;
+            bufs[i].len = (ULONG)slices[off + i].len;
+        }
+        DWORD sent = 0;
+        if (WSASend(sock, bufs, n, &sent, 0, nullptr, nullptr) == SOCKET_ERROR) {
+            return total > 0 ? total : (lastErrorWouldBlock() ? 0 : -1);
+        }
+        total += sent;
+        size_t wanted = 0;
+        for (int i = 0; i < n; ++i) wanted += bufs[i].len;
+        if (sent < wanted) break;
+    }
+    return total;
+#else
+    iovec iov[64];
+    long total = 0;
+    for (int off = 0; off < count; off += 64) {
+        int n = count - off < 64 ? count - off : 64;
+        size_t wanted = 0;
+        for (int i = 0; i < n; ++i) {
+            iov[i].iov_base = const_cast<void*>(slices[off + i].data);
+            iov[i].iov_len = slices[off + i].len;
+            wanted += slices[off + i].len;
+        }
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+#ifdef MSG_NOSIGNAL
+        ssize_t w = sendmsg(sock, &msg, MSG_NOSIGNAL);
+#else
+        ssize_t w = sendmsg(sock, &msg, 0);
+#endif
+        if (w < 0) return total > 0 ? total : (lastErrorWouldBlock() ? 0 : -1);
+        total += w;
+        if ((size_t)w < wanted) break;
+    }
+    return total;
+#endif
+}
+
+#endif
@@ -1,36 +1,116 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <algorithm>
+#include <ostream>
 
 constexpr uint16_t DEFAULT_PORT = 5000;
 constexpr int SUCLIST_SIZE = 3;
+constexpr int ID_BITS = 160;
+constexpr int MAX_LOOKUP_HOPS = 32;
+constexpr uint32_t MAX_VALUE_LEN = 8192;
+constexpr int MERKLE_FANOUT = 16;
+constexpr int MERKLE_DEPTH = 3;          // levels below the root, MERKLE_FANOUT^3 leaves
+constexpr int MAX_DIGESTS = 512;
+constexpr uint32_t TRANSFER_BATCH_BYTES = 60 * 1024;
+constexpr int MAX_BATCH_TARGETS = 256;
+constexpr int MAX_STATS_TYPES = 64;
+constexpr uint32_t MAX_PAYLOAD_LEN = 64 * 1024;
+constexpr uint32_t CERT_MAX_LEN = 1024 * 1024;
+constexpr uint32_t CERT_CHUNK_LEN = 32 * 1024;
+
+constexpr uint8_t PACKET_MAGIC = 0xCC;
+// Bumped on every incompatible change of the framing or a payload layout.
+constexpr uint8_t PROTOCOL_VERSION = 6;
 
 struct Sha1ID {
     uint8_t bytes[20];
     bool operator==(const Sha1ID& other) const { return std::memcmp(bytes, other.bytes, 20) == 0; }
     bool operator!=(const Sha1ID& other) const { return !(*this == other); }
-    uint8_t toTinyID() const { return bytes[19]; }
+    bool operator<(const Sha1ID& other) const { return std::memcmp(bytes, other.bytes, 20) < 0; }
+
+    // 160-bit addition modulo 2^160, bytes are big-endian.
+    Sha1ID operator+(const Sha1ID& other) const {
+        Sha1ID res;
+        uint16_t carry = 0;
+        for (int i = 19; i >= 0; --i) {
+            uint16_t sum = (uint16_t)bytes[i] + other.bytes[i] + carry;
+            res.bytes[i] = (uint8_t)sum;
+            carry = sum >> 8;
+        }
+        return res;
+    }
+
+    // Returns this + 2^exp (mod 2^160), used for the finger table starts.
+    Sha1ID addPowerOfTwo(int exp) const {
+        Sha1ID res = *this;
+        int idx = 19 - exp / 8;
+        uint16_t carry = (uint16_t)(1u << (exp % 8));
+        for (int i = idx; i >= 0 && carry; --i) {
+            uint16_t sum = (uint16_t)res.bytes[i] + carry;
+            res.bytes[i] = (uint8_t)sum;
+            carry = sum >> 8;
+        }
+        return res;
+    }
+
+    // 160-bit subtraction modulo 2^160, the clockwise distance from other to this.
+    Sha1ID operator-(const Sha1ID& other) const {
+        Sha1ID res;
+        int16_t borrow = 0;
+        for (int i = 19; i >= 0; --i) {
+            int16_t diff = (int16_t)bytes[i] - other.bytes[i] - borrow;
+            borrow = diff < 0 ? 1 : 0;
+            res.bytes[i] = (uint8_t)(diff + (borrow << 8));
+        }
+        return res;
+    }
+
+    // Logs the first 4 bytes in hex, enough to tell nodes apart.
     friend std::ostream& operator<<(std::ostream& os, const Sha1ID& id) {
-        os << (int)id.toTinyID();
-        return os;
+        static const char hex[] = "0123456789abcdef";
+        char s[9];
+        for (int i = 0; i < 4; ++i) {
+            s[2 * i] = hex[id.bytes[i] >> 4];
+            s[2 * i + 1] = hex[id.bytes[i] & 0x0F];
+        }
+        s[8] = 0;
+        return os << s;
     }
 };
 
 inline bool in_interval(const Sha1ID& id, const Sha1ID& start, const Sha1ID& end) {
-    auto lessThan = [](const Sha1ID& a, const Sha1ID& b) {
-        return std::memcmp(a.bytes, b.bytes, 20) < 0;
-    };
     if (start == end) return true;
-    bool start_lt_end = lessThan(start, end);
-    bool start_lt_id = lessThan(start, id);
-    bool id_le_end = (lessThan(id, end) || id == end);
+    bool start_lt_end = start < end;
+    bool start_lt_id = start < id;
+    bool id_le_end = !(end < id);
     if (start_lt_end) return start_lt_id && id_le_end;
     else return start_lt_id || id_le_end;
 }
 
+/**
+ * Share of the ring covered by (start, end], between 0 and 1. start == end is the whole ring.
+ */
+inline double ringFraction(const Sha1ID& start, const Sha1ID& end) {
+    if (start == end) return 1.0;
+    Sha1ID d = end - start;
+    uint64_t top = 0;
+    for (int i = 0; i < 8; ++i) top = (top << 8) | d.bytes[i];
+    return (double)top / 18446744073709551616.0;
+}
+
+/**
+ * Open interval (start, end) on the ring. start == end covers the whole ring except start.
+ */
+inline bool in_open_interval(const Sha1ID& id, const Sha1ID& start, const Sha1ID& end) {
+    if (id == end) return false;
+    if (start == end) return id != start;
+    return in_interval(id, start, end);
+}
+
 struct NodeInfo {
     Sha1ID id;
     uint32_t ip;
@@ -49,30 +129,393 @@ enum MessageType : uint8_t {
     MSG_GET_SUCLIST = 0x0A,
     MSG_GET_SUCLIST_RESPONSE = 0x0B,
 	MSG_GET_CERT = 0x0C,
-    MSG_CERT_RESPONSE = 0x0D
+    MSG_CERT_RESPONSE = 0x0D,
+    MSG_PUT = 0x10,
+    MSG_PUT_RESPONSE = 0x11,
+    MSG_GET = 0x12,
+    MSG_GET_RESPONSE = 0x13,
+    MSG_DELETE = 0x14,
+    MSG_DELETE_RESPONSE = 0x15,
+    MSG_REPLICATE = 0x16,
+    MSG_FETCH_ITEM = 0x17,
+    MSG_FETCH_ITEM_RESPONSE = 0x18,
+    MSG_MERKLE_NODES = 0x19,
+    MSG_MERKLE_NODES_RESPONSE = 0x1A,
+    MSG_MERKLE_LEAVES = 0x1B,
+    MSG_MERKLE_LEAVES_RESPONSE = 0x1C,
+    MSG_TRANSFER_BATCH = 0x1D,
+    MSG_TRANSFER_BATCH_RESPONSE = 0x1E,
+    MSG_LEAVE = 0x1F,
+    MSG_FIND_SUCCESSOR_BATCH = 0x20,
+    MSG_FIND_SUCCESSOR_BATCH_RESPONSE = 0x21,
+    MSG_FIND_SUCCESSOR_RECURSIVE = 0x22,
+    MSG_FIND_SUCCESSOR_RECURSIVE_ACK = 0x23,
+    MSG_LOOKUP_RESULT = 0x24,
+    MSG_STABILIZE = 0x25,
+    MSG_STABILIZE_RESPONSE = 0x26,
+    MSG_GET_STATS = 0x27,
+    MSG_GET_STATS_RESPONSE = 0x28,
+    MSG_CERT_DIGEST = 0x29,
+    MSG_CERT_CHUNK = 0x2A,
+    MSG_CERT_CHUNK_RESPONSE = 0x2B
+};
+
+enum StoreStatus : uint8_t {
+    STORE_OK = 0,
+    STORE_NOT_FOUND = 1,
+    STORE_FULL = 2,
+    STORE_TOO_LARGE = 3,
+    STORE_UNREACHABLE = 4,
+    STORE_BAD_REQUEST = 5
+};
+
+// Set by the node that routed a store request, the receiver serves it without routing again.
+constexpr uint8_t STORE_FLAG_FORWARDED = 0x01;
+
+enum CertChunkStatus : uint8_t {
+    CERT_CHUNK_OK = 0,
+    CERT_CHUNK_GONE = 1,  // the node no longer holds that version
+    CERT_CHUNK_BUSY = 2,  // too many transfers started this round, ask again later
+    CERT_CHUNK_BAD_OFFSET = 3
 };
 
 #pragma pack(push, 1)
+/**
+* Certificate record, newer ones replace older ones everywhere in the ring. Records are
+* ordered by version, equal versions by hash so that all nodes pick the same one. hash is
+* the SHA-1 of data, a record that does not match it is dropped. Version 0: no certificate.
+* sender is the node that sent the digest, a receiver that is behind fetches from it.
+*/
+struct CertDigestPayload {
+    NodeInfo sender;
+    uint64_t version;
+    Sha1ID hash;
+    uint32_t cert_len;
+};
+
+// MSG_CERT_RESPONSE, followed by the first CERT_CHUNK_LEN bytes of data at most.
 struct CertPayload {
+    uint64_t version;
+    Sha1ID hash;
     uint32_t cert_len;
-    uint8_t data[2048];
+};
+
+// MSG_CERT_CHUNK: the chunk of the record starting at offset, a multiple of CERT_CHUNK_LEN.
+struct CertChunkRequestPayload {
+    uint64_t version;
+    Sha1ID hash;
+    uint32_t offset;
+};
+
+// MSG_CERT_CHUNK_RESPONSE, followed by chunk_len bytes of data. crc is their CRC-32.
+struct CertChunkPayload {
+    uint8_t status;  // CertChunkStatus, no data unless CERT_CHUNK_OK
+    uint32_t offset;
+    uint32_t chunk_len;
+    uint32_t crc;
 };
 #pragma pack(pop)
 
 #pragma pack(push, 1)
 struct PacketHeader {
     uint8_t magic;
+    uint8_t version;     // PROTOCOL_VERSION, a peer speaking another one is disconnected
     uint8_t type;
     uint32_t payload_len;
+    uint32_t request_id; // echoed in the response, matches responses on pooled connections
 };
 
 struct FindSuccessorPayload { Sha1ID target_id; };
 struct NodeInfoPayload { NodeInfo node; };
 
+// is_owner == 0 means "node" is only the next hop, ask it again.
+struct FindSuccessorResponsePayload {
+    NodeInfo node;
+    uint8_t is_owner;
+};
+
+/**
+* MSG_FIND_SUCCESSOR_RECURSIVE: forwarded from hop to hop, each hop acknowledges it right
+* away. The node whose successor owns the key sends MSG_LOOKUP_RESULT with that
+* successor as node straight to origin, the owner itself is never asked.
+*/
+struct RecursiveLookupPayload {
+    Sha1ID target_id;
+    NodeInfo origin;
+    uint32_t lookup_id;  // chosen by origin, echoed in the result
+    uint8_t hops;
+};
+
+// MSG_LOOKUP_RESULT
+struct LookupResultPayload {
+    uint32_t lookup_id;
+    NodeInfo node;
+    uint8_t hops;
+};
+
+/**
+* Answer to MSG_STABILIZE, whose request is a NodeInfoPayload notify. Replaces the
+* GET_PREDECESSOR, GET_SUCLIST and NOTIFY round, which are still served for tools.
+*/
+struct StabilizeResponsePayload {
+    uint8_t has_predecessor;
+    NodeInfo predecessor;
+    uint8_t count;
+    NodeInfo nodes[SUCLIST_SIZE];
+};
+
+/**
+* UDP liveness probe, PacketHeader with type MSG_PING followed by this. port is the TCP
+* port of the probed node, the reply echoes the request ID.
+*/
+struct HeartbeatPayload {
+    uint16_t port;
+    uint8_t is_reply;
+};
+
+// The receiver runs the whole lookups and answers with the owners, not just the next hops.
+constexpr uint8_t LOOKUP_FLAG_RESOLVE = 0x01;
+
+// MSG_FIND_SUCCESSOR_BATCH, sent with only count targets
+struct FindSuccessorBatchPayload {
+    uint8_t flags;
+    uint16_t count;
+    Sha1ID targets[MAX_BATCH_TARGETS];
+};
+
+/**
+* MSG_FIND_SUCCESSOR_BATCH_RESPONSE, one result per target in request order, sent with
+* only count results. With LOOKUP_FLAG_RESOLVE is_owner == 0 means the lookup failed.
+*/
+struct FindSuccessorBatchResponsePayload {
+    uint16_t count;
+    FindSuccessorResponsePayload results[MAX_BATCH_TARGETS];
+};
+
+// MSG_GET / MSG_DELETE
+struct KeyPayload {
+    Sha1ID key;
+    uint8_t flags;
+};
+
+// MSG_PUT, sent with only value_len bytes of data
+struct PutPayload {
+    Sha1ID key;
+    uint8_t flags;
+    uint32_t value_len;
+    uint8_t data[MAX_VALUE_LEN];
+};
+
+// MSG_PUT_RESPONSE / MSG_DELETE_RESPONSE
+struct StatusPayload { uint8_t status; };
+
+// MSG_GET_RESPONSE, sent with only value_len bytes of data
+struct ValuePayload {
+    uint8_t status;
+    uint32_t value_len;
+    uint64_t version;  // the owner's item version, 0 unless status is STORE_OK
+    uint8_t data[MAX_VALUE_LEN];
+};
+
+// MSG_REPLICATE / MSG_FETCH_ITEM_RESPONSE, sent with only value_len bytes of data
+struct ItemPayload {
+    Sha1ID key;
+    uint64_t version;
+    uint8_t tombstone;
+    uint32_t value_len;
+    uint8_t data[MAX_VALUE_LEN];
+};
+
+/**
+* MSG_MERKLE_NODES asks for the children of the given nodes on level, MSG_MERKLE_LEAVES
+* (level == MERKLE_DEPTH) for the item digests inside the given leaves. Only keys in
+* (range_start, range_end] are covered.
+*/
+struct MerkleRequestPayload {
+    Sha1ID range_start;
+    Sha1ID range_end;
+    uint8_t level;
+    uint8_t count;
+    uint16_t indices[MERKLE_FANOUT];
+};
+
+struct MerkleHashesPayload {
+    uint8_t count;
+    uint64_t hashes[MERKLE_FANOUT * MERKLE_FANOUT];
+};
+
+struct ItemDigest {
+    Sha1ID key;
+    uint64_t version;
+    uint8_t tombstone;
+};
+
+struct DigestListPayload {
+    uint16_t count;
+    ItemDigest items[MAX_DIGESTS];
+};
+
 struct NodeListPayload {
     uint8_t count;
     NodeInfo nodes[SUCLIST_SIZE];
 };
+
+/**
+* MSG_TRANSFER_BATCH is a sequence of items, each one this header followed by value_len
+* bytes, up to TRANSFER_BATCH_BYTES per frame.
+*/
+struct TransferItemHeader {
+    Sha1ID key;
+    uint64_t version;
+    uint8_t tombstone;
+    uint32_t value_len;
+};
+
+// MSG_LEAVE: the leaving node names the neighbour that takes its place.
+struct LeavePayload {
+    NodeInfo leaving;
+    NodeInfo replacement;
+};
+
+// MSG_GET_STATS, an empty payload asks for STATS_FORMAT_BINARY.
+constexpr uint8_t STATS_FORMAT_BINARY = 0;  // StatsPayload
+constexpr uint8_t STATS_FORMAT_TEXT = 1;    // Prometheus text exposition format
+struct StatsRequestPayload {
+    uint8_t format;
+};
+
+// Latency percentiles in microseconds, each rounded up by at most 1/16.
+struct LatencySummary {
+    uint64_t count;
+    uint64_t sum_us;
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t p999_us;
+    uint32_t max_us;
+};
+
+struct MessageCount {
+    uint8_t type;
+    uint64_t received;  // requests of this type served
+    uint64_t sent;      // requests of this type sent
+};
+
+/**
+* MSG_GET_STATS_RESPONSE, sent with only count message types. Counters run since the
+* start of the node. RPC counters and latencies cover all virtual nodes of the host, the
+* ring counters only the node asked.
+*/
+struct StatsPayload {
+    uint64_t uptime_ms;
+    uint64_t lookups_served;
+    uint64_t store_ops_served;
+    uint64_t successor_failovers;
+    uint64_t predecessor_failovers;
+    uint64_t stabilize_changes;
+    uint64_t join_attempts;
+    uint64_t joins;
+    uint64_t rpc_failures;
+    uint64_t cache_hits;    // relayed reads answered from the read cache
+    uint64_t cache_misses;  // relayed reads the read cache could not answer
+    // Startup timeline in ms after the process started, 0 while the step is pending.
+    uint32_t discovered_ms;  // bootstrap chosen, or no other node found
+    uint32_t joined_ms;      // successor found, or started the ring
+    uint32_t cert_ms;        // first certificate received
+    LatencySummary handle;  // inbound requests, time in the handler
+    LatencySummary rpc;     // outbound RPCs, round trip
+    uint8_t count;
+    MessageCount types[MAX_STATS_TYPES];
+};
 #pragma pack(pop)
 
+inline PacketHeader makeHeader(uint8_t type, uint32_t request_id, uint32_t payload_len) {
+    PacketHeader hdr;
+    hdr.magic = PACKET_MAGIC;
+    hdr.version = PROTOCOL_VERSION;
+    hdr.type = type;
+    hdr.payload_len = payload_len;
+    hdr.request_id = request_id;
+    return hdr;
+}
+
+/**
+* Checks a frame's payload length against what its type can carry, before the payload is
+* buffered or a handler sees it. Handlers still check counts inside the payload. Types this
+* version does not know are passed on up to MAX_PAYLOAD_LEN and ignored by the handlers.
+*/
+inline bool payloadLenValid(uint8_t type, uint32_t len) {
+    uint32_t min_len = 0, max_len = MAX_PAYLOAD_LEN;
+    switch (type) {
+        case MSG_PING:
+        case MSG_GET_PREDECESSOR:  // also the answer of a node without predecessor
+        case MSG_GET_SUCLIST:
+        case MSG_GET_CERT:
+        case MSG_FIND_SUCCESSOR_RECURSIVE_ACK:
+            max_len = 0; break;
+        case MSG_FIND_SUCCESSOR:
+            min_len = max_len = sizeof(FindSuccessorPayload); break;
+        case MSG_FIND_SUCCESSOR_RESPONSE:
+            min_len = sizeof(NodeInfoPayload); max_len = sizeof(FindSuccessorResponsePayload); break;
+        case MSG_NOTIFY:
+        case MSG_GET_PREDECESSOR_RESPONSE:
+        case MSG_SET_SUCCESSOR:
+        case MSG_SET_PREDECESSOR:
+        case MSG_STABILIZE:
+            min_len = max_len = sizeof(NodeInfoPayload); break;
+        case MSG_GET_SUCLIST_RESPONSE:
+            min_len = max_len = sizeof(NodeListPayload); break;
+        case MSG_CERT_DIGEST:
+            min_len = max_len = sizeof(CertDigestPayload); break;
+        case MSG_CERT_RESPONSE:
+            min_len = sizeof(CertPayload); max_len = sizeof(CertPayload) + CERT_CHUNK_LEN; break;
+        case MSG_CERT_CHUNK:
+            min_len = max_len = sizeof(CertChunkRequestPayload); break;
+        case MSG_CERT_CHUNK_RESPONSE:
+            min_len = sizeof(CertChunkPayload); max_len = sizeof(CertChunkPayload) + CERT_CHUNK_LEN; break;
+        case MSG_PUT:
+            min_len = offsetof(PutPayload, data); max_len = sizeof(PutPayload); break;
+        case MSG_GET:
+        case MSG_DELETE:
+        case MSG_FETCH_ITEM:
+            min_len = max_len = sizeof(KeyPayload); break;
+        case MSG_PUT_RESPONSE:
+        case MSG_DELETE_RESPONSE:
+        case MSG_TRANSFER_BATCH_RESPONSE:
+            min_len = max_len = sizeof(StatusPayload); break;
+        case MSG_GET_RESPONSE:  // a bare status on errors
+            min_len = sizeof(StatusPayload); max_len = sizeof(ValuePayload); break;
+        case MSG_REPLICATE:
+            min_len = offsetof(ItemPayload, data); max_len = sizeof(ItemPayload); break;
+        case MSG_FETCH_ITEM_RESPONSE:  // empty if the item is unknown
+            max_len = sizeof(ItemPayload); break;
+        case MSG_MERKLE_NODES:
+        case MSG_MERKLE_LEAVES:
+            min_len = max_len = sizeof(MerkleRequestPayload); break;
+        case MSG_MERKLE_NODES_RESPONSE:
+            min_len = offsetof(MerkleHashesPayload, hashes); max_len = sizeof(MerkleHashesPayload); break;
+        case MSG_MERKLE_LEAVES_RESPONSE:
+            min_len = offsetof(DigestListPayload, items); max_len = sizeof(DigestListPayload); break;
+        case MSG_TRANSFER_BATCH:
+            max_len = TRANSFER_BATCH_BYTES; break;
+        case MSG_LEAVE:
+            min_len = max_len = sizeof(LeavePayload); break;
+        case MSG_FIND_SUCCESSOR_BATCH:
+            min_len = offsetof(FindSuccessorBatchPayload, targets); max_len = sizeof(FindSuccessorBatchPayload); break;
+        case MSG_FIND_SUCCESSOR_BATCH_RESPONSE:
+            min_len = offsetof(FindSuccessorBatchResponsePayload, results); max_len = sizeof(FindSuccessorBatchResponsePayload); break;
+        case MSG_FIND_SUCCESSOR_RECURSIVE:
+            min_len = max_len = sizeof(RecursiveLookupPayload); break;
+        case MSG_LOOKUP_RESULT:
+            min_len = max_len = sizeof(LookupResultPayload); break;
+        case MSG_STABILIZE_RESPONSE:
+            min_len = max_len = sizeof(StabilizeResponsePayload); break;
+        case MSG_GET_STATS:
+            max_len = sizeof(StatsRequestPayload); break;
+        default:
+            break;
+    }
+    return len >= min_len && len <= max_len;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,116 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+* Read-copy-update for data that one thread writes and many threads read. The writer
+* publishes a fresh copy instead of changing the current one, readers take no lock and
+* write nothing the writer waits for. A replaced copy is freed once no reader can still
+* hold it: every reader announces the epoch it entered its read section in, and a copy
+* retired in epoch e is freed when no reader is inside a section older than e.
+*/
+class RcuDomain {
+public:
+    static const int MAX_READERS = 64;
+
+    RcuDomain() : epoch(1), readers(0) {
+        for (int i = 0; i < MAX_READERS; ++i) slots[i].store(IDLE);
+    }
+
+    ~RcuDomain() {
+        for (size_t i = 0; i < retired.size(); ++i) retired[i].destroy(retired[i].ptr);
+    }
+
+    // Slot of a new reader thread, -1 if all are taken. Called by the writer before the
+    // reader starts.
+    int addReader() {
+        if (readers >= MAX_READERS) return -1;
+        return readers++;
+    }
+
+    void readLock(int reader) { slots[reader].store(epoch.load()); }
+    void readUnlock(int reader) { slots[reader].store(IDLE); }
+
+    // Writer only. old is freed once the readers that may still see it are done.
+    template <typename T>
+    void retire(const T* old) {
+        Retired r;
+        r.epoch = epoch.fetch_add(1) + 1;
+        r.ptr = const_cast<T*>(old);
+        r.destroy = &destroy<T>;
+        retired.push_back(r);
+    }
+
+    // Writer only, frees what no reader can see any more. Cheap if there is nothing.
+    void reclaim() {
+        if (retired.empty()) return;
+        uint64_t oldest = IDLE;
+        for (int i = 0; i < readers; ++i) {
+            uint64_t s = slots[i].load();
+            if (s < oldest) oldest = s;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); ++i) {
+            if (retired[i].epoch <= oldest) retired[i].destroy(retired[i].ptr);
+            else retired[kept++] = retired[i];
+        }
+        retired.resize(kept);
+    }
+
+private:
+    static const uint64_t IDLE = ~0ull;
+
+    struct Retired {
+        uint64_t epoch;
+        void* ptr;
+        void (*destroy)(void*);
+    };
+
+    template <typename T>
+    static void destroy(void* p) { delete (T*)p; }
+
+    std::atomic<uint64_t> epoch;
+    int readers;
+    std::atomic<uint64_t> slots[MAX_READERS];  // epoch of the reader's open section, IDLE outside
+    std::vector<Retired> retired;
+};
+
+// Read section of one reader thread, the pointers read inside stay valid until it ends.
+class RcuReadGuard {
+public:
+    RcuReadGuard(RcuDomain& rcu, int reader) : rcu(rcu), reader(reader) { rcu.readLock(reader); }
+    ~RcuReadGuard() { rcu.readUnlock(reader); }
+
+private:
+    RcuDomain& rcu;
+    int reader;
+};
+
+/**
+* The current copy of a T. Readers call read() inside a read section, the writer replaces
+* the copy with publish().
+*/
+template <typename T>
+class RcuPtr {
+public:
+    RcuPtr() : current(nullptr) {}
+    ~RcuPtr() { delete current.load(); }
+
+    const T* read() const { return current.load(); }
+
+    void publish(RcuDomain& rcu, const T* fresh) {
+        const T* old = current.exchange(fresh);
+        if (old) rcu.retire(old);
+    }
+
+private:
+    RcuPtr(const RcuPtr&) = delete;
+    RcuPtr& operator=(const RcuPtr&) = delete;
+
+    std::atomic<const T*> current;
+};
+
+#endif
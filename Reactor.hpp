@@ -0,0 +1,894 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "Log.hpp"
+#include "Net.h"
+#include "Protocol.h"
+#include "Transport.hpp"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+constexpr int MAX_CONNECTIONS = 1024;
+constexpr size_t RX_BUFFER_SIZE = 16 * 1024;  // per connection, holds every frame but transfer batches and cert chunks
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/**
+* Single-threaded event loop over all inbound and outbound connections. Sockets are
+* non-blocking, partial reads and writes stay buffered per connection, and outbound RPCs
+* complete through callbacks matched by request ID. Nothing in here ever blocks on a peer.
+* Other threads may only post(), adopt() and reply().
+*/
+class Reactor : public Transport {
+public:
+    // Called on the loop thread for each accepted connection, which it then owns.
+    typedef std::function<void(SOCKET sock, uint16_t local_port, const sockaddr_in& peer)> AcceptHandler;
+
+    // shared_metrics: counters to add to instead of our own, e.g. those of another reactor.
+    explicit Reactor(RpcMetrics* shared_metrics = nullptr)
+        : heartbeat_sock(INVALID_SOCKET), heartbeat_port(0), wake_sock(INVALID_SOCKET), wake_pending(false),
+          next_conn_id(1), next_request_id(1), rpc_metrics(shared_metrics ? shared_metrics : &own_metrics),
+          loop_thread(std::this_thread::get_id()) {
+#ifdef __linux__
+        epoll_fd = epoll_create1(0);
+#endif
+        openWakeSocket();
+    }
+
+    ~Reactor() {
+        for (auto& it : conns) {
+            closesocket(it.second->sock);
+            delete it.second;
+        }
+        for (auto& it : listeners) closesocket(it.first);
+        if (heartbeat_sock != INVALID_SOCKET) closesocket(heartbeat_sock);
+        if (wake_sock != INVALID_SOCKET) closesocket(wake_sock);
+#ifdef __linux__
+        close(epoll_fd);
+#endif
+    }
+
+    /**
+    * Accepts connections on port. May be called for several ports, requests are then
+    * dispatched to the handler registered for the port they arrived on.
+    */
+    bool listen(uint16_t port) {
+        SOCKET listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_sock == INVALID_SOCKET) return false;
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+
+        int opt = 1; setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+        if (bind(listen_sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            ::listen(listen_sock, 64) == SOCKET_ERROR) {
+            closesocket(listen_sock);
+            return false;
+        }
+        setNonBlocking(listen_sock, true);
+        listeners[listen_sock] = port;
+        watch(listen_sock, false);
+        return true;
+    }
+
+    /**
+    * Opens the UDP heartbeat socket on port. probe() then sends one datagram each way
+    * instead of a MSG_PING on the connection, where it could wait behind a bulk transfer.
+    * Peers must use the same port, a probe without a UDP answer is repeated over TCP.
+    */
+    bool enableHeartbeat(uint16_t port) {
+        SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock == INVALID_SOCKET) return false;
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            closesocket(sock);
+            return false;
+        }
+        setNonBlocking(sock, true);
+        heartbeat_sock = sock;
+        heartbeat_port = port;
+        watch(sock, false);
+        return true;
+    }
+
+    // Handler for requests on every port without a handler of its own.
+    void onRequest(RequestHandler handler) override { request_handler = handler; }
+
+    void onRequest(uint16_t port, RequestHandler handler) { port_handlers[port] = handler; }
+
+    // Accepted connections go to handler instead of being served here.
+    void onAccept(AcceptHandler handler) { accept_handler = handler; }
+
+    // The thread that calls poll() from now on, by default the one that constructed us.
+    void runOnThisThread() { loop_thread = std::this_thread::get_id(); }
+
+    /**
+    * Runs task on the loop thread during its next poll(), which is woken up for it. May be
+    * called from any thread.
+    */
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(posted_mutex);
+            posted.push_back(std::move(task));
+        }
+        if (!wake_pending.exchange(true) && wake_sock != INVALID_SOCKET) {
+            char b = 0;
+            sendto(wake_sock, &b, 1, 0, (struct sockaddr*)&wake_addr, sizeof(wake_addr));
+        }
+    }
+
+    // Takes over a connection accepted by another reactor. May be called from any thread.
+    void adopt(SOCKET sock, uint16_t local_port, const sockaddr_in& peer) {
+        post([this, sock, local_port, peer]() {
+            if ((int)conns.size() >= MAX_CONNECTIONS) {
+                closesocket(sock);
+                return;
+            }
+            addInbound(sock, local_port, peer);
+        });
+    }
+
+    void call(const NodeInfo& target, uint8_t type, const void* payload, uint32_t len, uint16_t timeout_ms, RpcCallback cb) override {
+        rpc_metrics->requests_out[type].fetch_add(1, std::memory_order_relaxed);
+        Connection* conn = outboundTo(target);
+        if (!conn) {
+            failNow(cb);
+            return;
+        }
+        queuePacket(conn, type, addPending(conn, timeout_ms, std::move(cb)), payload, len);
+    }
+
+    /**
+    * If nothing is queued on the connection the slices are written straight to the socket
+    * and only an unsent tail is copied, so the slices may point into buffers that change
+    * after callv() returns.
+    */
+    void callv(const NodeInfo& target, uint8_t type, const IoSlice* slices, int count, uint16_t timeout_ms, RpcCallback cb) override {
+        rpc_metrics->requests_out[type].fetch_add(1, std::memory_order_relaxed);
+        Connection* conn = outboundTo(target);
+        if (!conn) {
+            failNow(cb);
+            return;
+        }
+        queuePacketv(conn, type, addPending(conn, timeout_ms, std::move(cb)), slices, count);
+    }
+
+    /**
+    * Requests handed to us by another reactor are answered through that one. From another
+    * thread the reply is copied and posted to the loop thread.
+    */
+    void reply(const ReplyTo& to, uint8_t type, const void* payload, uint32_t len) override {
+        IoSlice slice;
+        slice.data = payload;
+        slice.len = len;
+        replyv(to, type, &slice, 1);
+    }
+
+    void replyv(const ReplyTo& to, uint8_t type, const IoSlice* slices, int count) override {
+        if (to.origin && to.origin != this) {
+            to.origin->replyv(to, type, slices, count);
+            return;
+        }
+        if (std::this_thread::get_id() != loop_thread) {
+            std::vector<uint8_t> data;
+            for (int i = 0; i < count; ++i) data.insert(data.end(), (const uint8_t*)slices[i].data, (const uint8_t*)slices[i].data + slices[i].len);
+            ReplyTo local = to;
+            post([this, local, type, data]() { reply(local, type, data.data(), (uint32_t)data.size()); });
+            return;
+        }
+        auto it = conns.find(to.sock);
+        if (it == conns.end() || it->second->id != to.conn_id || it->second->dead) return;
+        queuePacketv(it->second, type, to.request_id, slices, count);
+    }
+
+    void evict(const NodeInfo& target) override {
+        auto it = outbound.find(peerKey(target.ip, target.port));
+        if (it != outbound.end()) fail(it->second);
+    }
+
+    uint64_t nowMs() const override {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void probe(const NodeInfo& target, uint16_t timeout_ms, RpcCallback cb) override {
+        if (heartbeat_sock == INVALID_SOCKET) {
+            Transport::probe(target, timeout_ms, cb);
+            return;
+        }
+        uint32_t request_id = nextRequestId();
+        rpc_metrics->requests_out[MSG_PING].fetch_add(1, std::memory_order_relaxed);
+        sendHeartbeat(target.ip, heartbeat_port, request_id, target.port, false);
+        Probe& p = probes[request_id];
+        p.target = target;
+        p.timeout_ms = timeout_ms;
+        p.cb = cb;
+        p.sent = std::chrono::steady_clock::now();
+        p.deadline = p.sent + std::chrono::milliseconds(timeout_ms);
+    }
+
+    const RpcMetrics* rpcMetrics() const override { return rpc_metrics; }
+
+    // The counters this reactor adds to, for reactors that should share them.
+    RpcMetrics* sharedMetrics() { return rpc_metrics; }
+
+    /**
+    * One loop iteration: waits up to timeout_ms for I/O, serves everything that is ready
+    * and expires overdue RPCs.
+    */
+    void poll(int timeout_ms) {
+        if (!failed.empty()) timeout_ms = 0;
+
+#ifdef __linux__
+        epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, 64, timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            uint32_t ev = events[i].events;
+            handleEvent(events[i].data.fd, (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0, (ev & EPOLLOUT) != 0);
+        }
+#else
+        std::vector<pollfd> fds;
+        fds.reserve(conns.size() + 1);
+        for (auto& it : listeners) {
+            pollfd lp; lp.fd = it.first; lp.events = POLLIN; lp.revents = 0;
+            fds.push_back(lp);
+        }
+        if (heartbeat_sock != INVALID_SOCKET) {
+            pollfd hp; hp.fd = heartbeat_sock; hp.events = POLLIN; hp.revents = 0;
+            fds.push_back(hp);
+        }
+        if (wake_sock != INVALID_SOCKET) {
+            pollfd wp; wp.fd = wake_sock; wp.events = POLLIN; wp.revents = 0;
+            fds.push_back(wp);
+        }
+        for (auto& it : conns) {
+            pollfd p; p.fd = it.first; p.revents = 0;
+            p.events = POLLIN | (it.second->want_write ? POLLOUT : 0);
+            fds.push_back(p);
+        }
+#ifdef _WIN32
+        int n = fds.empty() ? 0 : WSAPoll(fds.data(), (ULONG)fds.size(), timeout_ms);
+#else
+        int n = fds.empty() ? 0 : ::poll(fds.data(), fds.size(), timeout_ms);
+#endif
+        for (size_t i = 0; n > 0 && i < fds.size(); ++i) {
+            if (fds[i].revents == 0) continue;
+            handleEvent(fds[i].fd, (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0, (fds[i].revents & POLLOUT) != 0);
+        }
+#endif
+
+        runPosted();
+        expireTimeouts();
+        runFailedCallbacks();
+        reap();
+    }
+
+private:
+    struct Pending {
+        uint32_t request_id;
+        RpcCallback cb;
+        std::chrono::steady_clock::time_point sent;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    // A UDP probe in flight.
+    struct Probe {
+        NodeInfo target;
+        uint16_t timeout_ms;
+        RpcCallback cb;
+        std::chrono::steady_clock::time_point sent;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    struct Connection {
+        SOCKET sock;
+        uint64_t id;
+        bool inbound;
+        uint16_t local_port;  // listening port an inbound connection was accepted on
+        bool connecting;
+        bool want_write;
+        bool dead;
+        uint32_t ip;
+        uint16_t port;
+        std::vector<uint8_t> rx;  // received bytes, read into in place
+        size_t rx_len;            // bytes of rx holding data
+        std::vector<uint8_t> tx;
+        size_t tx_off;
+        // Only a handful of RPCs are in flight per connection. A flat list is scanned
+        // faster than a tree is walked and keeps its memory from one RPC to the next.
+        std::vector<Pending> pending;
+    };
+
+    static uint64_t peerKey(uint32_t ip, uint16_t port) { return ((uint64_t)ip << 16) | port; }
+
+    Connection* addConnection(SOCKET sock, bool inbound) {
+        Connection* conn = new Connection();
+        conn->sock = sock;
+        conn->id = next_conn_id++;
+        conn->inbound = inbound;
+        conn->local_port = 0;
+        conn->connecting = false;
+        conn->want_write = false;
+        conn->dead = false;
+        conn->ip = 0;
+        conn->port = 0;
+        conn->rx.resize(RX_BUFFER_SIZE);
+        conn->rx_len = 0;
+        conn->tx_off = 0;
+        conns[sock] = conn;
+        return conn;
+    }
+
+    Connection* outboundTo(const NodeInfo& target) {
+        auto it = outbound.find(peerKey(target.ip, target.port));
+        if (it != outbound.end()) return it->second;
+        if ((int)conns.size() >= MAX_CONNECTIONS) return nullptr;
+
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return nullptr;
+        setNonBlocking(sock, true);
+        setNoDelay(sock);
+
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = target.ip;
+        addr.sin_port = htons(target.port);
+
+        bool connecting = false;
+        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            if (!lastErrorWouldBlock()) {
+                closesocket(sock);
+                return nullptr;
+            }
+            connecting = true;
+        }
+
+        Connection* conn = addConnection(sock, false);
+        conn->connecting = connecting;
+        conn->ip = target.ip;
+        conn->port = target.port;
+        outbound[peerKey(target.ip, target.port)] = conn;
+        watch(sock, connecting);
+        conn->want_write = connecting;
+        return conn;
+    }
+
+    uint32_t nextRequestId() {
+        uint32_t request_id = next_request_id++;
+        if (next_request_id == 0) next_request_id = 1;
+        return request_id;
+    }
+
+    uint32_t addPending(Connection* conn, uint16_t timeout_ms, RpcCallback cb) {
+        uint32_t request_id = nextRequestId();
+        if (cb) {
+            conn->pending.push_back(Pending());
+            Pending& p = conn->pending.back();
+            p.request_id = request_id;
+            p.cb = std::move(cb);
+            p.sent = std::chrono::steady_clock::now();
+            p.deadline = p.sent + std::chrono::milliseconds(timeout_ms);
+        }
+        return request_id;
+    }
+
+    Pending* findPending(Connection* conn, uint32_t request_id) {
+        for (size_t i = 0; i < conn->pending.size(); ++i) {
+            if (conn->pending[i].request_id == request_id) return &conn->pending[i];
+        }
+        return nullptr;
+    }
+
+    // Moves the last entry into the gap, order does not matter.
+    void removePending(Connection* conn, size_t i) {
+        if (i + 1 < conn->pending.size()) conn->pending[i] = std::move(conn->pending.back());
+        conn->pending.pop_back();
+    }
+
+    void queuePacket(Connection* conn, uint8_t type, uint32_t request_id, const void* payload, uint32_t len) {
+        IoSlice slice;
+        slice.data = payload;
+        slice.len = len;
+        queuePacketv(conn, type, request_id, &slice, len > 0 ? 1 : 0);
+    }
+
+    /**
+    * Header and payload leave in one gather write, so a request is one segment on the
+    * wire and nothing is copied unless the socket cannot take it all.
+    */
+    void queuePacketv(Connection* conn, uint8_t type, uint32_t request_id, const IoSlice* slices, int count) {
+        uint32_t len = 0;
+        for (int i = 0; i < count; ++i) len += (uint32_t)slices[i].len;
+        PacketHeader hdr = makeHeader(type, request_id, len);
+
+        // Only transfer batches have more slices than fit on the stack.
+        IoSlice local[8];
+        std::vector<IoSlice> many;
+        IoSlice* all = local;
+        int all_count = count + 1;
+        if (all_count > 8) {
+            many.resize(all_count);
+            all = many.data();
+        }
+        all[0].data = &hdr;
+        all[0].len = sizeof(hdr);
+        for (int i = 0; i < count; ++i) all[i + 1] = slices[i];
+
+        size_t skip = 0;
+        if (!conn->connecting && conn->tx.empty()) {
+            long w = sendVector(conn->sock, all, all_count);
+            if (w < 0) {
+                fail(conn);
+                return;
+            }
+            skip = (size_t)w;
+        }
+        for (int i = 0; i < all_count; ++i) {
+            if (skip >= all[i].len) {
+                skip -= all[i].len;
+                continue;
+            }
+            const uint8_t* p = (const uint8_t*)all[i].data;
+            conn->tx.insert(conn->tx.end(), p + skip, p + all[i].len);
+            skip = 0;
+        }
+        if (!conn->connecting && !conn->tx.empty()) flush(conn);
+    }
+
+    void handleEvent(SOCKET sock, bool readable, bool writable) {
+        if (sock == heartbeat_sock) {
+            readHeartbeats();
+            return;
+        }
+        if (sock == wake_sock) {
+            char buf[16];
+            for (int i = 0; i < 64 && recv(wake_sock, buf, sizeof(buf), 0) > 0; ++i) {}
+            return;
+        }
+        auto listener = listeners.find(sock);
+        if (listener != listeners.end()) {
+            acceptAll(listener->first, listener->second);
+            return;
+        }
+        auto it = conns.find(sock);
+        if (it == conns.end() || it->second->dead) return;
+        Connection* conn = it->second;
+
+        if (writable) {
+            if (conn->connecting) {
+                int err = 0; socklen_t err_len = sizeof(err);
+                if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&err, &err_len) != 0 || err != 0) {
+                    fail(conn);
+                    return;
+                }
+                conn->connecting = false;
+            }
+            flush(conn);
+        }
+        if (readable && !conn->dead) readAll(conn);
+    }
+
+    void acceptAll(SOCKET listen_sock, uint16_t port) {
+        while (true) {
+            sockaddr_in c_addr; socklen_t c_len = sizeof(c_addr);
+            SOCKET client = accept(listen_sock, (struct sockaddr*)&c_addr, &c_len);
+            if (client == INVALID_SOCKET) return;
+            if ((int)conns.size() >= MAX_CONNECTIONS) {
+                closesocket(client);
+                continue;
+            }
+            setNonBlocking(client, true);
+            setNoDelay(client);
+            if (accept_handler) accept_handler(client, port, c_addr);
+            else addInbound(client, port, c_addr);
+        }
+    }
+
+    void addInbound(SOCKET sock, uint16_t local_port, const sockaddr_in& peer) {
+        Connection* conn = addConnection(sock, true);
+        conn->local_port = local_port;
+        conn->ip = peer.sin_addr.s_addr;
+        conn->port = ntohs(peer.sin_port);
+        watch(sock, false);
+    }
+
+    void readAll(Connection* conn) {
+        while (true) {
+            if (conn->rx_len == conn->rx.size()) {
+                // Serve what is complete to make room. A single frame that still does not
+                // fit is a transfer batch or a cert chunk, processFrames() has checked its length.
+                processFrames(conn);
+                if (conn->dead) return;
+                if (conn->rx_len == conn->rx.size()) conn->rx.resize(sizeof(PacketHeader) + MAX_PAYLOAD_LEN);
+            }
+            int r = recv(conn->sock, (char*)conn->rx.data() + conn->rx_len, conn->rx.size() - conn->rx_len, 0);
+            if (r > 0) {
+                conn->rx_len += r;
+                continue;
+            }
+            if (r < 0 && lastErrorWouldBlock()) break;
+            // EOF or hard error, serve what arrived completely, then drop the connection.
+            processFrames(conn);
+            fail(conn);
+            return;
+        }
+        processFrames(conn);
+    }
+
+    void processFrames(Connection* conn) {
+        size_t off = 0;
+        while (!conn->dead && conn->rx_len - off >= sizeof(PacketHeader)) {
+            PacketHeader hdr;
+            std::memcpy(&hdr, conn->rx.data() + off, sizeof(hdr));
+            if (!headerValid(conn, hdr)) {
+                fail(conn);
+                return;
+            }
+            if (conn->rx_len - off < sizeof(hdr) + hdr.payload_len) break;
+            const uint8_t* payload = conn->rx.data() + off + sizeof(hdr);
+            off += sizeof(hdr) + hdr.payload_len;
+
+            if (conn->inbound) {
+                ReplyTo from;
+                from.sock = conn->sock;
+                from.conn_id = conn->id;
+                from.request_id = hdr.request_id;
+                from.origin = this;
+                rpc_metrics->requests_in[hdr.type].fetch_add(1, std::memory_order_relaxed);
+                auto start = std::chrono::steady_clock::now();
+                auto h = port_handlers.find(conn->local_port);
+                if (h != port_handlers.end()) h->second(from, hdr, payload);
+                else if (request_handler) request_handler(from, hdr, payload);
+                rpc_metrics->handle_us.record(microsSince(start));
+            } else {
+                Pending* p = findPending(conn, hdr.request_id);
+                if (!p) continue; // late response of an expired RPC
+                RpcCallback cb = std::move(p->cb);
+                rpc_metrics->rpc_us.record(microsSince(p->sent));
+                removePending(conn, p - conn->pending.data());
+                cb(true, hdr, payload);
+            }
+        }
+        if (conn->dead) return;
+        // A partial header is checked as far as it goes, the 10 byte header of a peer from
+        // before versioning would otherwise wait for a byte that never comes.
+        size_t left = conn->rx_len - off;
+        if (left >= 2 && left < sizeof(PacketHeader)) {
+            PacketHeader hdr;
+            std::memset(&hdr, 0, sizeof(hdr));
+            std::memcpy(&hdr, conn->rx.data() + off, left);
+            if (hdr.magic != PACKET_MAGIC || hdr.version != PROTOCOL_VERSION) {
+                headerValid(conn, hdr);
+                fail(conn);
+                return;
+            }
+        }
+        if (off == 0) return;
+        // Only the start of an incomplete frame is left, usually nothing.
+        conn->rx_len -= off;
+        if (conn->rx_len > 0) std::memmove(conn->rx.data(), conn->rx.data() + off, conn->rx_len);
+    }
+
+    /**
+    * Checked as soon as a header is in, before its payload is buffered. Anything else on
+    * the connection would be misframed as well, so a bad header ends the connection.
+    */
+    bool headerValid(const Connection* conn, const PacketHeader& hdr) {
+        if (hdr.magic == PACKET_MAGIC && hdr.version == PROTOCOL_VERSION && payloadLenValid(hdr.type, hdr.payload_len)) return true;
+        if (LOG_LEVEL_WARN < LOG_MIN_LEVEL || !Logger::instance().enabled(LOG_LEVEL_WARN)) return false;
+        LogLine line(LOG_LEVEL_WARN);
+        line << "[NET] Dropping connection with " << inet_ntoa(*(in_addr*)&conn->ip) << ":" << conn->port << ", ";
+        if (hdr.magic != PACKET_MAGIC) line << "not a chord peer";
+        else if (hdr.version != PROTOCOL_VERSION) line << "protocol version " << (int)hdr.version << " instead of " << (int)PROTOCOL_VERSION;
+        else line << "message type 0x" << std::hex << (int)hdr.type << std::dec << " cannot have " << hdr.payload_len << " bytes";
+        return false;
+    }
+
+    void sendHeartbeat(uint32_t ip, uint16_t udp_port, uint32_t request_id, uint16_t node_port, bool is_reply) {
+        uint8_t buf[sizeof(PacketHeader) + sizeof(HeartbeatPayload)];
+        PacketHeader hdr = makeHeader(MSG_PING, request_id, sizeof(HeartbeatPayload));
+        HeartbeatPayload hb;
+        hb.port = node_port;
+        hb.is_reply = is_reply ? 1 : 0;
+        std::memcpy(buf, &hdr, sizeof(hdr));
+        std::memcpy(buf + sizeof(hdr), &hb, sizeof(hb));
+
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = ip;
+        addr.sin_port = htons(udp_port);
+        // A lost datagram is a timeout like any other.
+        sendto(heartbeat_sock, (const char*)buf, sizeof(buf), 0, (struct sockaddr*)&addr, sizeof(addr));
+    }
+
+    /**
+    * Answers probes for the ports we listen on and completes our own probes. The event
+    * loop answering is the proof of life, the nodes themselves are not involved.
+    */
+    void readHeartbeats() {
+        // Bounded, an error that does not go away must not spin the loop.
+        for (int i = 0; i < 64; ++i) {
+            uint8_t buf[sizeof(PacketHeader) + sizeof(HeartbeatPayload)];
+            sockaddr_in from; socklen_t from_len = sizeof(from);
+            int r = recvfrom(heartbeat_sock, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+            if (r < 0 && lastErrorWouldBlock()) return;
+            if (r != (int)sizeof(buf)) continue;  // e.g. ICMP unreachable reported on Windows
+
+            PacketHeader hdr;
+            HeartbeatPayload hb;
+            std::memcpy(&hdr, buf, sizeof(hdr));
+            std::memcpy(&hb, buf + sizeof(hdr), sizeof(hb));
+            if (hdr.magic != PACKET_MAGIC || hdr.version != PROTOCOL_VERSION || hdr.type != MSG_PING) continue;
+
+            if (!hb.is_reply) {
+                if (!isListening(hb.port)) continue;
+                rpc_metrics->requests_in[MSG_PING].fetch_add(1, std::memory_order_relaxed);
+                sendHeartbeat(from.sin_addr.s_addr, ntohs(from.sin_port), hdr.request_id, hb.port, true);
+                continue;
+            }
+            auto p = probes.find(hdr.request_id);
+            if (p == probes.end() || p->second.target.ip != from.sin_addr.s_addr) continue;
+            RpcCallback cb = p->second.cb;
+            rpc_metrics->rpc_us.record(microsSince(p->second.sent));
+            probes.erase(p);
+            cb(true, hdr, nullptr);
+        }
+    }
+
+    bool isListening(uint16_t port) const {
+        for (auto& it : listeners) {
+            if (it.second == port) return true;
+        }
+        return false;
+    }
+
+    void flush(Connection* conn) {
+        while (conn->tx_off < conn->tx.size()) {
+            int w = ::send(conn->sock, (const char*)conn->tx.data() + conn->tx_off, conn->tx.size() - conn->tx_off, SEND_FLAGS);
+            if (w > 0) {
+                conn->tx_off += w;
+                continue;
+            }
+            if (w < 0 && lastErrorWouldBlock()) {
+                setWantWrite(conn, true);
+                return;
+            }
+            fail(conn);
+            return;
+        }
+        conn->tx.clear();
+        conn->tx_off = 0;
+        setWantWrite(conn, false);
+    }
+
+    void expireTimeouts() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& it : conns) {
+            Connection* conn = it.second;
+            if (conn->dead) continue;
+            bool expired = false;
+            for (size_t i = 0; i < conn->pending.size(); ) {
+                if (conn->pending[i].deadline <= now) {
+                    failNow(conn->pending[i].cb);
+                    removePending(conn, i);
+                    expired = true;
+                } else {
+                    ++i;
+                }
+            }
+            // A peer that did not even accept the connection in time is treated as down.
+            if (expired && conn->connecting) fail(conn);
+        }
+
+        // Datagrams get lost, or the peer has no heartbeat socket. Ask once more over TCP.
+        std::vector<Probe> expired_probes;
+        for (auto p = probes.begin(); p != probes.end(); ) {
+            if (p->second.deadline <= now) {
+                expired_probes.push_back(p->second);
+                p = probes.erase(p);
+            } else {
+                ++p;
+            }
+        }
+        for (size_t i = 0; i < expired_probes.size(); ++i) {
+            const Probe& p = expired_probes[i];
+            call(p.target, MSG_PING, nullptr, 0, p.timeout_ms, p.cb);
+        }
+    }
+
+    void fail(Connection* conn) {
+        if (conn->dead) return;
+        conn->dead = true;
+        unwatch(conn->sock);
+        if (!conn->inbound) {
+            auto it = outbound.find(peerKey(conn->ip, conn->port));
+            if (it != outbound.end() && it->second == conn) outbound.erase(it);
+        }
+        for (size_t i = 0; i < conn->pending.size(); ++i) failNow(conn->pending[i].cb);
+        conn->pending.clear();
+    }
+
+    // cb runs with ok == false from the event loop, never from within call().
+    void failNow(const RpcCallback& cb) {
+        if (!cb) return;
+        rpc_metrics->rpc_failures.fetch_add(1, std::memory_order_relaxed);
+        failed.push_back(cb);
+    }
+
+    void runPosted() {
+        if (!wake_pending.load()) return;
+        wake_pending.store(false);
+        std::vector<std::function<void()>> batch;
+        {
+            std::lock_guard<std::mutex> lock(posted_mutex);
+            batch.swap(posted);
+        }
+        for (size_t i = 0; i < batch.size(); ++i) batch[i]();
+    }
+
+    // A UDP socket on loopback that post() sends a byte to, so a sleeping poll() wakes up.
+    void openWakeSocket() {
+        SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock == INVALID_SOCKET) return;
+        std::memset(&wake_addr, 0, sizeof(wake_addr));
+        wake_addr.sin_family = AF_INET;
+        wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        wake_addr.sin_port = 0;
+        socklen_t len = sizeof(wake_addr);
+        if (bind(sock, (struct sockaddr*)&wake_addr, sizeof(wake_addr)) == SOCKET_ERROR ||
+            getsockname(sock, (struct sockaddr*)&wake_addr, &len) == SOCKET_ERROR) {
+            closesocket(sock);
+            return;
+        }
+        setNonBlocking(sock, true);
+        wake_sock = sock;
+        watch(sock, false);
+    }
+
+    static uint64_t microsSince(std::chrono::steady_clock::time_point start) {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void runFailedCallbacks() {
+        while (!failed.empty()) {
+            std::vector<RpcCallback> batch;
+            batch.swap(failed);
+            PacketHeader none;
+            std::memset(&none, 0, sizeof(none));
+            for (size_t i = 0; i < batch.size(); ++i) batch[i](false, none, nullptr);
+        }
+    }
+
+    void reap() {
+        for (auto it = conns.begin(); it != conns.end(); ) {
+            if (it->second->dead) {
+                closesocket(it->second->sock);
+                delete it->second;
+                it = conns.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void watch(SOCKET sock, bool want_write) {
+#ifdef __linux__
+        epoll_event ev;
+        ev.events = want_write ? (uint32_t)(EPOLLIN | EPOLLOUT) : (uint32_t)EPOLLIN;
+        ev.data.fd = sock;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+#else
+        (void)sock; (void)want_write;
+#endif
+    }
+
+    void unwatch(SOCKET sock) {
+#ifdef __linux__
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+#else
+        (void)sock;
+#endif
+    }
+
+    void setWantWrite(Connection* conn, bool want_write) {
+        if (conn->want_write == want_write) return;
+        conn->want_write = want_write;
+#ifdef __linux__
+        epoll_event ev;
+        ev.events = want_write ? (uint32_t)(EPOLLIN | EPOLLOUT) : (uint32_t)EPOLLIN;
+        ev.data.fd = conn->sock;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev);
+#endif
+    }
+
+#ifdef __linux__
+    int epoll_fd;
+#endif
+    std::map<SOCKET, uint16_t> listeners;
+    SOCKET heartbeat_sock;
+    uint16_t heartbeat_port;
+    std::map<uint32_t, Probe> probes;
+    SOCKET wake_sock;
+    sockaddr_in wake_addr;
+    std::atomic<bool> wake_pending;  // a wake-up byte is on its way, or posted tasks wait
+    std::mutex posted_mutex;
+    std::vector<std::function<void()>> posted;
+    AcceptHandler accept_handler;
+    uint64_t next_conn_id;
+    uint32_t next_request_id;
+    RequestHandler request_handler;
+    std::map<uint16_t, RequestHandler> port_handlers;
+    std::unordered_map<SOCKET, Connection*> conns;
+    std::map<uint64_t, Connection*> outbound;
+    std::vector<RpcCallback> failed;
+    RpcMetrics own_metrics;
+    RpcMetrics* rpc_metrics;
+    std::thread::id loop_thread;
+};
+
+/**
+* The transport of one virtual node on a shared Reactor. Outbound RPCs use the reactor's
+* connections, inbound requests are those arriving on the node's own port.
+*/
+class PortTransport : public Transport {
+public:
+    PortTransport(Reactor& reactor, uint16_t port) : reactor(reactor), port(port) {}
+
+    void onRequest(RequestHandler handler) override { reactor.onRequest(port, handler); }
+
+    void call(const NodeInfo& target, uint8_t type, const void* payload, uint32_t len, uint16_t timeout_ms, RpcCallback cb) override {
+        reactor.call(target, type, payload, len, timeout_ms, cb);
+    }
+
+    void callv(const NodeInfo& target, uint8_t type, const IoSlice* slices, int count, uint16_t timeout_ms, RpcCallback cb) override {
+        reactor.callv(target, type, slices, count, timeout_ms, cb);
+    }
+
+    void reply(const ReplyTo& to, uint8_t type, const void* payload, uint32_t len) override {
+        reactor.reply(to, type, payload, len);
+    }
+
+    void replyv(const ReplyTo& to, uint8_t type, const IoSlice* slices, int count) override {
+        reactor.replyv(to, type, slices, count);
+    }
+
+    void evict(const NodeInfo& target) override { reactor.evict(target); }
+
+    uint64_t nowMs() const override { return reactor.nowMs(); }
+
+    void probe(const NodeInfo& target, uint16_t timeout_ms, RpcCallback cb) override {
+        reactor.probe(target, timeout_ms, cb);
+    }
+
+    const RpcMetrics* rpcMetrics() const override { return reactor.rpcMetrics(); }
+
+private:
+    Reactor& reactor;
+    uint16_t port;
+};
+
+#endif
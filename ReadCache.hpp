@@ -0,0 +1,54 @@
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include "KVStore.hpp"
+
+/**
+* Values this host relayed from their owners, kept so that a popular key is answered by
+* whichever node a client asks instead of by its owner alone. Entries live in a KVStore
+* that evicts with CLOCK and carry the owner's item version, their write time is when we
+* fetched them. A copy is served for ttl_ms after that, so a read through another node
+* may return a value up to ttl_ms old. A copy never replaces a newer version, and writes
+* relayed through this host drop it.
+*/
+class ReadCache {
+public:
+    ReadCache(const StoreConfig& cfg, uint32_t ttl_ms) : entries(clockEvicting(cfg)), ttl_ms(ttl_ms) {}
+
+    /**
+    * Copies a fresh copy of key into out, false if we hold none. An expired copy is
+    * dropped.
+    */
+    bool get(const Sha1ID& key, uint64_t now_ms, uint8_t* out, uint32_t max_len, uint32_t* out_len, uint64_t* out_version) {
+        if (entries.get(key, out, max_len, out_len, out_version) != STORE_OK) return false;
+        if (now_ms - entries.modifiedAt(key) < ttl_ms) return true;
+        entries.drop(key);
+        return false;
+    }
+
+    // Keeps a value the owner just returned, unless we hold a newer version.
+    void insert(const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t version, uint64_t now_ms) {
+        uint64_t cached = 0;
+        bool tombstone = false;
+        if (entries.getMeta(key, &cached, &tombstone)) {
+            if (cached > version) return;
+            entries.drop(key);  // the same version fetched again starts a new TTL
+        }
+        entries.apply(key, data, len, version, false, now_ms);
+    }
+
+    void invalidate(const Sha1ID& key) { entries.drop(key); }
+
+    uint32_t size() const { return entries.size(); }
+
+private:
+    static StoreConfig clockEvicting(StoreConfig cfg) {
+        cfg.eviction = EVICT_CLOCK;
+        return cfg;
+    }
+
+    KVStore entries;
+    uint32_t ttl_ms;
+};
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef REPLICATOR_H
+#define REPLICATOR_H
+
+#include "ChordNode.hpp"
+#include "KVStore.hpp"
+#include "Merkle.hpp"
+#include "Transport.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+constexpr uint64_t ANTI_ENTROPY_INTERVAL_MS = 1000;
+constexpr uint64_t TOMBSTONE_TTL_MS = 5 * 60 * 1000;
+
+/**
+* Keeps copies of the keys this node owns on its first R successors. Every local write is
+* pushed right away, and a periodic anti-entropy pass compares Merkle trees over
+* (predecessor, myself] with one successor at a time and transfers only the items below
+* subtrees that differ. Lost pushes and failovers are repaired by the next pass.
+*/
+class Replicator {
+public:
+    Replicator(ChordNode& node, Transport& transport, KVStore& store, int replicas)
+        : node(node), transport(transport), store(store),
+          replicas(std::max(0, std::min(replicas, SUCLIST_SIZE))),
+          sync_in_flight(false), next_peer(0) {
+        last_sync = transport.nowMs();
+    }
+
+    // Pushes the current state of key (value or tombstone) to all replicas.
+    void replicate(const Sha1ID& key) {
+        NodeInfo peers[SUCLIST_SIZE];
+        int n = replicaPeers(peers);
+        for (int i = 0; i < n; ++i) pushItem(peers[i], key);
+    }
+
+    /**
+    * Serves replication requests, returns false for message types it does not handle.
+    */
+    bool handleRequest(const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+        if (hdr.type == MSG_REPLICATE) {
+            const ItemPayload* item = (const ItemPayload*)payload;
+            uint32_t header_len = offsetof(ItemPayload, data);
+            if (hdr.payload_len < header_len || item->value_len > MAX_VALUE_LEN || hdr.payload_len - header_len < item->value_len) return true;
+            store.apply(item->key, item->data, item->value_len, item->version, item->tombstone != 0, wallClockMs());
+        }
+        else if (hdr.type == MSG_FETCH_ITEM) {
+            if (hdr.payload_len < sizeof(KeyPayload)) return true;
+            ItemPayload item;
+            uint32_t len = readItem(((const KeyPayload*)payload)->key, &item);
+            transport.reply(from, MSG_FETCH_ITEM_RESPONSE, &item, len);
+        }
+        else if (hdr.type == MSG_MERKLE_NODES) {
+            const MerkleRequestPayload* req = (const MerkleRequestPayload*)payload;
+            if (hdr.payload_len < sizeof(MerkleRequestPayload) || req->level >= MERKLE_DEPTH || req->count > MERKLE_FANOUT) return true;
+
+            if (!serve_tree) serve_tree.reset(new MerkleTree());
+            serve_tree->build(store, req->range_start, req->range_end);
+            MerkleHashesPayload resp;
+            resp.count = req->count;
+            uint32_t width = MerkleTree::levelWidth(req->level);
+            for (int i = 0; i < req->count; ++i) {
+                for (int c = 0; c < MERKLE_FANOUT; ++c) {
+                    resp.hashes[i * MERKLE_FANOUT + c] = req->indices[i] < width
+                        ? serve_tree->hash(req->level + 1, req->indices[i] * MERKLE_FANOUT + c) : 0;
+                }
+            }
+            transport.reply(from, MSG_MERKLE_NODES_RESPONSE, &resp, offsetof(MerkleHashesPayload, hashes) + resp.count * MERKLE_FANOUT * sizeof(uint64_t));
+        }
+        else if (hdr.type == MSG_MERKLE_LEAVES) {
+            const MerkleRequestPayload* req = (const MerkleRequestPayload*)payload;
+            if (hdr.payload_len < sizeof(MerkleRequestPayload) || req->count > MERKLE_FANOUT) return true;
+
+            DigestListPayload resp;
+            resp.count = collectDigests(req->range_start, req->range_end, req->indices, req->count, resp.items);
+            transport.reply(from, MSG_MERKLE_LEAVES_RESPONSE, &resp, offsetof(DigestListPayload, items) + resp.count * sizeof(ItemDigest));
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    void tick() {
+        uint64_t now = transport.nowMs();
+        if (sync_in_flight || now - last_sync < ANTI_ENTROPY_INTERVAL_MS) return;
+        last_sync = now;
+
+        store.purgeTombstones(wallClockMs() - TOMBSTONE_TTL_MS);
+        if (!node.hasPredecessor() || node.isAlone()) return;
+
+        NodeInfo peers[SUCLIST_SIZE];
+        int n = replicaPeers(peers);
+        if (n == 0) return;
+
+        std::shared_ptr<SyncSession> session(new SyncSession());
+        session->peer = peers[next_peer++ % n];
+        session->start = node.getPredecessor().id;
+        session->end = node.getMyself().id;
+        session->outstanding = 0;
+
+        sync_in_flight = true;
+        if (!local_tree) local_tree.reset(new MerkleTree());
+        local_tree->build(store, session->start, session->end);
+        std::vector<uint16_t> root(1, 0);
+        requestNodes(session, 0, root);
+    }
+
+private:
+    struct SyncSession {
+        NodeInfo peer;
+        Sha1ID start;
+        Sha1ID end;
+        int outstanding;
+    };
+
+    // First R successors on distinct other hosts. Our own virtual nodes fail together
+    // with us, a copy there would not help.
+    int replicaPeers(NodeInfo* out) const {
+        NodeInfo list[SUCLIST_SIZE];
+        uint8_t count = 0;
+        const_cast<ChordNode&>(node).getMySuccessorList(list, &count);
+        int n = 0;
+        for (int i = 0; i < count && n < replicas; ++i) {
+            if (list[i].id == node.getMyself().id || list[i].ip == node.getMyself().ip) continue;
+            bool dup = false;
+            for (int j = 0; j < n; ++j) dup = dup || out[j].ip == list[i].ip;
+            if (!dup) out[n++] = list[i];
+        }
+        return n;
+    }
+
+    // Fills item with the current state of key, returns the payload length (0 if unknown).
+    uint32_t readItem(const Sha1ID& key, ItemPayload* item) {
+        bool tombstone = false;
+        if (!store.getMeta(key, &item->version, &tombstone)) return 0;
+        item->key = key;
+        item->tombstone = tombstone ? 1 : 0;
+        item->value_len = 0;
+        if (!tombstone && store.get(key, item->data, MAX_VALUE_LEN, &item->value_len) != STORE_OK) return 0;
+        return offsetof(ItemPayload, data) + item->value_len;
+    }
+
+    void pushItem(const NodeInfo& peer, const Sha1ID& key) {
+        ItemPayload item;
+        uint32_t len = readItem(key, &item);
+        if (len > 0) transport.send(peer, MSG_REPLICATE, &item, len);
+    }
+
+    void fetchItem(const NodeInfo& peer, const Sha1ID& key) {
+        KeyPayload req;
+        req.key = key;
+        req.flags = 0;
+        transport.call(peer, MSG_FETCH_ITEM, &req, sizeof(req), 1000, [this](bool ok, const PacketHeader& h, const uint8_t* payload) {
+            if (!ok || h.type != MSG_FETCH_ITEM_RESPONSE || h.payload_len < offsetof(ItemPayload, data)) return;
+            const ItemPayload* item = (const ItemPayload*)payload;
+            if (item->value_len > MAX_VALUE_LEN || h.payload_len - offsetof(ItemPayload, data) < item->value_len) return;
+            store.apply(item->key, item->data, item->value_len, item->version, item->tombstone != 0, wallClockMs());
+        });
+    }
+
+    uint16_t collectDigests(const Sha1ID& start, const Sha1ID& end, const uint16_t* leaves, int count, ItemDigest* out) const {
+        uint16_t n = 0;
+        store.forEach([&](const Sha1ID& key, uint64_t version, bool tombstone) {
+            if (n >= MAX_DIGESTS || !in_interval(key, start, end)) return;
+            uint32_t leaf = MerkleTree::leafOf(key);
+            for (int i = 0; i < count; ++i) {
+                if (leaves[i] != leaf) continue;
+                out[n].key = key;
+                out[n].version = version;
+                out[n].tombstone = tombstone ? 1 : 0;
+                ++n;
+                return;
+            }
+        });
+        return n;
+    }
+
+    void finishStep(const std::shared_ptr<SyncSession>& session) {
+        if (--session->outstanding == 0) sync_in_flight = false;
+    }
+
+    /**
+    * Asks the peer for the children of the given nodes, in batches of MERKLE_FANOUT, and
+    * descends into every child whose hash differs from ours.
+    */
+    void requestNodes(const std::shared_ptr<SyncSession>& session, int level, const std::vector<uint16_t>& indices) {
+        for (size_t off = 0; off < indices.size(); off += MERKLE_FANOUT) {
+            MerkleRequestPayload req;
+            req.range_start = session->start;
+            req.range_end = session->end;
+            req.level = (uint8_t)level;
+            req.count = (uint8_t)std::min((size_t)MERKLE_FANOUT, indices.size() - off);
+            for (int i = 0; i < req.count; ++i) req.indices[i] = indices[off + i];
+
+            ++session->outstanding;
+            uint8_t msg_type = level == MERKLE_DEPTH ? MSG_MERKLE_LEAVES : MSG_MERKLE_NODES;
+            transport.call(session->peer, msg_type, &req, sizeof(req), 1000, [this, session, req](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                if (ok) {
+                    if (req.level == MERKLE_DEPTH) onLeaves(session, req, h, payload);
+                    else onNodes(session, req, h, payload);
+                }
+                finishStep(session);
+            });
+        }
+    }
+
+    void onNodes(const std::shared_ptr<SyncSession>& session, const MerkleRequestPayload& req, const PacketHeader& h, const uint8_t* payload) {
+        const MerkleHashesPayload* resp = (const MerkleHashesPayload*)payload;
+        if (h.type != MSG_MERKLE_NODES_RESPONSE || h.payload_len < offsetof(MerkleHashesPayload, hashes) + req.count * MERKLE_FANOUT * sizeof(uint64_t)) return;
+
+        std::vector<uint16_t> differing;
+        for (int i = 0; i < req.count; ++i) {
+            for (int c = 0; c < MERKLE_FANOUT; ++c) {
+                uint32_t child = req.indices[i] * MERKLE_FANOUT + c;
+                if (local_tree->hash(req.level + 1, child) != resp->hashes[i * MERKLE_FANOUT + c]) {
+                    differing.push_back((uint16_t)child);
+                }
+            }
+        }
+        if (!differing.empty()) requestNodes(session, req.level + 1, differing);
+    }
+
+    /**
+    * Compares item versions inside differing leaves: newer local items are pushed, newer
+    * or unknown remote items are fetched.
+    */
+    void onLeaves(const std::shared_ptr<SyncSession>& session, const MerkleRequestPayload& req, const PacketHeader& h, const uint8_t* payload) {
+        const DigestListPayload* resp = (const DigestListPayload*)payload;
+        if (h.type != MSG_MERKLE_LEAVES_RESPONSE || h.payload_len < offsetof(DigestListPayload, items) ||
+            resp->count > MAX_DIGESTS || h.payload_len < offsetof(DigestListPayload, items) + resp->count * sizeof(ItemDigest)) return;
+
+        std::vector<Sha1ID> remote_keys;
+        remote_keys.reserve(resp->count);
+        for (int i = 0; i < resp->count; ++i) {
+            const ItemDigest& d = resp->items[i];
+            remote_keys.push_back(d.key);
+            uint64_t version = 0;
+            bool tombstone = false;
+            if (!store.getMeta(d.key, &version, &tombstone) || version < d.version) fetchItem(session->peer, d.key);
+            else if (version > d.version) pushItem(session->peer, d.key);
+        }
+        std::sort(remote_keys.begin(), remote_keys.end());
+
+        std::vector<ItemDigest> local(MAX_DIGESTS);
+        uint16_t n = collectDigests(session->start, session->end, req.indices, req.count, local.data());
+        for (int i = 0; i < n; ++i) {
+            if (!std::binary_search(remote_keys.begin(), remote_keys.end(), local[i].key)) pushItem(session->peer, local[i].key);
+        }
+    }
+
+    ChordNode& node;
+    Transport& transport;
+    KVStore& store;
+    int replicas;
+    bool sync_in_flight;
+    uint32_t next_peer;
+    uint64_t last_sync;
+    // 35 KB each, only allocated once this node takes part in anti-entropy.
+    std::unique_ptr<MerkleTree> local_tree;
+    std::unique_ptr<MerkleTree> serve_tree;
+};
+
+#endif
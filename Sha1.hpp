@@ -0,0 +1,120 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include "Protocol.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+* SHA-1 (FIPS 180-4), used to place nodes on the ring. Not for anything that needs
+* collision resistance against an attacker.
+*/
+class Sha1 {
+public:
+    Sha1() : length(0), buffered(0) {
+        state[0] = 0x67452301;
+        state[1] = 0xEFCDAB89;
+        state[2] = 0x98BADCFE;
+        state[3] = 0x10325476;
+        state[4] = 0xC3D2E1F0;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = (const uint8_t*)data;
+        length += len;
+        if (buffered > 0) {
+            size_t n = std::min(len, sizeof(block) - buffered);
+            std::memcpy(block + buffered, p, n);
+            buffered += n;
+            p += n;
+            len -= n;
+            if (buffered < sizeof(block)) return;
+            compress(block);
+            buffered = 0;
+        }
+        while (len >= sizeof(block)) {
+            compress(p);
+            p += sizeof(block);
+            len -= sizeof(block);
+        }
+        std::memcpy(block, p, len);
+        buffered = len;
+    }
+
+    Sha1ID digest() {
+        uint64_t bits = length * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (buffered != sizeof(block) - 8) update(&pad, 1);
+        uint8_t len_be[8];
+        for (int i = 0; i < 8; ++i) len_be[i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(len_be, 8);
+
+        Sha1ID id;
+        for (int i = 0; i < 5; ++i) {
+            id.bytes[4 * i] = (uint8_t)(state[i] >> 24);
+            id.bytes[4 * i + 1] = (uint8_t)(state[i] >> 16);
+            id.bytes[4 * i + 2] = (uint8_t)(state[i] >> 8);
+            id.bytes[4 * i + 3] = (uint8_t)state[i];
+        }
+        return id;
+    }
+
+private:
+    static uint32_t rol(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void compress(const uint8_t* chunk) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = ((uint32_t)chunk[4 * i] << 24) | ((uint32_t)chunk[4 * i + 1] << 16) |
+                   ((uint32_t)chunk[4 * i + 2] << 8) | (uint32_t)chunk[4 * i + 3];
+        }
+        for (int i = 16; i < 80; ++i) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+
+    uint32_t state[5];
+    uint64_t length;
+    uint8_t block[64];
+    size_t buffered;
+};
+
+inline Sha1ID sha1(const void* data, size_t len) {
+    Sha1 h;
+    h.update(data, len);
+    return h.digest();
+}
+
+/**
+* Ring position of the node listening on ip:port, the SHA-1 of e.g. "10.0.0.7:5000".
+* Tools can compute it the same way, hashlib.sha1(b"10.0.0.7:5000") in Python.
+*/
+inline Sha1ID nodeIdFor(uint32_t ip, uint16_t port) {
+    const uint8_t* b = (const uint8_t*)&ip;  // network byte order
+    std::string s = std::to_string(b[0]) + "." + std::to_string(b[1]) + "." + std::to_string(b[2]) + "." +
+                    std::to_string(b[3]) + ":" + std::to_string(port);
+    return sha1(s.data(), s.size());
+}
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef SIMNETWORK_H
+#define SIMNETWORK_H
+
+#include "Transport.hpp"
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+struct SimConfig {
+    uint32_t min_latency_ms;
+    uint32_t max_latency_ms;
+    double loss;          // probability that a single message is dropped
+    uint64_t seed;
+
+    SimConfig() : min_latency_ms(1), max_latency_ms(20), loss(0.0), seed(1) {}
+};
+
+class SimTransport;
+
+/**
+* Deterministic discrete-event network: a virtual clock, an event queue ordered by time
+* and insertion, and one seeded random generator for latency and loss. Messages between
+* two nodes keep their order, like on a TCP connection. The same seed always replays the
+* same run.
+*/
+class SimNetwork {
+public:
+    explicit SimNetwork(const SimConfig& cfg) : config(cfg), rng(cfg.seed), now(0), next_seq(0), messages(0), dropped(0) {}
+
+    uint64_t nowMs() const { return now; }
+
+    void schedule(uint64_t delay_ms, std::function<void()> fn) {
+        Event e;
+        e.time = now + delay_ms;
+        e.seq = next_seq++;
+        e.fn = std::make_shared<std::function<void()>>(std::move(fn));
+        events.push(e);
+    }
+
+    // Runs all events up to and including time t, returns false if the queue ran empty.
+    bool runUntil(uint64_t t) {
+        while (!events.empty() && events.top().time <= t) {
+            Event e = events.top();
+            events.pop();
+            now = e.time;
+            (*e.fn)();
+        }
+        if (now < t) now = t;
+        return !events.empty();
+    }
+
+    // Runs while busy() returns true, at most limit_ms of virtual time. Returns !busy().
+    bool runWhile(const std::function<bool()>& busy, uint64_t limit_ms) {
+        uint64_t deadline = now + limit_ms;
+        while (busy() && !events.empty() && events.top().time <= deadline) {
+            Event e = events.top();
+            events.pop();
+            now = e.time;
+            (*e.fn)();
+        }
+        return !busy();
+    }
+
+    void attach(uint64_t addr, SimTransport* t) { endpoints[addr] = t; }
+    void setAlive(uint64_t addr, bool alive) { if (alive) up.insert(addr); else up.erase(addr); }
+    bool isAlive(uint64_t addr) const { return up.count(addr) != 0; }
+    SimTransport* endpoint(uint64_t addr) const {
+        auto it = endpoints.find(addr);
+        return (it == endpoints.end() || !isAlive(addr)) ? nullptr : it->second;
+    }
+
+    /**
+    * Delivers fn after a random latency unless the message is lost. Never runs fn
+    * immediately.
+    */
+    void transmit(uint64_t from, uint64_t to, std::function<void()> fn) {
+        ++messages;
+        if (config.loss > 0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng) < config.loss) {
+            ++dropped;
+            return;
+        }
+        uint64_t latency = std::uniform_int_distribution<uint32_t>(config.min_latency_ms, config.max_latency_ms)(rng);
+        uint64_t at = now + (latency > 0 ? latency : 1);
+        uint64_t& last = last_delivery[std::make_pair(from, to)];
+        if (at < last) at = last;
+        last = at;
+        schedule(at - now, std::move(fn));
+    }
+
+    std::mt19937_64& random() { return rng; }
+    uint64_t messageCount() const { return messages; }
+    uint64_t droppedCount() const { return dropped; }
+
+    static uint64_t addrOf(const NodeInfo& n) { return ((uint64_t)n.ip << 16) | n.port; }
+
+private:
+    struct Event {
+        uint64_t time;
+        uint64_t seq;
+        std::shared_ptr<std::function<void()>> fn;
+    };
+    struct Later {
+        bool operator()(const Event& a, const Event& b) const {
+            return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+        }
+    };
+
+    SimConfig config;
+    std::mt19937_64 rng;
+    uint64_t now;
+    uint64_t next_seq;
+    uint64_t messages;
+    uint64_t dropped;
+    std::priority_queue<Event, std::vector<Event>, Later> events;
+    std::unordered_map<uint64_t, SimTransport*> endpoints;
+    std::set<uint64_t> up;
+    std::map<std::pair<uint64_t, uint64_t>, uint64_t> last_delivery;
+};
+
+/**
+* Transport of one simulated node. Requests, responses and timeouts are events on the
+* shared SimNetwork, a dead node neither receives messages nor sees its callbacks fire.
+*/
+class SimTransport : public Transport {
+public:
+    SimTransport(SimNetwork& net, const NodeInfo& self) : net(net), self(SimNetwork::addrOf(self)), next_request_id(1) {
+        std::memset(sent, 0, sizeof(sent));
+        net.attach(this->self, this);
+    }
+
+    void onRequest(RequestHandler handler) override { request_handler = handler; }
+
+    void call(const NodeInfo& target, uint8_t type, const void* payload, uint32_t len, uint16_t timeout_ms, RpcCallback cb) override {
+        ++sent[type];
+        uint32_t request_id = next_request_id++;
+        uint64_t to = SimNetwork::addrOf(target);
+        if (cb) {
+            Pending p;
+            p.cb = cb;
+            p.target = to;
+            pending[request_id] = p;
+            net.schedule(timeout_ms, [this, request_id]() { expire(request_id); });
+        }
+
+        PacketHeader hdr = makeHeader(type, request_id, len);
+        std::shared_ptr<std::vector<uint8_t>> data(new std::vector<uint8_t>((const uint8_t*)payload, (const uint8_t*)payload + len));
+        uint64_t from = self;
+        SimNetwork* n = &net;
+        net.transmit(from, to, [n, from, to, hdr, data]() {
+            SimTransport* dst = n->endpoint(to);
+            if (dst && n->isAlive(from)) dst->deliverRequest(from, hdr, data->data());
+        });
+    }
+
+    void callv(const NodeInfo& target, uint8_t type, const IoSlice* slices, int count, uint16_t timeout_ms, RpcCallback cb) override {
+        std::vector<uint8_t> payload;
+        for (int i = 0; i < count; ++i) {
+            const uint8_t* p = (const uint8_t*)slices[i].data;
+            payload.insert(payload.end(), p, p + slices[i].len);
+        }
+        call(target, type, payload.data(), (uint32_t)payload.size(), timeout_ms, cb);
+    }
+
+    void reply(const ReplyTo& to, uint8_t type, const void* payload, uint32_t len) override {
+        PacketHeader hdr = makeHeader(type, to.request_id, len);
+        std::shared_ptr<std::vector<uint8_t>> data(new std::vector<uint8_t>((const uint8_t*)payload, (const uint8_t*)payload + len));
+        uint64_t from = self;
+        uint64_t dest = to.conn_id;
+        SimNetwork* n = &net;
+        net.transmit(from, dest, [n, dest, hdr, data]() {
+            SimTransport* dst = n->endpoint(dest);
+            if (dst) dst->deliverResponse(hdr, data->data());
+        });
+    }
+
+    void replyv(const ReplyTo& to, uint8_t type, const IoSlice* slices, int count) override {
+        std::vector<uint8_t> payload;
+        for (int i = 0; i < count; ++i) {
+            const uint8_t* p = (const uint8_t*)slices[i].data;
+            payload.insert(payload.end(), p, p + slices[i].len);
+        }
+        reply(to, type, payload.data(), (uint32_t)payload.size());
+    }
+
+    void evict(const NodeInfo& target) override {
+        uint64_t addr = SimNetwork::addrOf(target);
+        for (auto& p : pending) {
+            if (p.second.target == addr) {
+                uint32_t id = p.first;
+                net.schedule(0, [this, id]() { expire(id); });
+            }
+        }
+    }
+
+    uint64_t nowMs() const override { return net.nowMs(); }
+
+    // Number of messages of the given type this node has sent.
+    uint64_t sentCount(uint8_t type) const { return sent[type]; }
+
+    void deliverRequest(uint64_t from, const PacketHeader& hdr, const uint8_t* payload) {
+        ReplyTo r;
+        r.sock = 0;
+        r.conn_id = from;
+        r.request_id = hdr.request_id;
+        r.origin = this;
+        if (request_handler) request_handler(r, hdr, payload);
+    }
+
+    void deliverResponse(const PacketHeader& hdr, const uint8_t* payload) {
+        auto it = pending.find(hdr.request_id);
+        if (it == pending.end()) return;  // late response of an expired RPC
+        RpcCallback cb = it->second.cb;
+        pending.erase(it);
+        cb(true, hdr, payload);
+    }
+
+private:
+    struct Pending {
+        RpcCallback cb;
+        uint64_t target;
+    };
+
+    void expire(uint32_t request_id) {
+        if (!net.isAlive(self)) return;
+        auto it = pending.find(request_id);
+        if (it == pending.end()) return;
+        RpcCallback cb = it->second.cb;
+        pending.erase(it);
+        PacketHeader none;
+        std::memset(&none, 0, sizeof(none));
+        cb(false, none, nullptr);
+    }
+
+    SimNetwork& net;
+    uint64_t self;
+    uint32_t next_request_id;
+    RequestHandler request_handler;
+    std::unordered_map<uint32_t, Pending> pending;
+    uint64_t sent[256];
+};
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef STORELOG_H
+#define STORELOG_H
+
+#include "Crc32.hpp"
+#include "KVStore.hpp"
+#include "Log.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr uint64_t LOG_FILE_MAGIC = 0x474F4C4149464F53ULL;   // "SOFIALOG"
+constexpr uint32_t LOG_FORMAT = 1;
+constexpr uint32_t LOG_RECORD_MAGIC = 0x43455253;            // "SREC"
+constexpr size_t LOG_MIN_MAP = 1 << 20;
+constexpr size_t LOG_COMPACT_MIN_BYTES = 4 << 20;
+constexpr int LOG_SYNC_INTERVAL_MS = 1000;
+
+enum LogRecordKind : uint8_t {
+    LOG_WRITE = 1,
+    LOG_ERASE = 2
+};
+
+#pragma pack(push, 1)
+struct LogFileHeader {
+    uint64_t magic;
+    uint32_t format;
+    uint32_t reserved;
+};
+
+// Followed by value_len bytes, padded to a multiple of 8.
+struct LogRecordHeader {
+    uint32_t magic;
+    uint32_t crc;          // CRC-32 over the header (crc = 0) and the value
+    uint32_t value_len;
+    uint8_t kind;
+    uint8_t tombstone;
+    uint16_t reserved;
+    Sha1ID key;
+    uint64_t version;
+    uint64_t modified_ms;
+};
+#pragma pack(pop)
+
+/**
+* Append-only, memory-mapped journal of a KVStore. Every change becomes a checksummed
+* record, a restart replays the file into the in-memory table and stops at the first torn
+* or corrupt record. The file is rewritten with only the live items once it has grown to
+* twice their size. Writes are flushed to disk asynchronously once per second, anything
+* lost on a power cut is repaired from the replicas by anti-entropy.
+*/
+class StoreLog : public StoreJournal {
+public:
+    StoreLog() : fd(-1), map(nullptr), map_size(0), tail(0) {
+        last_sync = std::chrono::steady_clock::now();
+    }
+
+    ~StoreLog() { close(); }
+
+    /**
+    * Opens or creates the log at path, returns false if it cannot be mapped.
+    */
+    bool open(const std::string& file_path) {
+#ifdef _WIN32
+        (void)file_path;
+        LOG_ERROR("[STORE] Persistent store is not supported on Windows");
+        return false;
+#else
+        path = file_path;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+
+        size_t size = (size_t)st.st_size;
+        if (!remap(size < LOG_MIN_MAP ? LOG_MIN_MAP : size)) return false;
+
+        LogFileHeader* fh = (LogFileHeader*)map;
+        if (size < sizeof(LogFileHeader) || fh->magic != LOG_FILE_MAGIC) {
+            fh->magic = LOG_FILE_MAGIC;
+            fh->format = LOG_FORMAT;
+            fh->reserved = 0;
+        } else if (fh->format != LOG_FORMAT) {
+            LOG_ERROR("[STORE] " << path << " has unknown format " << fh->format);
+            return false;
+        }
+        tail = sizeof(LogFileHeader);
+        return true;
+#endif
+    }
+
+    /**
+    * Loads all valid records into store, returns their number. The log must be attached
+    * to store only afterwards, otherwise the replay would be appended again.
+    */
+    uint32_t replay(KVStore& store) {
+        uint32_t records = 0;
+        size_t off = sizeof(LogFileHeader);
+        while (off + sizeof(LogRecordHeader) <= map_size) {
+            LogRecordHeader rec;
+            std::memcpy(&rec, map + off, sizeof(rec));
+            size_t len = recordSize(rec.value_len);
+            if (rec.magic != LOG_RECORD_MAGIC || rec.value_len > MAX_VALUE_LEN || off + len > map_size) break;
+            const uint8_t* value = map + off + sizeof(rec);
+            if (checksum(rec, value) != rec.crc) break;
+
+            if (rec.kind == LOG_WRITE) store.apply(rec.key, value, rec.value_len, rec.version, rec.tombstone != 0, rec.modified_ms);
+            else if (rec.kind == LOG_ERASE) store.drop(rec.key);
+            off += len;
+            ++records;
+        }
+        // Whatever follows a torn record must not be mistaken for records appended later.
+        tail = off;
+        std::memset(map + tail, 0, map_size - tail);
+        return records;
+    }
+
+    void recordWrite(const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t version, bool tombstone, uint64_t modified_ms) override {
+        append(LOG_WRITE, key, data, len, version, tombstone, modified_ms);
+    }
+
+    void recordErase(const Sha1ID& key) override {
+        append(LOG_ERASE, key, nullptr, 0, 0, false, 0);
+    }
+
+    /**
+    * Called from the main loop: starts the periodic flush and compacts when due.
+    */
+    void maintain(const KVStore& store) {
+        if (map == nullptr) return;
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_sync).count() < LOG_SYNC_INTERVAL_MS) return;
+        last_sync = now;
+
+        size_t live = sizeof(LogFileHeader) + (size_t)store.size() * sizeof(LogRecordHeader) + store.usedBytes();
+        if (tail > LOG_COMPACT_MIN_BYTES && tail > 2 * live) {
+            compact(store);
+        } else {
+#ifndef _WIN32
+            msync(map, tail, MS_ASYNC);
+#endif
+        }
+    }
+
+    // Flushes synchronously, trims the preallocated tail and closes the file.
+    void close() {
+#ifndef _WIN32
+        if (map != nullptr) {
+            msync(map, tail, MS_SYNC);
+            munmap(map, map_size);
+            map = nullptr;
+        }
+        if (fd >= 0) {
+            if (ftruncate(fd, tail) != 0) LOG_ERROR("[STORE] Could not trim " << path);
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    size_t sizeBytes() const { return tail; }
+
+private:
+    static size_t recordSize(uint32_t value_len) { return (sizeof(LogRecordHeader) + value_len + 7) & ~(size_t)7; }
+
+    void append(uint8_t kind, const Sha1ID& key, const uint8_t* data, uint32_t len, uint64_t version, bool tombstone, uint64_t modified_ms) {
+        if (map == nullptr) return;
+        size_t size = recordSize(len);
+        if (tail + size > map_size && !remap(std::max(map_size * 2, tail + size))) return;
+
+        LogRecordHeader rec;
+        rec.magic = LOG_RECORD_MAGIC;
+        rec.crc = 0;
+        rec.value_len = len;
+        rec.kind = kind;
+        rec.tombstone = tombstone ? 1 : 0;
+        rec.reserved = 0;
+        rec.key = key;
+        rec.version = version;
+        rec.modified_ms = modified_ms;
+        rec.crc = checksum(rec, data);
+
+        if (len > 0) std::memcpy(map + tail + sizeof(rec), data, len);
+        std::memset(map + tail + sizeof(rec) + len, 0, size - sizeof(rec) - len);
+        std::memcpy(map + tail, &rec, sizeof(rec));
+        tail += size;
+    }
+
+    /**
+    * Writes the live items to a new file and renames it over the log, so a crash during
+    * compaction leaves the old log intact.
+    */
+    void compact(const KVStore& store) {
+#ifndef _WIN32
+        auto start = std::chrono::steady_clock::now();
+        size_t before = tail;
+        StoreLog fresh;
+        std::string tmp_path = path + ".compact";
+        ::unlink(tmp_path.c_str());
+        if (!fresh.open(tmp_path)) return;
+        fresh.tail = sizeof(LogFileHeader);
+
+        uint8_t value[MAX_VALUE_LEN];
+        store.forEach([&](const Sha1ID& key, uint64_t version, bool tombstone) {
+            uint32_t len = 0;
+            store.readChunks(key, [&](const uint8_t* data, uint32_t n) {
+                std::memcpy(value + len, data, n);
+                len += n;
+            });
+            fresh.append(LOG_WRITE, key, value, len, version, tombstone, store.modifiedAt(key));
+        });
+        msync(fresh.map, fresh.tail, MS_SYNC);
+        if (fsync(fresh.fd) != 0 || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            LOG_ERROR("[STORE] Compaction of " << path << " failed");
+            return;
+        }
+        // The rename is durable only once the directory entry is. Appends already go to
+        // the new file, so a failed sync is reported but the swap still happens.
+        if (!syncDirectory()) LOG_WARN("[STORE] Could not sync the directory of " << path);
+
+        munmap(map, map_size);
+        ::close(fd);
+        fd = fresh.fd;
+        map = fresh.map;
+        map_size = fresh.map_size;
+        tail = fresh.tail;
+        fresh.fd = -1;
+        fresh.map = nullptr;
+
+        long ms = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        LOG_INFO("[STORE] Compacted log from " << before / 1024 << " KiB to " << tail / 1024 << " KiB in " << ms << " ms");
+#else
+        (void)store;
+#endif
+    }
+
+    bool remap(size_t new_size) {
+#ifdef _WIN32
+        (void)new_size;
+        return false;
+#else
+        new_size = (new_size + LOG_MIN_MAP - 1) & ~(LOG_MIN_MAP - 1);
+        if (ftruncate(fd, new_size) != 0) return false;
+        if (map != nullptr) munmap(map, map_size);
+        void* m = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) {
+            map = nullptr;
+            map_size = 0;
+            LOG_ERROR("[STORE] Could not map " << path);
+            return false;
+        }
+        map = (uint8_t*)m;
+        map_size = new_size;
+        return true;
+#endif
+    }
+
+    bool syncDirectory() const {
+#ifdef _WIN32
+        return true;
+#else
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int dir_fd = ::open(dir.c_str(), O_RDONLY);
+        if (dir_fd < 0) return false;
+        bool ok = fsync(dir_fd) == 0;
+        ::close(dir_fd);
+        return ok;
+#endif
+    }
+
+    static uint32_t checksum(const LogRecordHeader& rec, const uint8_t* value) {
+        LogRecordHeader h = rec;
+        h.crc = 0;
+        uint32_t c = crc32Update(0xFFFFFFFF, (const uint8_t*)&h, sizeof(h));
+        if (rec.value_len > 0) c = crc32Update(c, value, rec.value_len);
+        return ~c;
+    }
+
+    std::string path;
+    int fd;
+    uint8_t* map;
+    size_t map_size;
+    size_t tail;
+    std::chrono::steady_clock::time_point last_sync;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "Metrics.hpp"
+#include "Net.h"
+#include "Protocol.h"
+#include <functional>
+
+class Transport;
+
+/**
+* Identifies an inbound request so it can be answered later, e.g. after an outbound RPC
+* finished. The connection ID protects against socket numbers being reused.
+*/
+struct ReplyTo {
+    SOCKET sock;
+    uint64_t conn_id;
+    uint32_t request_id;
+    Transport* origin;  // transport the request arrived on, replies are passed to it
+};
+
+/**
+* Message exchange between nodes as seen by the protocol code. The Reactor implements it
+* over TCP, the simulator over a virtual network. Callbacks are never invoked from within
+* the call that registered them, and time is read through nowMs() so a simulation can
+* run on virtual time.
+*/
+class Transport {
+public:
+    typedef std::function<void(bool ok, const PacketHeader& hdr, const uint8_t* payload)> RpcCallback;
+    typedef std::function<void(const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload)> RequestHandler;
+
+    virtual ~Transport() {}
+
+    virtual void onRequest(RequestHandler handler) = 0;
+
+    /**
+    * Sends a request to target and calls cb exactly once, with the response or with
+    * ok == false on error or timeout.
+    */
+    virtual void call(const NodeInfo& target, uint8_t type, const void* payload, uint32_t len, uint16_t timeout_ms, RpcCallback cb) = 0;
+
+    // Like call(), with the payload gathered from slices.
+    virtual void callv(const NodeInfo& target, uint8_t type, const IoSlice* slices, int count, uint16_t timeout_ms, RpcCallback cb) = 0;
+
+    virtual void reply(const ReplyTo& to, uint8_t type, const void* payload, uint32_t len) = 0;
+
+    // Like reply(), with the payload gathered from slices.
+    virtual void replyv(const ReplyTo& to, uint8_t type, const IoSlice* slices, int count) = 0;
+
+    // Drops the connection to target, all RPCs in flight on it fail.
+    virtual void evict(const NodeInfo& target) = 0;
+
+    // Milliseconds on a monotonic clock.
+    virtual uint64_t nowMs() const = 0;
+
+    /**
+    * Liveness check of target, cb gets ok == true if it answered in time. A MSG_PING on
+    * the connection unless the transport has a faster path.
+    */
+    virtual void probe(const NodeInfo& target, uint16_t timeout_ms, RpcCallback cb) {
+        call(target, MSG_PING, nullptr, 0, timeout_ms, cb);
+    }
+
+    // Message counters and RPC latencies, null if the transport keeps none.
+    virtual const RpcMetrics* rpcMetrics() const { return nullptr; }
+
+    // One-way message, no response expected.
+    void send(const NodeInfo& target, uint8_t type, const void* payload, uint32_t len) {
+        call(target, type, payload, len, 0, RpcCallback());
+    }
+};
+
+#endif
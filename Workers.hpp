@@ -0,0 +1,105 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "ChordNode.hpp"
+#include "ChordService.hpp"
+#include "Rcu.hpp"
+#include "Reactor.hpp"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/**
+* Serves inbound connections on worker threads, each running a reactor of its own. The
+* main reactor still accepts and hands each connection to the next worker in turn.
+* Lookups and the other requests that only read routing state are answered right on the
+* worker, from the routing table the node last published. Requests that change state or
+* need more than the table, store requests included, are posted to the main thread, and
+* their replies find their way back to the worker's connection.
+*/
+class WorkerPool {
+public:
+    WorkerPool(Reactor& main, int threads) : main(main), next_worker(0), running(false) {
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back(new Worker(main.sharedMetrics()));
+            workers.back()->reader = rcu.addReader();
+        }
+    }
+
+    ~WorkerPool() { stop(); }
+
+    // Serves node, whose requests arrive on port. Called for every node before start().
+    void addNode(uint16_t port, ChordNode& node, ChordService& service) {
+        for (auto& w : workers) {
+            Worker* worker = w.get();
+            worker->reactor.onRequest(port, [this, worker, &node, &service](const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+                serve(*worker, node, service, from, hdr, payload);
+            });
+        }
+        nodes.push_back(&node);
+    }
+
+    void start() {
+        publish();
+        running = true;
+        for (auto& w : workers) {
+            Worker* worker = w.get();
+            worker->thread = std::thread([this, worker]() {
+                worker->reactor.runOnThisThread();
+                while (running.load()) worker->reactor.poll(20);
+            });
+        }
+        main.onAccept([this](SOCKET sock, uint16_t port, const sockaddr_in& peer) {
+            workers[next_worker++ % workers.size()]->reactor.adopt(sock, port, peer);
+        });
+    }
+
+    /**
+    * Publishes the routing tables that changed and frees the copies no worker reads any
+    * more. The main thread calls it after each round of its own work.
+    */
+    void publish() {
+        for (size_t i = 0; i < nodes.size(); ++i) nodes[i]->publish(rcu);
+        rcu.reclaim();
+    }
+
+    // Requests still posted to the main thread are answered nowhere after this.
+    void stop() {
+        if (!running) return;
+        main.onAccept(Reactor::AcceptHandler());
+        running = false;
+        for (auto& w : workers) w->thread.join();
+    }
+
+private:
+    struct Worker {
+        Reactor reactor;
+        int reader;  // RCU reader slot
+        std::thread thread;
+
+        explicit Worker(RpcMetrics* metrics) : reactor(metrics), reader(-1) {}
+    };
+
+    void serve(Worker& w, ChordNode& node, ChordService& service, const ReplyTo& from, const PacketHeader& hdr, const uint8_t* payload) {
+        {
+            RcuReadGuard guard(rcu, w.reader);
+            const RoutingTable* table = node.snapshot();
+            if (table && service.serveFromTable(*table, w.reactor, from, hdr, payload)) return;
+        }
+        std::vector<uint8_t> data(payload, payload + hdr.payload_len);
+        PacketHeader h = hdr;
+        ReplyTo r = from;
+        ChordService* s = &service;
+        main.post([s, r, h, data]() { s->handleRequest(r, h, data.data()); });
+    }
+
+    Reactor& main;
+    RcuDomain rcu;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<ChordNode*> nodes;
+    size_t next_worker;
+    std::atomic<bool> running;
+};
+
+#endif
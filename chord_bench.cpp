@@ -0,0 +1,427 @@
+// Microbenchmarks of the protocol and routing hot paths. Reports ns/op and heap
+// allocations/op as text, JSON or CSV, so results can be compared between releases.
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ChordService.hpp"
+#include "Reactor.hpp"
+
+// Every heap allocation in the process goes through here. The benchmarks run on one
+// thread, the counters are only read between measurements.
+static uint64_t g_allocs = 0;
+static uint64_t g_alloc_bytes = 0;
+
+// Not inlined, GCC would otherwise flag free() on memory that came from operator new.
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void* operator new(size_t size) {
+    ++g_allocs;
+    g_alloc_bytes += size;
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+BENCH_NOINLINE void operator delete(void* p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+// Results are folded into this so the compiler cannot drop the measured work.
+static volatile uint64_t g_sink = 0;
+
+struct BenchOptions {
+    std::string format;
+    std::string filter;
+    uint32_t min_time_ms;
+    uint16_t port;
+    int ring_size;
+
+    BenchOptions() : format("text"), min_time_ms(200), port(5900), ring_size(1024) {}
+};
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+/**
+* Runs fn(i) in batches of growing size until one batch takes at least min_time_ms, and
+* reports that batch. fn returns a value that is folded into g_sink.
+*/
+template <typename F>
+BenchResult measure(const std::string& name, uint32_t min_time_ms, F fn) {
+    for (uint64_t i = 0; i < 1000; ++i) g_sink = g_sink + fn(i);  // warm-up
+
+    uint64_t batch = 1000;
+    while (true) {
+        uint64_t allocs = g_allocs;
+        uint64_t bytes = g_alloc_bytes;
+        uint64_t acc = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; ++i) acc += fn(i);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        g_sink = g_sink + acc;
+
+        double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        if (ns >= min_time_ms * 1e6 || batch >= (1ull << 34)) {
+            BenchResult r;
+            r.name = name;
+            r.iterations = batch;
+            r.ns_per_op = ns / batch;
+            r.allocs_per_op = (double)(g_allocs - allocs) / batch;
+            r.bytes_per_op = (double)(g_alloc_bytes - bytes) / batch;
+            return r;
+        }
+        // Aim a bit past the target so the next batch is usually the last one.
+        double factor = ns > 0 ? (min_time_ms * 1.2e6) / ns : 100.0;
+        batch = (uint64_t)(batch * std::min(100.0, std::max(2.0, factor)));
+    }
+}
+
+static Sha1ID randomId(std::mt19937_64& rng) {
+    Sha1ID id;
+    for (int i = 0; i < 20; i += 4) {
+        uint32_t r = (uint32_t)rng();
+        std::memcpy(&id.bytes[i], &r, 4);
+    }
+    return id;
+}
+
+static NodeInfo makeNode(const Sha1ID& id, uint32_t ip) {
+    NodeInfo n;
+    std::memset(&n, 0, sizeof(n));
+    n.id = id;
+    n.ip = ip;
+    n.port = DEFAULT_PORT;
+    return n;
+}
+
+/**
+* A node with a fully stabilized view of a ring of ring_size random IDs: correct fingers,
+* successor list and predecessor.
+*/
+static void buildRingView(ChordNode& node, int ring_size, std::mt19937_64& rng) {
+    std::vector<Sha1ID> ids;
+    ids.push_back(node.getMyself().id);
+    for (int i = 1; i < ring_size; ++i) ids.push_back(randomId(rng));
+    std::sort(ids.begin(), ids.end());
+
+    auto successorOf = [&ids](const Sha1ID& key) {
+        auto it = std::lower_bound(ids.begin(), ids.end(), key);
+        return it == ids.end() ? ids.front() : *it;
+    };
+    const Sha1ID me = node.getMyself().id;
+    size_t pos = std::lower_bound(ids.begin(), ids.end(), me) - ids.begin();
+
+    for (int i = 0; i < ID_BITS; ++i) node.updateFinger(i, makeNode(successorOf(node.fingerStart(i)), (uint32_t)i + 1));
+    NodeInfo list[SUCLIST_SIZE];
+    for (int i = 0; i < SUCLIST_SIZE; ++i) list[i] = makeNode(ids[(pos + 1 + i) % ids.size()], 1000 + i);
+    node.handleStabilizeResponse(list[0]);
+    node.updateSuccessorList(list + 1, SUCLIST_SIZE - 1);
+    node.handleSetPredecessor(makeNode(ids[(pos + ids.size() - 1) % ids.size()], 2000));
+}
+
+class BenchSuite {
+public:
+    explicit BenchSuite(const BenchOptions& opts) : opts(opts), rng(42) {
+        for (int i = 0; i < KEY_COUNT; ++i) keys[i] = randomId(rng);
+    }
+
+    std::vector<BenchResult> run() {
+        benchIds();
+        benchPacket();
+        benchRouting();
+        benchMetrics();
+        benchLog();
+        benchDispatch();
+        return results;
+    }
+
+private:
+    static constexpr int KEY_COUNT = 1024;  // power of two, indexed with i & (KEY_COUNT - 1)
+
+    bool selected(const char* name) const { return opts.filter.empty() || std::strstr(name, opts.filter.c_str()) != nullptr; }
+
+    template <typename F>
+    void add(const char* name, F fn) {
+        if (selected(name)) results.push_back(measure(name, opts.min_time_ms, fn));
+    }
+
+    const Sha1ID& key(uint64_t i) const { return keys[i & (KEY_COUNT - 1)]; }
+
+    void benchIds() {
+        add("sha1id_less", [this](uint64_t i) -> uint64_t { return key(i) < key(i + 1); });
+        add("sha1id_equal", [this](uint64_t i) -> uint64_t { return key(i) == key(i + 3); });
+        add("in_interval", [this](uint64_t i) -> uint64_t { return in_interval(key(i), key(i + 1), key(i + 2)); });
+        add("finger_start", [this](uint64_t i) -> uint64_t { return key(i).addPowerOfTwo((int)(i % ID_BITS)).bytes[0]; });
+    }
+
+    // Framing as done by Reactor::queuePacket and Reactor::processFrames.
+    void benchPacket() {
+        add("packet_encode", [this](uint64_t i) -> uint64_t {
+            PacketHeader hdr = makeHeader(MSG_FIND_SUCCESSOR, (uint32_t)i, sizeof(FindSuccessorPayload));
+            FindSuccessorPayload req;
+            req.target_id = key(i);
+            std::memcpy(frame, &hdr, sizeof(hdr));
+            std::memcpy(frame + sizeof(hdr), &req, sizeof(req));
+            return frame[sizeof(hdr) + 19];
+        });
+
+        add("packet_decode", [this](uint64_t i) -> uint64_t {
+            frame[sizeof(PacketHeader) + 19] = (uint8_t)i;
+            PacketHeader hdr;
+            std::memcpy(&hdr, frame, sizeof(hdr));
+            if (hdr.magic != PACKET_MAGIC || hdr.version != PROTOCOL_VERSION || !payloadLenValid(hdr.type, hdr.payload_len)) return 0;
+            const FindSuccessorPayload* req = (const FindSuccessorPayload*)(frame + sizeof(hdr));
+            return req->target_id.bytes[19] + hdr.type;
+        });
+
+        add("suclist_encode", [this](uint64_t i) -> uint64_t {
+            NodeListPayload resp;
+            for (int k = 0; k < SUCLIST_SIZE; ++k) resp.nodes[k] = makeNode(key(i + k), (uint32_t)k);
+            resp.count = SUCLIST_SIZE;
+            PacketHeader hdr = makeHeader(MSG_GET_SUCLIST_RESPONSE, (uint32_t)i, sizeof(resp));
+            std::memcpy(frame, &hdr, sizeof(hdr));
+            std::memcpy(frame + sizeof(hdr), &resp, sizeof(resp));
+            return frame[sizeof(hdr)];
+        });
+    }
+
+    void benchRouting() {
+        ChordNode node(0x0100007F, DEFAULT_PORT);
+        buildRingView(node, opts.ring_size, rng);
+
+        add("find_successor_next_hop", [this, &node](uint64_t i) -> uint64_t {
+            bool is_owner = false;
+            NodeInfo hop = node.findSuccessorNextHop(key(i), &is_owner);
+            return hop.ip + is_owner;
+        });
+
+        add("closest_preceding_node", [this, &node](uint64_t i) -> uint64_t {
+            return node.closestPrecedingNode(key(i)).ip;
+        });
+
+        // A worker thread's lookup: read section, published table, routing step.
+        RcuDomain rcu;
+        int reader = rcu.addReader();
+        node.publish(rcu);
+        add("snapshot_next_hop", [this, &node, &rcu, reader](uint64_t i) -> uint64_t {
+            RcuReadGuard guard(rcu, reader);
+            bool is_owner = false;
+            NodeInfo hop = node.snapshot()->nextHop(key(i), &is_owner);
+            return hop.ip + is_owner;
+        });
+
+        // Alternates between two lists, so every call takes the update path.
+        NodeInfo lists[2][SUCLIST_SIZE];
+        for (int l = 0; l < 2; ++l) {
+            for (int k = 0; k < SUCLIST_SIZE; ++k) lists[l][k] = makeNode(key(l * SUCLIST_SIZE + k), (uint32_t)k);
+        }
+        add("update_successor_list", [&node, &lists](uint64_t i) -> uint64_t {
+            node.updateSuccessorList(lists[i & 1], SUCLIST_SIZE);
+            return node.getSuccessor().ip;
+        });
+    }
+
+    // The cost every request and RPC pays for the statistics of MSG_GET_STATS.
+    void benchMetrics() {
+        add("histogram_record", [this](uint64_t i) -> uint64_t {
+            histogram.record((i * 2654435761u) & 0xFFFF);
+            return histogram.count();
+        });
+        add("histogram_p99", [this](uint64_t) -> uint64_t { return histogram.percentile(0.99); });
+    }
+
+    /**
+    * A log line as the event loop pays for it: formatting and the copy into the ring. The
+    * writer thread drains into a temporary file, lines it cannot keep up with are dropped.
+    */
+    void benchLog() {
+        if (!selected("log_line")) return;
+        FILE* sink = std::tmpfile();
+        if (!sink) return;
+        Logger::instance().setLevel(LOG_LEVEL_INFO);
+        Logger::instance().start(sink, sink);
+        add("log_line", [this](uint64_t i) -> uint64_t {
+            LOG_INFO("[STABILIZE] Found closer successor: " << key(i) << " after " << i << " rounds");
+            return i;
+        });
+        Logger::instance().stop();
+        Logger::instance().setLevel(LOG_LEVEL_OFF);
+        std::fclose(sink);
+    }
+
+    /**
+    * One FIND_SUCCESSOR round trip over 127.0.0.1 between two reactors in this thread:
+    * client framing and send, server read, dispatch through ChordService and reply, client
+    * read and callback.
+    */
+    void benchDispatch() {
+        if (!selected("dispatch_find_successor_loopback") && !selected("cert_chunk_loopback")) return;
+
+        uint32_t loopback = inet_addr("127.0.0.1");
+        ChordNode node(loopback, opts.port);
+        buildRingView(node, opts.ring_size, rng);
+        StoreConfig store_cfg;
+        store_cfg.max_keys = 16;
+        store_cfg.arena_bytes = 4096;
+        KVStore store(store_cfg);
+        Reactor server;
+        if (!server.listen(opts.port)) {
+            std::cerr << "[BENCH] Could not listen on port " << opts.port << ", skipping loopback dispatch" << std::endl;
+            return;
+        }
+        Replicator replicator(node, server, store, 0);
+        Handoff handoff(server, store);
+        CertGossip certs(node, server);
+        ChordService service(node, server, store, replicator, handoff, certs);
+
+        Reactor client;
+        NodeInfo target = node.getMyself();
+        bool done = false;
+        bool ok = false;
+        Transport::RpcCallback on_response = [&done, &ok](bool r, const PacketHeader&, const uint8_t*) {
+            done = true;
+            ok = r;
+        };
+
+        add("dispatch_find_successor_loopback", [&](uint64_t i) -> uint64_t {
+            FindSuccessorPayload req;
+            req.target_id = key(i);
+            done = false;
+            client.call(target, MSG_FIND_SUCCESSOR, &req, sizeof(req), 1000, on_response);
+            while (!done) {
+                server.poll(0);
+                client.poll(0);
+            }
+            return ok;
+        });
+
+        // One 32 KiB certificate chunk over the same connection, sent straight from the
+        // record. Offsets past the first chunk are what a transfer mostly asks for.
+        if (!selected("cert_chunk_loopback")) return;
+        std::vector<uint8_t> cert(512 * 1024);
+        for (size_t k = 0; k < cert.size(); ++k) cert[k] = (uint8_t)rng();
+        certs.setCertificate(cert.data(), (uint32_t)cert.size(), 1);
+        CertChunkRequestPayload chunk_req;
+        chunk_req.version = 1;
+        chunk_req.hash = sha1(cert.data(), cert.size());
+        uint32_t chunks = (uint32_t)(cert.size() / CERT_CHUNK_LEN);
+        Transport::RpcCallback on_chunk = [&done, &ok](bool r, const PacketHeader& h, const uint8_t* payload) {
+            done = true;
+            ok = r && h.payload_len > sizeof(CertChunkPayload) && ((const CertChunkPayload*)payload)->status == CERT_CHUNK_OK;
+        };
+        add("cert_chunk_loopback", [&](uint64_t i) -> uint64_t {
+            chunk_req.offset = (uint32_t)(1 + i % (chunks - 1)) * CERT_CHUNK_LEN;
+            done = false;
+            client.call(target, MSG_CERT_CHUNK, &chunk_req, sizeof(chunk_req), 1000, on_chunk);
+            while (!done) {
+                server.poll(0);
+                client.poll(0);
+            }
+            return ok;
+        });
+    }
+
+    BenchOptions opts;
+    std::mt19937_64 rng;
+    Sha1ID keys[KEY_COUNT];
+    uint8_t frame[sizeof(PacketHeader) + sizeof(NodeListPayload)];
+    std::vector<BenchResult> results;
+    LatencyHistogram histogram;
+};
+
+static void printText(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << std::left << std::setw(36) << "benchmark" << std::right << std::setw(14) << "iterations"
+        << std::setw(12) << "ns/op" << std::setw(12) << "allocs/op" << std::setw(12) << "bytes/op" << "\n";
+    for (const BenchResult& r : results) {
+        out << std::left << std::setw(36) << r.name << std::right << std::setw(14) << r.iterations
+            << std::fixed << std::setprecision(2) << std::setw(12) << r.ns_per_op
+            << std::setw(12) << r.allocs_per_op << std::setw(12) << r.bytes_per_op << "\n";
+    }
+    out.flush();
+}
+
+static void printJson(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations << std::fixed << std::setprecision(3)
+            << ", \"ns_per_op\": " << r.ns_per_op << ", \"allocs_per_op\": " << r.allocs_per_op
+            << ", \"bytes_per_op\": " << r.bytes_per_op << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}" << std::endl;
+}
+
+static void printCsv(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "name,iterations,ns_per_op,allocs_per_op,bytes_per_op\n";
+    for (const BenchResult& r : results) {
+        out << r.name << "," << r.iterations << std::fixed << std::setprecision(3) << "," << r.ns_per_op << ","
+            << r.allocs_per_op << "," << r.bytes_per_op << "\n";
+    }
+    out.flush();
+}
+
+static void printBenchUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --format=text|json|csv  output format (default text)\n"
+              << "  --filter=SUBSTR         run only benchmarks whose name contains SUBSTR\n"
+              << "  --min-time-ms=N         minimum measured time per benchmark (default 200)\n"
+              << "  --ring-size=N           nodes in the ring the routing benchmarks see (default 1024)\n"
+              << "  --port=N                loopback port of the dispatch benchmark (default 5900)"
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+#ifdef _WIN32
+    WSADATA wsa; WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+    BenchOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strncmp(arg, "--format=", 9) == 0) opts.format = arg + 9;
+        else if (std::strncmp(arg, "--filter=", 9) == 0) opts.filter = arg + 9;
+        else if (std::strncmp(arg, "--min-time-ms=", 14) == 0) opts.min_time_ms = (uint32_t)std::strtoul(arg + 14, nullptr, 10);
+        else if (std::strncmp(arg, "--ring-size=", 12) == 0) opts.ring_size = std::atoi(arg + 12);
+        else if (std::strncmp(arg, "--port=", 7) == 0) opts.port = (uint16_t)std::atoi(arg + 7);
+        else {
+            printBenchUsage(argv[0]);
+            return 1;
+        }
+    }
+    if ((opts.format != "text" && opts.format != "json" && opts.format != "csv") || opts.min_time_ms == 0 || opts.ring_size < 2) {
+        printBenchUsage(argv[0]);
+        return 1;
+    }
+
+    // The node logs routing changes, keep stdout for the results only.
+    Logger::instance().setLevel(LOG_LEVEL_OFF);
+    BenchSuite suite(opts);
+    std::vector<BenchResult> results = suite.run();
+
+    if (opts.format == "json") printJson(std::cout, results);
+    else if (opts.format == "csv") printCsv(std::cout, results);
+    else printText(std::cout, results);
+    return 0;
+}
@@ -0,0 +1,428 @@
+// Closed-loop load generator for live rings. Many clients keep requests outstanding
+// against the nodes of a local or Docker ring, optionally while nodes are killed and
+// restarted, and the throughput and latency percentiles are reported as JSON or text.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Metrics.hpp"
+#include "Reactor.hpp"
+
+static std::atomic<bool> g_running(true);
+static void stopHandler(int) { g_running = false; }
+
+enum RequestKind { KIND_LOOKUP, KIND_CERT, KIND_PING, KIND_COUNT };
+static const char* const KIND_NAMES[KIND_COUNT] = {"lookup", "cert", "ping"};
+
+struct LoadOptions {
+    std::vector<NodeInfo> targets;
+    int nodes;                // consecutive IPs from the first target, 0: the targets as given
+    int clients;              // requests kept outstanding in total
+    int threads;              // event loops the clients are spread over
+    uint32_t duration_s;
+    double rate;              // requests per second over all clients, 0: as fast as answered
+    uint32_t weights[KIND_COUNT];
+    uint16_t timeout_ms;
+    std::string kill_cmd;     // run for a random node, {ip} is replaced by its address
+    std::string restart_cmd;
+    uint32_t churn_interval_ms;
+    uint32_t down_ms;         // time between killing a node and restarting it
+    uint64_t seed;
+    std::string format;
+
+    LoadOptions() : nodes(0), clients(16), threads(1), duration_s(10), rate(0), timeout_ms(1000), churn_interval_ms(5000),
+                    down_ms(2000), seed(1), format("json") {
+        weights[KIND_LOOKUP] = 8;
+        weights[KIND_CERT] = 1;
+        weights[KIND_PING] = 1;
+    }
+};
+
+// Completions of one second of the run.
+struct Window {
+    LatencyHistogram latency;
+    std::atomic<uint64_t> ok;
+    std::atomic<uint64_t> errors;
+
+    Window() {
+        ok.store(0, std::memory_order_relaxed);
+        errors.store(0, std::memory_order_relaxed);
+    }
+};
+
+struct KindStats {
+    LatencyHistogram latency;  // successful requests only
+    std::atomic<uint64_t> ok;
+    std::atomic<uint64_t> errors;
+
+    KindStats() {
+        ok.store(0, std::memory_order_relaxed);
+        errors.store(0, std::memory_order_relaxed);
+    }
+};
+
+struct ChurnEvent {
+    uint64_t at_ms;
+    const char* action;
+    std::string ip;
+    int status;
+};
+
+static std::string ipString(uint32_t ip) {
+    in_addr a;
+    a.s_addr = ip;
+    return inet_ntoa(a);
+}
+
+/**
+* Runs the clients on opts.threads event loops, each with its own Reactor and so with
+* one connection per node, shared by the clients of that loop. A client sends its next
+* request when the previous one completed, and with a rate no earlier than its share of
+* the rate allows. Latency is measured from send to response.
+*/
+class LoadRun {
+public:
+    explicit LoadRun(const LoadOptions& opts) : opts(opts), windows(opts.duration_s + 1), weight_total(0) {
+        for (int k = 0; k < KIND_COUNT; ++k) weight_total += opts.weights[k];
+    }
+
+    void run() {
+        start = std::chrono::steady_clock::now();
+        end = start + std::chrono::seconds(opts.duration_s);
+        std::vector<std::thread> loops;
+        for (int t = 0; t < opts.threads; ++t) loops.emplace_back([this, t]() { runLoop(t); });
+        std::thread churn;
+        if (!opts.kill_cmd.empty()) churn = std::thread([this]() { runChurn(); });
+        for (std::thread& l : loops) l.join();
+        stopped = std::chrono::steady_clock::now();
+        if (churn.joinable()) churn.join();
+    }
+
+    void printJson(std::ostream& out) const {
+        uint64_t ok = 0, errors = 0;
+        countKinds(&ok, &errors);
+        out << std::fixed << std::setprecision(1);
+        out << "{\n  \"targets\": " << opts.targets.size() << ", \"clients\": " << opts.clients << ", \"threads\": " << opts.threads
+            << ", \"duration_s\": " << elapsedS() << ", \"target_rate\": " << opts.rate << ",\n"
+            << "  \"requests\": " << ok + errors << ", \"ok\": " << ok << ", \"errors\": " << errors
+            << ", \"throughput_rps\": " << throughput() << ",\n  \"latency_us\": ";
+        printLatencyJson(out, latency);
+        out << ",\n  \"types\": [\n";
+        bool first = true;
+        for (int k = 0; k < KIND_COUNT; ++k) {
+            if (opts.weights[k] == 0) continue;
+            const KindStats& s = kinds[k];
+            out << (first ? "" : ",\n") << "    {\"type\": \"" << KIND_NAMES[k] << "\", \"ok\": " << s.ok.load()
+                << ", \"errors\": " << s.errors.load() << ", \"latency_us\": ";
+            printLatencyJson(out, s.latency);
+            out << "}";
+            first = false;
+        }
+        out << "\n  ],\n  \"churn\": [";
+        for (size_t i = 0; i < churn_events.size(); ++i) {
+            const ChurnEvent& e = churn_events[i];
+            out << (i ? ",\n" : "\n") << "    {\"t_ms\": " << e.at_ms << ", \"action\": \"" << e.action << "\", \"ip\": \"" << e.ip
+                << "\", \"status\": " << e.status << "}";
+        }
+        out << (churn_events.empty() ? "" : "\n  ") << "],\n  \"timeline\": [";
+        for (size_t s = 0; s < opts.duration_s && s < windows.size(); ++s) {
+            const Window& w = windows[s];
+            out << (s ? ",\n" : "\n") << "    {\"t_s\": " << s + 1 << ", \"ok\": " << w.ok.load() << ", \"errors\": " << w.errors.load()
+                << ", \"p50_us\": " << w.latency.percentile(0.5) << ", \"p99_us\": " << w.latency.percentile(0.99) << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+    }
+
+    void printText(std::ostream& out) const {
+        uint64_t ok = 0, errors = 0;
+        countKinds(&ok, &errors);
+        out << std::fixed << std::setprecision(1);
+        out << opts.clients << " clients on " << opts.threads << " loop(s) against " << opts.targets.size() << " nodes for "
+            << elapsedS() << " s: " << ok << " ok, " << errors << " errors, " << throughput() << " requests/s\n";
+        for (int k = 0; k < KIND_COUNT; ++k) {
+            if (opts.weights[k] == 0) continue;
+            const KindStats& s = kinds[k];
+            out << "  " << std::left << std::setw(8) << KIND_NAMES[k] << std::right << std::setw(10) << s.ok.load() << " ok "
+                << std::setw(8) << s.errors.load() << " errors  p50 " << s.latency.percentile(0.5) << " us  p99 "
+                << s.latency.percentile(0.99) << " us  p99.9 " << s.latency.percentile(0.999) << " us  max " << s.latency.maxUs() << " us\n";
+        }
+        for (const ChurnEvent& e : churn_events) {
+            out << "  " << e.at_ms << " ms: " << e.action << " " << e.ip << (e.status == 0 ? "" : " (command failed)") << "\n";
+        }
+        out.flush();
+    }
+
+private:
+    struct Client {
+        bool busy;
+        std::chrono::steady_clock::time_point next_send;
+    };
+
+    void runLoop(int t) {
+        Reactor reactor;
+        std::mt19937_64 rng(opts.seed * 1000003 + (uint64_t)t);
+        int first = opts.clients * t / opts.threads;
+        int count = opts.clients * (t + 1) / opts.threads - first;
+        std::vector<Client> clients(count);
+        std::chrono::microseconds interval(opts.rate > 0 ? (int64_t)(opts.clients * 1e6 / opts.rate) : 0);
+        for (int c = 0; c < count; ++c) {
+            clients[c].busy = false;
+            // Spread the first requests over one interval instead of sending them at once.
+            clients[c].next_send = start + interval * (first + c) / opts.clients;
+        }
+
+        int in_flight = 0;
+        while (g_running && std::chrono::steady_clock::now() < end) {
+            auto now = std::chrono::steady_clock::now();
+            for (int c = 0; c < count; ++c) {
+                if (clients[c].busy || clients[c].next_send > now) continue;
+                clients[c].busy = true;
+                ++in_flight;
+                send(reactor, rng, [this, &clients, &in_flight, c, interval](std::chrono::steady_clock::time_point done) {
+                    Client& cl = clients[c];
+                    cl.busy = false;
+                    --in_flight;
+                    cl.next_send = std::max(cl.next_send + interval, done - interval);
+                });
+            }
+            reactor.poll(1);
+        }
+        // Requests still outstanding complete or time out, nothing new is sent.
+        auto give_up = std::chrono::steady_clock::now() + std::chrono::milliseconds(opts.timeout_ms + 100);
+        while (in_flight > 0 && std::chrono::steady_clock::now() < give_up) reactor.poll(1);
+    }
+
+    template <typename F>
+    void send(Reactor& reactor, std::mt19937_64& rng, F done) {
+        RequestKind kind = pickKind(rng);
+        const NodeInfo& target = opts.targets[rng() % opts.targets.size()];
+        uint8_t type = MSG_PING, expected = MSG_PING;
+        FindSuccessorPayload lookup;
+        uint32_t len = 0;
+        if (kind == KIND_LOOKUP) {
+            for (int i = 0; i < 20; ++i) lookup.target_id.bytes[i] = (uint8_t)rng();
+            type = MSG_FIND_SUCCESSOR;
+            expected = MSG_FIND_SUCCESSOR_RESPONSE;
+            len = sizeof(lookup);
+        } else if (kind == KIND_CERT) {
+            type = MSG_GET_CERT;
+            expected = MSG_CERT_RESPONSE;
+        }
+        auto sent = std::chrono::steady_clock::now();
+        reactor.call(target, type, &lookup, len, opts.timeout_ms, [this, kind, expected, sent, done](bool ok, const PacketHeader& h, const uint8_t*) {
+            auto now = std::chrono::steady_clock::now();
+            record(kind, ok && h.type == expected, now, (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - sent).count());
+            done(now);
+        });
+    }
+
+    RequestKind pickKind(std::mt19937_64& rng) const {
+        uint64_t r = rng() % weight_total;
+        for (int k = 0; k < KIND_COUNT; ++k) {
+            if (r < opts.weights[k]) return (RequestKind)k;
+            r -= opts.weights[k];
+        }
+        return KIND_PING;
+    }
+
+    void record(RequestKind kind, bool ok, std::chrono::steady_clock::time_point at, uint64_t us) {
+        size_t s = (size_t)std::chrono::duration_cast<std::chrono::seconds>(at - start).count();
+        Window& w = windows[std::min(s, windows.size() - 1)];
+        if (ok) {
+            kinds[kind].ok.fetch_add(1, std::memory_order_relaxed);
+            kinds[kind].latency.record(us);
+            latency.record(us);
+            w.ok.fetch_add(1, std::memory_order_relaxed);
+            w.latency.record(us);
+        } else {
+            kinds[kind].errors.fetch_add(1, std::memory_order_relaxed);
+            w.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+    * Every churn_interval_ms kills a random node other than the first, which stays up as
+    * the bootstrap for restarts, and restarts it down_ms later.
+    */
+    void runChurn() {
+        std::mt19937_64 rng(opts.seed);
+        auto next = start + std::chrono::milliseconds(opts.churn_interval_ms);
+        while (g_running && next + std::chrono::milliseconds(opts.down_ms) < end && opts.targets.size() > 1) {
+            if (!sleepUntil(next)) break;
+            std::string ip = ipString(opts.targets[1 + rng() % (opts.targets.size() - 1)].ip);
+            runCommand("kill", opts.kill_cmd, ip);
+            sleepUntil(std::chrono::steady_clock::now() + std::chrono::milliseconds(opts.down_ms));
+            if (!opts.restart_cmd.empty()) runCommand("restart", opts.restart_cmd, ip);
+            next += std::chrono::milliseconds(opts.churn_interval_ms);
+        }
+    }
+
+    void runCommand(const char* action, std::string cmd, const std::string& ip) {
+        for (size_t pos = cmd.find("{ip}"); pos != std::string::npos; pos = cmd.find("{ip}", pos + ip.size())) cmd.replace(pos, 4, ip);
+        ChurnEvent e;
+        e.at_ms = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        e.action = action;
+        e.ip = ip;
+        e.status = std::system(cmd.c_str());
+        std::lock_guard<std::mutex> lock(churn_mutex);
+        churn_events.push_back(e);
+    }
+
+    // Returns false if the run was interrupted meanwhile.
+    bool sleepUntil(std::chrono::steady_clock::time_point t) {
+        while (g_running && std::chrono::steady_clock::now() < t) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return g_running;
+    }
+
+    void countKinds(uint64_t* ok, uint64_t* errors) const {
+        for (int k = 0; k < KIND_COUNT; ++k) {
+            *ok += kinds[k].ok.load();
+            *errors += kinds[k].errors.load();
+        }
+    }
+
+    static void printLatencyJson(std::ostream& out, const LatencyHistogram& h) {
+        out << "{\"p50\": " << h.percentile(0.5) << ", \"p90\": " << h.percentile(0.9) << ", \"p99\": " << h.percentile(0.99)
+            << ", \"p999\": " << h.percentile(0.999) << ", \"max\": " << h.maxUs() << ", \"mean\": "
+            << (h.count() ? (double)h.sumUs() / h.count() : 0.0) << "}";
+    }
+
+    double elapsedS() const { return std::chrono::duration_cast<std::chrono::milliseconds>(std::min(stopped, end) - start).count() / 1e3; }
+
+    // Successful requests per second while requests were sent, without the drain at the end.
+    double throughput() const {
+        uint64_t ok = 0;
+        for (size_t s = 0; s + 1 < windows.size(); ++s) ok += windows[s].ok.load();
+        double elapsed = elapsedS();
+        return elapsed > 0 ? ok / elapsed : 0;
+    }
+
+    const LoadOptions& opts;
+    std::vector<Window> windows;  // one per second, the last one collects what completed after the end
+    KindStats kinds[KIND_COUNT];
+    LatencyHistogram latency;     // successful requests of all kinds
+    uint64_t weight_total;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    std::chrono::steady_clock::time_point stopped;
+    std::mutex churn_mutex;
+    std::vector<ChurnEvent> churn_events;
+};
+
+static bool parseTarget(const char* arg, NodeInfo* out) {
+    std::memset(out, 0, sizeof(*out));
+    std::string s(arg);
+    size_t colon = s.find(':');
+    out->port = DEFAULT_PORT;
+    if (colon != std::string::npos) {
+        out->port = (uint16_t)std::atoi(s.c_str() + colon + 1);
+        s.resize(colon);
+    }
+    out->ip = inet_addr(s.c_str());
+    return out->ip != INADDR_NONE && out->port != 0;
+}
+
+// "lookup:8,cert:1,ping:1", kinds left out get weight 0.
+static bool parseMix(const char* arg, uint32_t* weights) {
+    for (int k = 0; k < KIND_COUNT; ++k) weights[k] = 0;
+    std::string mix(arg);
+    size_t pos = 0;
+    while (pos < mix.size()) {
+        size_t comma = mix.find(',', pos);
+        std::string item = mix.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t colon = item.find(':');
+        int k = 0;
+        while (k < KIND_COUNT && item.compare(0, colon, KIND_NAMES[k]) != 0) ++k;
+        if (colon == std::string::npos || k == KIND_COUNT) return false;
+        weights[k] = (uint32_t)std::strtoul(item.c_str() + colon + 1, nullptr, 10);
+        if (comma == std::string::npos) break;
+        pos = comma + 1;
+    }
+    return weights[KIND_LOOKUP] + weights[KIND_CERT] + weights[KIND_PING] > 0;
+}
+
+static void printLoadgenUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " NODE_IP[:PORT]... [options]\n"
+              << "  --nodes=N              use N consecutive IPs starting at the first node (default: the nodes given)\n"
+              << "  --clients=N            requests kept outstanding (default 16)\n"
+              << "  --threads=N            event loops the clients are spread over, one connection per node each (default 1)\n"
+              << "  --duration-s=N         length of the run (default 10)\n"
+              << "  --rate=R               requests per second over all clients (default 0, as fast as answered)\n"
+              << "  --mix=KIND:W,...       weights of lookup, cert and ping requests (default lookup:8,cert:1,ping:1)\n"
+              << "  --timeout-ms=N         a request without response counts as an error after N ms (default 1000)\n"
+              << "  --kill-cmd=CMD         command that kills the node at {ip}, run every churn interval\n"
+              << "  --restart-cmd=CMD      command that restarts the node at {ip} after --down-ms\n"
+              << "  --churn-interval-ms=N  time between two kills (default 5000)\n"
+              << "  --down-ms=N            time a killed node stays down (default 2000)\n"
+              << "  --seed=N               random seed (default 1)\n"
+              << "  --format=json|text     output format (default json)"
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGINT, stopHandler);
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+#ifdef _WIN32
+    WSADATA wsa; WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+
+    LoadOptions opts;
+    bool ok = true;
+    for (int i = 1; i < argc && ok; ++i) {
+        const char* arg = argv[i];
+        if (std::strncmp(arg, "--nodes=", 8) == 0) opts.nodes = std::atoi(arg + 8);
+        else if (std::strncmp(arg, "--clients=", 10) == 0) opts.clients = std::atoi(arg + 10);
+        else if (std::strncmp(arg, "--threads=", 10) == 0) opts.threads = std::atoi(arg + 10);
+        else if (std::strncmp(arg, "--duration-s=", 13) == 0) opts.duration_s = (uint32_t)std::strtoul(arg + 13, nullptr, 10);
+        else if (std::strncmp(arg, "--rate=", 7) == 0) opts.rate = std::atof(arg + 7);
+        else if (std::strncmp(arg, "--mix=", 6) == 0) ok = parseMix(arg + 6, opts.weights);
+        else if (std::strncmp(arg, "--timeout-ms=", 13) == 0) opts.timeout_ms = (uint16_t)std::atoi(arg + 13);
+        else if (std::strncmp(arg, "--kill-cmd=", 11) == 0) opts.kill_cmd = arg + 11;
+        else if (std::strncmp(arg, "--restart-cmd=", 14) == 0) opts.restart_cmd = arg + 14;
+        else if (std::strncmp(arg, "--churn-interval-ms=", 20) == 0) opts.churn_interval_ms = (uint32_t)std::strtoul(arg + 20, nullptr, 10);
+        else if (std::strncmp(arg, "--down-ms=", 10) == 0) opts.down_ms = (uint32_t)std::strtoul(arg + 10, nullptr, 10);
+        else if (std::strncmp(arg, "--seed=", 7) == 0) opts.seed = std::strtoull(arg + 7, nullptr, 10);
+        else if (std::strncmp(arg, "--format=", 9) == 0) opts.format = arg + 9;
+        else if (arg[0] != '-') {
+            NodeInfo target;
+            ok = parseTarget(arg, &target);
+            opts.targets.push_back(target);
+        }
+        else ok = false;
+    }
+    if (ok && opts.nodes > 0 && !opts.targets.empty()) {
+        NodeInfo first = opts.targets[0];
+        opts.targets.clear();
+        for (int n = 0; n < opts.nodes; ++n) {
+            NodeInfo t = first;
+            t.ip = htonl(ntohl(first.ip) + (uint32_t)n);
+            opts.targets.push_back(t);
+        }
+    }
+    if (!ok || opts.targets.empty() || opts.nodes < 0 || opts.clients < 1 || opts.threads < 1 || opts.threads > opts.clients ||
+        opts.duration_s == 0 || opts.rate < 0 || opts.timeout_ms == 0 || opts.churn_interval_ms == 0 ||
+        (opts.format != "json" && opts.format != "text")) {
+        printLoadgenUsage(argv[0]);
+        return 1;
+    }
+
+    Logger::instance().setLevel(LOG_LEVEL_OFF);
+    LoadRun load(opts);
+    load.run();
+    if (opts.format == "json") load.printJson(std::cout);
+    else load.printText(std::cout);
+    return 0;
+}
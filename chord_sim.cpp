@@ -0,0 +1,658 @@
+// Discrete-event simulation of a Chord ring: thousands of ChordService instances in one
+// process on a virtual network. Reports convergence, lookup hops and failover recovery.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include "ChordService.hpp"
+#include "Config.hpp"
+#include "SimNetwork.hpp"
+
+struct SimOptions {
+    int nodes;
+    int vnodes;
+    uint32_t join_interval_ms;
+    uint32_t settle_ms;
+    int lookups;
+    int batch;
+    double fail_fraction;
+    uint32_t churn_ms;
+    uint32_t churn_interval_ms;
+    double phi_threshold;
+    int cert_kb;
+    bool cold_start;
+    int hot_reads;
+    uint32_t cache_keys;
+    uint32_t cache_ttl_ms;
+    SimConfig net;
+
+    SimOptions() : nodes(1000), vnodes(1), join_interval_ms(20), settle_ms(10000), lookups(1000), batch(0),
+                   fail_fraction(0.1), churn_ms(0), churn_interval_ms(500), phi_threshold(DEFAULT_PHI_THRESHOLD),
+                   cert_kb(0), cold_start(false), hot_reads(0), cache_keys(0), cache_ttl_ms(1000) {}
+};
+
+struct LookupResult {
+    bool done;
+    bool ok;
+    NodeInfo owner;
+
+    LookupResult() : done(false), ok(false) { std::memset(&owner, 0, sizeof(owner)); }
+};
+
+/**
+* One simulated node: the same objects main.cpp wires up, on a SimTransport.
+*/
+struct SimNode {
+    SimTransport transport;
+    ChordNode node;
+    KVStore store;
+    Replicator replicator;
+    Handoff handoff;
+    CertGossip certs;
+    ChordService service;
+    std::unique_ptr<ReadCache> cache;  // one per node, chord_node shares it between virtual nodes
+
+    SimNode(SimNetwork& net, const NodeInfo& self, const StoreConfig& store_cfg)
+        : transport(net, self), node(self.ip, self.port), store(store_cfg),
+          replicator(node, transport, store, 0), handoff(transport, store), certs(node, transport),
+          service(node, transport, store, replicator, handoff, certs) {}
+};
+
+class Simulation {
+public:
+    Simulation(const SimOptions& opts, std::ostream& out) : opts(opts), out(out), net(opts.net), paused(false) {
+        store_cfg.max_keys = 16;
+        store_cfg.arena_bytes = 4096;
+    }
+
+    int run() {
+        uint64_t t0 = net.nowMs();
+        for (int i = 0; i < opts.nodes; ++i) {
+            // After a power cycle all hosts start at once. Discovery elects the same
+            // bootstrap for all of them, which starts the ring.
+            spawn(opts.cold_start);
+            if (!opts.cold_start) net.runUntil(net.nowMs() + opts.join_interval_ms);
+        }
+        uint64_t joined = net.nowMs();
+        out << "nodes            " << opts.nodes << (opts.cold_start ? " started at once" : " joined in ")
+            << (opts.cold_start ? "" : std::to_string(joined - t0) + " ms (virtual)");
+        if (opts.vnodes > 1) out << ", " << opts.vnodes << " virtual nodes each";
+        out << std::endl;
+
+        // With message loss the ring is rarely perfect at one instant, the run goes on anyway.
+        int status = 0;
+        uint64_t converged = waitForRing(120000);
+        if (converged == 0) {
+            out << "ring             did not converge, " << correctSuccessors() << "/" << aliveCount() << " successors correct" << std::endl;
+            status = 1;
+        } else {
+            out << "convergence      " << converged << " ms after the last join" << std::endl;
+        }
+        if (opts.cold_start) reportStartup();
+
+        reportOwnership();
+        measureMaintenance();
+        measureCertRotation();
+        measureLookups("lookups", ChordService::LOOKUP_ITERATIVE);
+        measureLookups("recursive", ChordService::LOOKUP_RECURSIVE);
+        if (opts.batch > 0) measureBatchLookup();
+        if (opts.hot_reads > 0) measureHotReads();
+
+        if (opts.fail_fraction > 0) {
+            int killed = killFraction(opts.fail_fraction);
+            uint64_t recovered = waitForRing(120000);
+            if (recovered == 0) {
+                out << "failover         " << killed << " nodes killed, ring did not recover, " << correctSuccessors() << "/"
+                    << aliveCount() << " successors correct" << std::endl;
+                status = 1;
+            } else {
+                out << "failover         " << killed << " nodes killed, ring repaired in " << recovered << " ms" << std::endl;
+            }
+            net.runUntil(net.nowMs() + opts.settle_ms);
+            measureLookups("lookups after", ChordService::LOOKUP_ITERATIVE);
+            measureLookups("recursive after", ChordService::LOOKUP_RECURSIVE);
+        }
+
+        if (opts.churn_ms > 0) runChurn();
+
+        out << "messages         " << net.messageCount() << " sent, " << net.droppedCount() << " dropped, "
+            << net.nowMs() << " ms simulated" << std::endl;
+        return status;
+    }
+
+private:
+    /**
+    * Starts a host with opts.vnodes virtual nodes on consecutive ports. Like chord_node,
+    * they join through a node of another host, on the first host through its first node.
+    * With elected set the other host is always the first one.
+    */
+    void spawn(bool elected = false) {
+        uint32_t ip;
+        do {
+            ip = (uint32_t)net.random()();
+        } while (ip == 0 || used_ips.count(ip));
+        used_ips.insert(ip);
+        hosts.push_back(ip);
+
+        std::vector<size_t> others = aliveIndices();
+        if (elected && !others.empty()) others.resize(1);
+        size_t first = nodes.size();
+        for (int v = 0; v < opts.vnodes; ++v) {
+            NodeInfo self;
+            std::memset(&self, 0, sizeof(self));
+            self.ip = ip;
+            self.port = (uint16_t)(DEFAULT_PORT + v);
+
+            std::unique_ptr<SimNode> n(new SimNode(net, self, store_cfg));
+            net.setAlive(SimNetwork::addrOf(self), true);
+            n->service.setPhiThreshold(opts.phi_threshold);
+            if (opts.cache_keys > 0) {
+                StoreConfig cache_cfg;
+                cache_cfg.max_keys = opts.cache_keys;
+                cache_cfg.arena_bytes = opts.cache_keys * 4096;
+                n->cache.reset(new ReadCache(cache_cfg, opts.cache_ttl_ms));
+                n->service.setReadCache(n->cache.get());
+            }
+            if (!others.empty()) {
+                n->service.setBootstrap(nodes[others[net.random()() % others.size()]]->node.getMyself());
+            } else if (v > 0) {
+                n->service.setBootstrap(nodes[first]->node.getMyself());
+            } else {
+                static const char root_secret[] = "TRUST-ME-I-AM-ROOT";
+                n->certs.setCertificate((const uint8_t*)root_secret, sizeof(root_secret), 1);
+            }
+            nodes.push_back(std::move(n));
+            scheduleTick(nodes.size() - 1, net.random()() % 20);
+        }
+    }
+
+    void killHost(uint32_t ip) {
+        NodeInfo n;
+        std::memset(&n, 0, sizeof(n));
+        n.ip = ip;
+        for (int v = 0; v < opts.vnodes; ++v) {
+            n.port = (uint16_t)(DEFAULT_PORT + v);
+            net.setAlive(SimNetwork::addrOf(n), false);
+        }
+    }
+
+    std::vector<uint32_t> aliveHosts() const {
+        std::vector<uint32_t> out_hosts;
+        NodeInfo n;
+        std::memset(&n, 0, sizeof(n));
+        n.port = DEFAULT_PORT;
+        for (uint32_t ip : hosts) {
+            n.ip = ip;
+            if (net.isAlive(SimNetwork::addrOf(n))) out_hosts.push_back(ip);
+        }
+        return out_hosts;
+    }
+
+    /**
+    * Share of the ring each host owns on the converged ring, relative to a fair share of
+    * 1/hosts. Virtual nodes narrow the spread.
+    */
+    void reportOwnership() {
+        std::vector<std::pair<Sha1ID, uint32_t>> ring;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (alive(i)) ring.push_back(std::make_pair(nodes[i]->node.getMyself().id, nodes[i]->node.getMyself().ip));
+        }
+        std::sort(ring.begin(), ring.end());
+        std::map<uint32_t, double> share;
+        for (size_t i = 0; i < ring.size(); ++i) {
+            const Sha1ID& pred = ring[(i + ring.size() - 1) % ring.size()].first;
+            share[ring[i].second] += ringFraction(pred, ring[i].first);
+        }
+        std::vector<uint64_t> rel;  // in percent of the fair share
+        for (auto& it : share) rel.push_back((uint64_t)(it.second * share.size() * 100 + 0.5));
+        out << "ownership        per host in % of a fair share: min " << percentile(rel, 0) << " p50 " << percentile(rel, 50)
+            << " p99 " << percentile(rel, 99) << " max " << percentile(rel, 100) << std::endl;
+    }
+
+    // Same cadence as the main loop, which polls for at most 20 ms between ticks.
+    void scheduleTick(size_t i, uint64_t delay) {
+        net.schedule(delay, [this, i]() {
+            SimNode* n = nodes[i].get();
+            if (!net.isAlive(SimNetwork::addrOf(n->node.getMyself()))) return;
+            if (!paused) n->service.tick();
+            else n->service.expireLookups();
+            scheduleTick(i, 20);
+        });
+    }
+
+    bool alive(size_t i) const { return net.isAlive(SimNetwork::addrOf(nodes[i]->node.getMyself())); }
+
+    std::vector<size_t> aliveIndices() const {
+        std::vector<size_t> out_idx;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (alive(i)) out_idx.push_back(i);
+        }
+        return out_idx;
+    }
+
+    size_t aliveCount() const { return aliveIndices().size(); }
+
+    // Alive nodes ordered by ID, the ring as it should be.
+    std::vector<Sha1ID> sortedIds() const {
+        std::vector<Sha1ID> ids;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (alive(i)) ids.push_back(nodes[i]->node.getMyself().id);
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    }
+
+    size_t correctSuccessors() const {
+        std::vector<Sha1ID> ids = sortedIds();
+        size_t correct = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (!alive(i)) continue;
+            const Sha1ID& me = nodes[i]->node.getMyself().id;
+            size_t pos = std::lower_bound(ids.begin(), ids.end(), me) - ids.begin();
+            const Sha1ID& expected_suc = ids[(pos + 1) % ids.size()];
+            const Sha1ID& expected_pred = ids[(pos + ids.size() - 1) % ids.size()];
+            const ChordNode& n = nodes[i]->node;
+            if (n.getSuccessor().id == expected_suc && n.hasPredecessor() && n.getPredecessor().id == expected_pred) ++correct;
+        }
+        return correct;
+    }
+
+    // Virtual ms until every successor and predecessor is correct, 0 on timeout.
+    uint64_t waitForRing(uint64_t limit_ms) {
+        uint64_t start = net.nowMs();
+        while (net.nowMs() - start < limit_ms) {
+            if (correctSuccessors() == aliveCount()) return std::max<uint64_t>(1, net.nowMs() - start);
+            net.runUntil(net.nowMs() + 100);
+        }
+        return 0;
+    }
+
+    Sha1ID ownerOf(const Sha1ID& key) const {
+        std::vector<Sha1ID> ids = sortedIds();
+        auto it = std::lower_bound(ids.begin(), ids.end(), key);
+        return it == ids.end() ? ids.front() : *it;
+    }
+
+    Sha1ID randomKey() {
+        Sha1ID key;
+        for (int i = 0; i < 20; i += 4) {
+            uint32_t r = (uint32_t)net.random()();
+            std::memcpy(&key.bytes[i], &r, 4);
+        }
+        return key;
+    }
+
+    uint64_t sentRequests(const uint8_t* types, size_t count) const {
+        uint64_t total = 0;
+        for (auto& n : nodes) {
+            for (size_t t = 0; t < count; ++t) total += n->transport.sentCount(types[t]);
+        }
+        return total;
+    }
+
+    /**
+    * Lets the ring settle and reports the traffic it causes on its own: all messages
+    * including responses, and the requests of stabilize and of fix fingers.
+    */
+    void measureMaintenance() {
+        static const uint8_t stabilize_types[] = {MSG_STABILIZE, MSG_GET_PREDECESSOR, MSG_GET_SUCLIST, MSG_NOTIFY, MSG_PING};
+        static const uint8_t finger_types[] = {MSG_FIND_SUCCESSOR};
+        uint64_t messages = net.messageCount();
+        uint64_t stabilize = sentRequests(stabilize_types, sizeof(stabilize_types));
+        uint64_t fingers = sentRequests(finger_types, sizeof(finger_types));
+        net.runUntil(net.nowMs() + opts.settle_ms);
+        double node_s = aliveCount() * (opts.settle_ms / 1000.0);
+        if (node_s <= 0) return;
+        out << "maintenance      " << (net.messageCount() - messages) / node_s << " msgs/node/s, stabilize requests "
+            << (sentRequests(stabilize_types, sizeof(stabilize_types)) - stabilize) / node_s << "/node/s, finger lookup requests "
+            << (sentRequests(finger_types, sizeof(finger_types)) - fingers) / node_s << "/node/s" << std::endl;
+    }
+
+    /**
+    * Startup timeline of a cold start: time from power-up until each node found its
+    * successor and until it held the certificate. Waits for the last certificate first.
+    */
+    void reportStartup() {
+        uint64_t start = net.nowMs();
+        while (nodesWithCert(1) < aliveCount() && net.nowMs() - start < 60000) net.runUntil(net.nowMs() + 100);
+        std::vector<uint64_t> joined_ms, cert_ms;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (!alive(i)) continue;
+            const ChordMetrics& m = nodes[i]->service.chordMetrics();
+            joined_ms.push_back(m.joined_ms.load());
+            if (m.cert_ms.load() != 0) cert_ms.push_back(m.cert_ms.load());
+        }
+        out << "startup          joined p50 " << percentile(joined_ms, 50) << " ms p99 " << percentile(joined_ms, 99) << " ms max "
+            << percentile(joined_ms, 100) << " ms, certificate p50 " << percentile(cert_ms, 50) << " ms p99 "
+            << percentile(cert_ms, 99) << " ms max " << percentile(cert_ms, 100) << " ms";
+        if (cert_ms.size() < joined_ms.size()) out << ", " << joined_ms.size() - cert_ms.size() << " without";
+        out << std::endl;
+    }
+
+    size_t nodesWithCert(uint64_t version) const {
+        size_t count = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (alive(i) && nodes[i]->certs.version() == version) ++count;
+        }
+        return count;
+    }
+
+    /**
+    * Hands a new certificate version to one random node and reports how long gossip takes
+    * to bring it to every node, in gossip intervals, and how many full records it moved.
+    */
+    void measureCertRotation() {
+        size_t initial = nodesWithCert(1);
+        uint64_t records = 0, chunks = 0;
+        for (auto& n : nodes) {
+            records -= n->certs.recordsSent();
+            chunks -= n->certs.chunksFetched();
+        }
+        std::vector<size_t> alive_idx = aliveIndices();
+        static const char rotated[] = "TRUST-ME-I-AM-THE-NEW-ROOT";
+        std::vector<uint8_t> cert(rotated, rotated + sizeof(rotated));
+        if (opts.cert_kb > 0) {
+            cert.resize((size_t)opts.cert_kb * 1024);
+            for (size_t i = sizeof(rotated); i < cert.size(); ++i) cert[i] = (uint8_t)net.random()();
+        }
+        nodes[alive_idx[net.random()() % alive_idx.size()]]->certs.setCertificate(cert.data(), (uint32_t)cert.size(), 2);
+
+        uint64_t start = net.nowMs();
+        while (nodesWithCert(2) < aliveCount() && net.nowMs() - start < 60000) net.runUntil(net.nowMs() + 100);
+        uint64_t took = net.nowMs() - start;
+        for (auto& n : nodes) {
+            records += n->certs.recordsSent();
+            chunks += n->certs.chunksFetched();
+        }
+        out << "certificates     version 1 on " << initial << "/" << aliveCount() << " nodes, version 2 (" << cert.size() << " bytes) on "
+            << nodesWithCert(2) << " after " << took << " ms (" << (double)took / CERT_GOSSIP_INTERVAL_MS << " gossip intervals), "
+            << records << " transfers, " << chunks << " chunks" << std::endl;
+    }
+
+    // An iterative lookup sends every request from the origin, a recursive one is passed
+    // on by every hop. Maintenance of the nodes runs iteratively, it is not counted.
+    uint64_t sentLookupRequests(const SimNode* origin, ChordService::LookupMode mode) const {
+        if (mode == ChordService::LOOKUP_ITERATIVE) return origin->transport.sentCount(MSG_FIND_SUCCESSOR);
+        uint64_t total = 0;
+        for (auto& n : nodes) total += n->transport.sentCount(MSG_FIND_SUCCESSOR_RECURSIVE);
+        return total;
+    }
+
+    /**
+    * Runs lookups one after another with maintenance paused, so every lookup request on
+    * the network belongs to the lookup being measured.
+    */
+    void measureLookups(const char* label, ChordService::LookupMode mode) {
+        paused = true;
+        std::vector<size_t> alive_idx = aliveIndices();
+        std::vector<uint64_t> hops;
+        std::vector<uint64_t> latency;
+        int ok = 0, correct = 0;
+        for (int l = 0; l < opts.lookups; ++l) {
+            SimNode* origin = nodes[alive_idx[net.random()() % alive_idx.size()]].get();
+            Sha1ID key = randomKey();
+            uint64_t before = sentLookupRequests(origin, mode);
+            uint64_t started = net.nowMs();
+            // Outlives this iteration if the lookup does not finish in time.
+            std::shared_ptr<LookupResult> result(new LookupResult());
+            origin->service.findSuccessor(key, mode, [result](bool r, const NodeInfo& o) {
+                result->done = true;
+                result->ok = r;
+                result->owner = o;
+            });
+            net.runWhile([result]() { return !result->done; }, 60000);
+            if (!result->done || !result->ok) continue;
+            ++ok;
+            if (result->owner.id == ownerOf(key)) ++correct;
+            hops.push_back(sentLookupRequests(origin, mode) - before);
+            latency.push_back(net.nowMs() - started);
+        }
+        paused = false;
+
+        out << label << std::string(17 - std::min<size_t>(16, std::strlen(label)), ' ')
+            << ok << "/" << opts.lookups << " ok, " << correct << " correct, hops mean " << mean(hops)
+            << " p50 " << percentile(hops, 50) << " p99 " << percentile(hops, 99) << " max " << percentile(hops, 100)
+            << ", latency p50 " << percentile(latency, 50) << " ms p99 " << percentile(latency, 99) << " ms" << std::endl;
+    }
+
+    /**
+    * One batched lookup of opts.batch random keys with maintenance paused, reports how
+    * many RPCs it took compared to one lookup per key.
+    */
+    void measureBatchLookup() {
+        paused = true;
+        std::vector<size_t> alive_idx = aliveIndices();
+        SimNode* origin = nodes[alive_idx[net.random()() % alive_idx.size()]].get();
+        std::vector<Sha1ID> keys;
+        for (int i = 0; i < opts.batch; ++i) keys.push_back(randomKey());
+
+        uint64_t before = origin->transport.sentCount(MSG_FIND_SUCCESSOR_BATCH);
+        uint64_t started = net.nowMs();
+        std::shared_ptr<LookupResult> done(new LookupResult());
+        std::shared_ptr<std::vector<NodeInfo>> owners(new std::vector<NodeInfo>());
+        std::shared_ptr<std::vector<uint8_t>> ok(new std::vector<uint8_t>());
+        origin->service.findSuccessors(keys, [done, owners, ok](const std::vector<uint8_t>& o, const std::vector<NodeInfo>& w) {
+            done->done = true;
+            *ok = o;
+            *owners = w;
+        });
+        net.runWhile([done]() { return !done->done; }, 60000);
+        paused = false;
+
+        int resolved = 0, correct = 0;
+        for (size_t i = 0; i < ok->size(); ++i) {
+            if (!(*ok)[i]) continue;
+            ++resolved;
+            if ((*owners)[i].id == ownerOf(keys[i])) ++correct;
+        }
+        uint64_t rpcs = origin->transport.sentCount(MSG_FIND_SUCCESSOR_BATCH) - before;
+        out << "batch lookup     " << opts.batch << " keys, " << resolved << " ok, " << correct << " correct, " << rpcs << " RPCs ("
+            << (double)rpcs / opts.batch << " per key), latency " << (net.nowMs() - started) << " ms" << std::endl;
+    }
+
+    /**
+    * Clients on random nodes read one 1 KiB key through random other nodes, one read per
+    * ms, as all PLCs fetch the same root certificate. Halfway through its owner writes a
+    * new version. Reports how many reads the owner served itself, and the reads that
+    * still returned the old version more than the cache TTL after the write.
+    */
+    void measureHotReads() {
+        std::vector<size_t> alive_idx = aliveIndices();
+        Sha1ID key = randomKey();
+        SimNode* owner = nullptr;
+        for (size_t i : alive_idx) {
+            if (nodes[i]->node.getMyself().id == ownerOf(key)) owner = nodes[i].get();
+        }
+        std::vector<uint8_t> value(1024);
+        for (size_t i = 0; i < value.size(); ++i) value[i] = (uint8_t)net.random()();
+        uint64_t old_version = 0, written_at = 0;
+        owner->store.put(key, value.data(), (uint32_t)value.size(), net.nowMs(), &old_version);
+
+        struct HotReads {
+            int ok;
+            int stale;
+            std::vector<uint64_t> latency;
+            HotReads() : ok(0), stale(0) {}
+        };
+        std::shared_ptr<HotReads> reads(new HotReads());
+        uint64_t served_before = owner->service.storeOpsServed();
+        uint64_t hits = 0;
+        for (size_t i : alive_idx) hits -= nodes[i]->service.chordMetrics().cache_hits.load();
+        KeyPayload req;
+        req.key = key;
+        req.flags = 0;
+        for (int r = 0; r < opts.hot_reads; ++r) {
+            if (r == opts.hot_reads / 2) {
+                owner->store.put(key, value.data(), (uint32_t)value.size(), net.nowMs());
+                written_at = net.nowMs();
+            }
+            SimNode* client = nodes[alive_idx[net.random()() % alive_idx.size()]].get();
+            SimNode* entry;
+            do {
+                entry = nodes[alive_idx[net.random()() % alive_idx.size()]].get();
+            } while (entry == client);
+            uint64_t started = net.nowMs();
+            uint64_t stale_after = written_at > 0 ? written_at + opts.cache_ttl_ms + 500 : ~0ull;
+            client->transport.call(entry->node.getMyself(), MSG_GET, &req, sizeof(req), 2000,
+                [this, reads, started, old_version, stale_after](bool ok, const PacketHeader& h, const uint8_t* payload) {
+                    const ValuePayload* resp = (const ValuePayload*)payload;
+                    if (!ok || h.type != MSG_GET_RESPONSE || h.payload_len < offsetof(ValuePayload, data) || resp->status != STORE_OK) return;
+                    ++reads->ok;
+                    reads->latency.push_back(net.nowMs() - started);
+                    if (resp->version == old_version && net.nowMs() > stale_after) ++reads->stale;
+                });
+            net.runUntil(net.nowMs() + 1);
+        }
+        net.runUntil(net.nowMs() + 3000);  // let the last reads finish
+        for (size_t i : alive_idx) hits += nodes[i]->service.chordMetrics().cache_hits.load();
+        uint64_t served = owner->service.storeOpsServed() - served_before;
+
+        out << "hot key          " << reads->ok << "/" << opts.hot_reads << " reads ok, owner served " << served << " ("
+            << 100.0 * served / opts.hot_reads << "%), " << hits << " cache hits, latency p50 " << percentile(reads->latency, 50)
+            << " ms p99 " << percentile(reads->latency, 99) << " ms, " << reads->stale << " stale after the TTL" << std::endl;
+    }
+
+    // Kills a fraction of the hosts with all their virtual nodes, returns the number of hosts.
+    int killFraction(double fraction) {
+        std::vector<uint32_t> alive_hosts = aliveHosts();
+        std::shuffle(alive_hosts.begin(), alive_hosts.end(), net.random());
+        int count = (int)(alive_hosts.size() * fraction);
+        for (int i = 0; i < count; ++i) killHost(alive_hosts[i]);
+        return count;
+    }
+
+    void killOne() {
+        std::vector<uint32_t> alive_hosts = aliveHosts();
+        killHost(alive_hosts[net.random()() % alive_hosts.size()]);
+    }
+
+    /**
+    * Alternates between killing a random node and spawning a new one while lookups keep
+    * running, then reports how many of them returned the correct owner.
+    */
+    void runChurn() {
+        uint64_t end = net.nowMs() + opts.churn_ms;
+        uint64_t next_event = net.nowMs();
+        bool kill_next = true;
+        int issued = 0, events = 0;
+        std::shared_ptr<int> ok(new int(0));
+        std::shared_ptr<int> correct(new int(0));
+        while (net.nowMs() < end) {
+            if (net.nowMs() >= next_event) {
+                if (kill_next) killOne();
+                else spawn();
+                kill_next = !kill_next;
+                next_event += opts.churn_interval_ms;
+                ++events;
+            }
+            std::vector<size_t> alive_idx = aliveIndices();
+            SimNode* origin = nodes[alive_idx[net.random()() % alive_idx.size()]].get();
+            Sha1ID key = randomKey();
+            ++issued;
+            origin->service.findSuccessor(key, [this, key, ok, correct](bool r, const NodeInfo& o) {
+                if (!r) return;
+                ++*ok;
+                if (o.id == ownerOf(key)) ++*correct;
+            });
+            net.runUntil(net.nowMs() + 100);
+        }
+        net.runUntil(net.nowMs() + 2000);  // let the last lookups finish
+        out << "churn            " << events << " joins/failures in " << opts.churn_ms << " ms, lookups "
+            << *ok << "/" << issued << " ok, " << *correct << " correct" << std::endl;
+    }
+
+    static double mean(const std::vector<uint64_t>& v) {
+        if (v.empty()) return 0;
+        uint64_t sum = 0;
+        for (uint64_t x : v) sum += x;
+        return (double)sum / v.size();
+    }
+
+    static uint64_t percentile(std::vector<uint64_t> v, int p) {
+        if (v.empty()) return 0;
+        std::sort(v.begin(), v.end());
+        size_t idx = (size_t)((v.size() - 1) * p / 100);
+        return v[idx];
+    }
+
+    SimOptions opts;
+    std::ostream& out;
+    SimNetwork net;
+    StoreConfig store_cfg;
+    bool paused;
+    std::vector<std::unique_ptr<SimNode>> nodes;
+    std::set<uint32_t> used_ips;
+    std::vector<uint32_t> hosts;
+};
+
+static void printSimUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --nodes=N              ring size in hosts (default 1000)\n"
+              << "  --vnodes=N             virtual nodes per host (default 1)\n"
+              << "  --seed=N               random seed, equal seeds give equal runs (default 1)\n"
+              << "  --latency=MIN:MAX      one-way latency in ms (default 1:20)\n"
+              << "  --loss=P               message loss probability (default 0)\n"
+              << "  --join-interval-ms=N   time between two joins (default 20)\n"
+              << "  --cold-start           start all nodes at once through one bootstrap, as after a power cycle\n"
+              << "  --settle-ms=N          time for fingers to settle before lookups (default 10000)\n"
+              << "  --lookups=N            measured lookups per phase (default 1000)\n"
+              << "  --batch=N              also resolve N keys in one batched lookup (default 0, off)\n"
+              << "  --fail=F               fraction of nodes killed at once (default 0.1)\n"
+              << "  --churn-ms=N           continuous churn phase length (default 0, off)\n"
+              << "  --churn-interval-ms=N  time between churn events (default 500)\n"
+              << "  --phi=X                suspicion at which a neighbour counts as failed (default " << DEFAULT_PHI_THRESHOLD << ")\n"
+              << "  --cert-kb=N            size of the rotated certificate in KiB (default: a short string)\n"
+              << "  --hot-reads=N          read one popular key N times through random nodes (default 0, off)\n"
+              << "  --cache-keys=N         read cache per node, as chord_node --cache-keys (default 0, off)\n"
+              << "  --cache-ttl-ms=N       how long a cached value is served (default 1000)"
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    SimOptions opts;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strncmp(arg, "--nodes=", 8) == 0) opts.nodes = std::atoi(arg + 8);
+        else if (std::strncmp(arg, "--vnodes=", 9) == 0) opts.vnodes = std::atoi(arg + 9);
+        else if (std::strncmp(arg, "--seed=", 7) == 0) opts.net.seed = std::strtoull(arg + 7, nullptr, 10);
+        else if (std::strncmp(arg, "--latency=", 10) == 0) {
+            opts.net.min_latency_ms = (uint32_t)std::strtoul(arg + 10, nullptr, 10);
+            const char* colon = std::strchr(arg + 10, ':');
+            opts.net.max_latency_ms = colon ? (uint32_t)std::strtoul(colon + 1, nullptr, 10) : opts.net.min_latency_ms;
+        }
+        else if (std::strncmp(arg, "--loss=", 7) == 0) opts.net.loss = std::atof(arg + 7);
+        else if (std::strncmp(arg, "--join-interval-ms=", 19) == 0) opts.join_interval_ms = (uint32_t)std::strtoul(arg + 19, nullptr, 10);
+        else if (std::strcmp(arg, "--cold-start") == 0) opts.cold_start = true;
+        else if (std::strncmp(arg, "--settle-ms=", 12) == 0) opts.settle_ms = (uint32_t)std::strtoul(arg + 12, nullptr, 10);
+        else if (std::strncmp(arg, "--lookups=", 10) == 0) opts.lookups = std::atoi(arg + 10);
+        else if (std::strncmp(arg, "--batch=", 8) == 0) opts.batch = std::atoi(arg + 8);
+        else if (std::strncmp(arg, "--fail=", 7) == 0) opts.fail_fraction = std::atof(arg + 7);
+        else if (std::strncmp(arg, "--churn-ms=", 11) == 0) opts.churn_ms = (uint32_t)std::strtoul(arg + 11, nullptr, 10);
+        else if (std::strncmp(arg, "--churn-interval-ms=", 20) == 0) opts.churn_interval_ms = (uint32_t)std::strtoul(arg + 20, nullptr, 10);
+        else if (std::strncmp(arg, "--phi=", 6) == 0) opts.phi_threshold = std::atof(arg + 6);
+        else if (std::strncmp(arg, "--cert-kb=", 10) == 0) opts.cert_kb = std::atoi(arg + 10);
+        else if (std::strncmp(arg, "--hot-reads=", 12) == 0) opts.hot_reads = std::atoi(arg + 12);
+        else if (std::strncmp(arg, "--cache-keys=", 13) == 0) opts.cache_keys = (uint32_t)std::strtoul(arg + 13, nullptr, 10);
+        else if (std::strncmp(arg, "--cache-ttl-ms=", 15) == 0) opts.cache_ttl_ms = (uint32_t)std::strtoul(arg + 15, nullptr, 10);
+        else {
+            printSimUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.nodes < 2 || opts.vnodes < 1 || opts.vnodes > MAX_VNODES || opts.net.max_latency_ms < opts.net.min_latency_ms || opts.fail_fraction < 0 || opts.fail_fraction >= 1 ||
+        opts.phi_threshold <= 0 || opts.cert_kb < 0 || (uint32_t)opts.cert_kb * 1024 > CERT_MAX_LEN ||
+        opts.hot_reads < 0 || opts.cache_ttl_ms == 0) {
+        printSimUsage(argv[0]);
+        return 1;
+    }
+
+    // The nodes log every routing change, keep stdout for the report only.
+    Logger::instance().setLevel(LOG_LEVEL_OFF);
+    Simulation sim(opts, std::cout);
+    return sim.run();
+}
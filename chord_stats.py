@@ -0,0 +1,112 @@
+import socket
+import struct
+import sys
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+PORT = 5000
+PROTOCOL_VERSION = 6
+
+MSG_GET_STATS = 0x27
+MSG_GET_STATS_RESP = 0x28
+STATS_FORMAT_BINARY = 0
+STATS_FORMAT_TEXT = 1
+
+COUNTERS = ["uptime_ms", "lookups_served", "store_ops_served", "successor_failovers", "predecessor_failovers",
+            "stabilize_changes", "join_attempts", "joins", "rpc_failures",
+            "cache_hits", "cache_misses"]
+STARTUP = ["discovered_ms", "joined_ms", "cert_ms"]
+LATENCY = ["count", "sum_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us"]
+
+def recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise ConnectionError("connection closed")
+        data += chunk
+    return data
+
+def get_stats(ip, port=PORT, fmt=STATS_FORMAT_BINARY):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    try:
+        sock.settimeout(1.0)
+        sock.connect((ip, port))
+        sock.sendall(struct.pack('<B B B I I B', 0xCC, PROTOCOL_VERSION, MSG_GET_STATS, 1, 1, fmt))
+        magic, _, msg_type, p_len, _ = struct.unpack('<B B B I I', recv_exact(sock, 11))
+        if magic != 0xCC or msg_type != MSG_GET_STATS_RESP:
+            raise ValueError("unexpected response type 0x%02x" % msg_type)
+        return recv_exact(sock, p_len)
+    finally:
+        sock.close()
+
+def parse_stats(payload):
+    off = 0
+    stats = dict(zip(COUNTERS, struct.unpack_from('<%dQ' % len(COUNTERS), payload, off)))
+    off += len(COUNTERS) * 8
+    stats.update(zip(STARTUP, struct.unpack_from('<3I', payload, off)))
+    off += 3 * 4
+    for name in ("handle", "rpc"):
+        stats[name] = dict(zip(LATENCY, struct.unpack_from('<2Q5I', payload, off)))
+        off += 2 * 8 + 5 * 4
+    count = payload[off]
+    off += 1
+    stats["types"] = []
+    for _ in range(count):
+        stats["types"].append(struct.unpack_from('<B2Q', payload, off))
+        off += 17
+    return stats
+
+def print_summary(ip, port, stats):
+    print(f"{ip}:{port} up {stats['uptime_ms'] / 1000:.0f} s")
+    steps = [f"{label} {stats[name]} ms" if stats[name] else f"{label} pending"
+             for name, label in zip(STARTUP, ("discovery", "joined", "certificate"))]
+    print("  startup " + ", ".join(steps))
+    for name, label in (("rpc", "outbound rpc"), ("handle", "request handling")):
+        h = stats[name]
+        print(f"  {label:17} {h['count']:>10} calls  p50 {h['p50_us']} us  p90 {h['p90_us']} us  "
+              f"p99 {h['p99_us']} us  p99.9 {h['p999_us']} us  max {h['max_us']} us")
+    print(f"  rpc failures {stats['rpc_failures']}, failovers {stats['successor_failovers']} successor / "
+          f"{stats['predecessor_failovers']} predecessor, stabilize changes {stats['stabilize_changes']}, "
+          f"joins {stats['joins']}/{stats['join_attempts']}")
+    print(f"  served {stats['lookups_served']} lookups, {stats['store_ops_served']} store requests, "
+          f"read cache {stats['cache_hits']} hits / {stats['cache_misses']} misses")
+    print("  type   received       sent")
+    for msg_type, received, sent in stats["types"]:
+        print(f"  0x{msg_type:02x} {received:>10} {sent:>10}")
+
+def serve(ip, port, http_port):
+    class MetricsHandler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            try:
+                body = get_stats(ip, port, STATS_FORMAT_TEXT)
+                self.send_response(200)
+            except Exception as e:
+                body = f"# node unreachable: {e}\n".encode()
+                self.send_response(503)
+            self.send_header("Content-Type", "text/plain; version=0.0.4")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, *args):
+            pass
+
+    print(f"Serving metrics of {ip}:{port} on http://0.0.0.0:{http_port}/metrics")
+    HTTPServer(("", http_port), MetricsHandler).serve_forever()
+
+if __name__ == "__main__":
+    args = [a for a in sys.argv[1:] if not a.startswith("--")]
+    flags = [a for a in sys.argv[1:] if a.startswith("--")]
+    if not args:
+        print(f"Usage: python {sys.argv[0]} IP [PORT] [--prometheus | --serve=HTTP_PORT]")
+        sys.exit(1)
+    ip = args[0]
+    port = int(args[1]) if len(args) > 1 else PORT
+
+    serve_flags = [f for f in flags if f.startswith("--serve=")]
+    if serve_flags:
+        serve(ip, port, int(serve_flags[0].split("=", 1)[1]))
+    elif "--prometheus" in flags:
+        sys.stdout.write(get_stats(ip, port, STATS_FORMAT_TEXT).decode())
+    else:
+        print_summary(ip, port, parse_stats(get_stats(ip, port)))
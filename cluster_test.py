@@ -3,14 +3,21 @@ import time
 import socket
 import struct
 import atexit
+import hashlib
 import os
+import shutil
+import signal
+import sys
+import tempfile
 
 BINARY_PATH = "./build/chord_node"
 START_PORT = 5000
 NUM_NODES = 10
 BOOTSTRAP_PORT = 5000
+STORE_SETTLE_S = 4  # discovery and join of the virtual nodes
 
-FMT_HEADER = '<B B I'
+FMT_HEADER = '<B B B I I'
+PROTOCOL_VERSION = 6
 FMT_NODE_INFO = '<20s I H'
 
 MSG_FIND_SUCCESSOR = 0x02
@@ -18,7 +25,25 @@ MSG_FIND_SUCCESSOR_RESPONSE = 0x03
 MSG_GET_CERT = 0x0C
 MSG_CERT_RESPONSE = 0x0D
 
-FMT_CERT_PAYLOAD = '<I 2048s'
+FMT_CERT_PAYLOAD = '<Q 20s I'  # version, SHA-1 of the data, data length, then the data
+
+MSG_PUT = 0x10
+MSG_PUT_RESPONSE = 0x11
+MSG_GET = 0x12
+MSG_GET_RESPONSE = 0x13
+MSG_DELETE = 0x14
+MSG_DELETE_RESPONSE = 0x15
+
+# StoreStatus
+STORE_OK = 0
+STORE_NOT_FOUND = 1
+
+FMT_VALUE_PAYLOAD = '<B I Q'  # status, value length, owner's item version, then the value
+
+LOG_RECORD_HEADER_LEN = 52  # LogRecordHeader in StoreLog.hpp, the value follows padded to 8 bytes
+
+def log_record_len(value_len):
+    return (LOG_RECORD_HEADER_LEN + value_len + 7) & ~7
 
 processes = []
 
@@ -53,14 +78,14 @@ def send_rpc_find_successor(target_port, search_id_byte):
         target_id = bytearray(20)
         target_id[19] = search_id_byte
 
-        header = struct.pack(FMT_HEADER, 0xCC, MSG_FIND_SUCCESSOR, 20)
+        header = struct.pack(FMT_HEADER, 0xCC, PROTOCOL_VERSION, MSG_FIND_SUCCESSOR, 20, 0)
 
         sock.sendall(header + target_id)
 
-        resp_hdr_bytes = sock.recv(6) # 1+1+4 bytes
-        if len(resp_hdr_bytes) < 6: return None
+        resp_hdr_bytes = sock.recv(11) # 1+1+1+4+4 bytes
+        if len(resp_hdr_bytes) < 11: return None
 
-        magic, msg_type, payload_len = struct.unpack(FMT_HEADER, resp_hdr_bytes)
+        magic, _, msg_type, payload_len, _ = struct.unpack(FMT_HEADER, resp_hdr_bytes)
 
         if msg_type == MSG_FIND_SUCCESSOR_RESPONSE:
             payload = sock.recv(payload_len)
@@ -71,24 +96,74 @@ def send_rpc_find_successor(target_port, search_id_byte):
         pass
     return None
 
+def recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise ConnectionError("connection closed")
+        data += chunk
+    return data
+
+def store_key(name):
+    return hashlib.sha1(name.encode()).digest()
+
+def send_store_rpc(port, msg_type, payload):
+    try:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.settimeout(2.0)
+        sock.connect(('127.0.0.1', port))
+        try:
+            sock.sendall(struct.pack(FMT_HEADER, 0xCC, PROTOCOL_VERSION, msg_type, len(payload), 0) + payload)
+            _, _, resp_type, payload_len, _ = struct.unpack(FMT_HEADER, recv_exact(sock, 11))
+            return resp_type, recv_exact(sock, payload_len)
+        finally:
+            sock.close()
+    except Exception:
+        return None
+
+# Status of the PUT, None without response.
+def send_rpc_put(port, key, value):
+    resp = send_store_rpc(port, MSG_PUT, key + b'\0' + struct.pack('<I', len(value)) + value)
+    if resp and resp[0] == MSG_PUT_RESPONSE and len(resp[1]) >= 1:
+        return resp[1][0]
+    return None
+
+# (status, value, version), value is None unless status is STORE_OK. None without response.
+def send_rpc_get(port, key):
+    resp = send_store_rpc(port, MSG_GET, key + b'\0')
+    if not resp or resp[0] != MSG_GET_RESPONSE or len(resp[1]) < 1:
+        return None
+    payload = resp[1]
+    if payload[0] != STORE_OK:
+        return payload[0], None, 0
+    status, value_len, version = struct.unpack(FMT_VALUE_PAYLOAD, payload[:13])
+    return status, payload[13:13 + value_len], version
+
+def send_rpc_delete(port, key):
+    resp = send_store_rpc(port, MSG_DELETE, key + b'\0')
+    if resp and resp[0] == MSG_DELETE_RESPONSE and len(resp[1]) >= 1:
+        return resp[1][0]
+    return None
+
 def test_node_certificate(port):
     try:
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.settimeout(1.5)
         sock.connect(('127.0.0.1', port))
 
-        header = struct.pack(FMT_HEADER, 0xCC, MSG_GET_CERT, 0)
+        header = struct.pack(FMT_HEADER, 0xCC, PROTOCOL_VERSION, MSG_GET_CERT, 0, 0)
         sock.sendall(header)
 
-        resp_hdr_bytes = sock.recv(6)
-        if len(resp_hdr_bytes) < 6: return None
-        magic, msg_type, payload_len = struct.unpack(FMT_HEADER, resp_hdr_bytes)
+        resp_hdr_bytes = sock.recv(11)
+        if len(resp_hdr_bytes) < 11: return None
+        magic, _, msg_type, payload_len, _ = struct.unpack(FMT_HEADER, resp_hdr_bytes)
 
         if msg_type == MSG_CERT_RESPONSE:
             payload = sock.recv(payload_len)
 
-            cert_len = struct.unpack('<I', payload[:4])[0]
-            cert_data = payload[4:4+cert_len]
+            _, _, cert_len = struct.unpack(FMT_CERT_PAYLOAD, payload[:32])
+            cert_data = payload[32:32+cert_len]
 
             cert_string = cert_data.decode('ascii', errors='ignore').strip('\x00')
             return cert_string
@@ -142,6 +217,132 @@ def print_topology():
 
     return len(nodes_found)
 
+def start_node(args, log_name):
+    if not os.path.exists("logs"):
+        os.makedirs("logs")
+    with open(f"logs/{log_name}.log", "w") as log:
+        p = subprocess.Popen([BINARY_PATH] + args, stdout=log, stderr=log)
+        processes.append(p)
+    return p
+
+def stop_node(p):
+    p.send_signal(signal.SIGINT)  # like Ctrl+C: handoff, the store log is flushed and trimmed
+    p.wait(timeout=15)
+
+def wait_for_port(port, timeout_s=10):
+    deadline = time.time() + timeout_s
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.5).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+failures = []
+
+def expect(condition, what):
+    print(f"  {'OK  ' if condition else 'FAIL'} {what}")
+    if not condition:
+        failures.append(what)
+
+def test_store_round_trip():
+    # Four virtual nodes on one host, so requests are relayed to the key's owner.
+    print("\n[STORE] PUT/GET/DELETE über vier virtuelle Nodes...")
+    node = start_node(["--vnodes=4"], "store_round_trip")
+    time.sleep(STORE_SETTLE_S)
+
+    for i in range(8):
+        key = store_key(f"cert-{i}")
+        value = f"certificate {i}".encode() * 10
+        put_port, get_port = START_PORT + i % 4, START_PORT + (i + 1) % 4
+        expect(send_rpc_put(put_port, key, value) == STORE_OK, f"PUT cert-{i} über Port {put_port} -> STORE_OK")
+        got = send_rpc_get(get_port, key)
+        expect(got is not None and got[0] == STORE_OK and got[1] == value and got[2] > 0,
+               f"GET cert-{i} über Port {get_port} -> STORE_OK, gleicher Wert, Version > 0")
+        expect(send_rpc_delete(START_PORT + (i + 2) % 4, key) == STORE_OK, f"DELETE cert-{i} -> STORE_OK")
+        got = send_rpc_get(put_port, key)
+        expect(got is not None and got[0] == STORE_NOT_FOUND, f"GET cert-{i} nach DELETE -> STORE_NOT_FOUND")
+        expect(send_rpc_delete(get_port, key) == STORE_NOT_FOUND, f"zweites DELETE cert-{i} -> STORE_NOT_FOUND")
+
+    stop_node(node)
+
+# The node listens before it replays its log, and logs asynchronously: wait for the line.
+def restored_line(log_name, timeout_s=5):
+    deadline = time.time() + timeout_s
+    while time.time() < deadline:
+        with open(f"logs/{log_name}.log", errors="ignore") as log:
+            for line in log:
+                if "[STORE] Restored" in line:
+                    return line.strip()
+        time.sleep(0.1)
+    return ""
+
+def start_persistent_node(data_dir, log_name):
+    node = start_node([f"--data-dir={data_dir}"], log_name)
+    expect(wait_for_port(START_PORT), f"{log_name}: Node erreichbar")
+    return node
+
+def expect_values(values, present, missing):
+    for name in present:
+        got = send_rpc_get(START_PORT, store_key(name))
+        expect(got is not None and got[0] == STORE_OK and got[1] == values[name], f"GET {name} -> STORE_OK, gleicher Wert")
+    for name in missing:
+        got = send_rpc_get(START_PORT, store_key(name))
+        expect(got is not None and got[0] == STORE_NOT_FOUND, f"GET {name} -> STORE_NOT_FOUND")
+
+def test_store_restart():
+    # Restarts with the same --data-dir replay store.log. A truncated or corrupted last
+    # record is dropped, everything before it survives.
+    print("\n[STORE] Neustart mit --data-dir...")
+    data_dir = tempfile.mkdtemp(prefix="sofia_store_")
+    log_path = os.path.join(data_dir, "store.log")
+    names = [f"device-{i}" for i in range(6)]
+    values = {name: f"{name} certificate ".encode() * (i + 3) for i, name in enumerate(names)}
+    try:
+        node = start_persistent_node(data_dir, "store_restart_1")
+        for name in names[:5]:
+            expect(send_rpc_put(START_PORT, store_key(name), values[name]) == STORE_OK, f"PUT {name} -> STORE_OK")
+        stop_node(node)
+
+        node = start_persistent_node(data_dir, "store_restart_2")
+        expect("Restored 5 keys from 5 log records" in restored_line("store_restart_2"), "5 Records wieder eingelesen")
+        expect_values(values, names[:5], [])
+        stop_node(node)
+
+        print("  -> Schneide den letzten Record (device-4) in der Mitte ab")
+        size = os.path.getsize(log_path)
+        os.truncate(log_path, size - log_record_len(len(values["device-4"])) // 2)
+        node = start_persistent_node(data_dir, "store_restart_3")
+        expect("Restored 4 keys from 4 log records" in restored_line("store_restart_3"), "4 Records wieder eingelesen")
+        expect_values(values, names[:4], ["device-4"])
+        # New writes are appended after the last valid record.
+        expect(send_rpc_put(START_PORT, store_key("device-5"), values["device-5"]) == STORE_OK, "PUT device-5 -> STORE_OK")
+        stop_node(node)
+
+        print("  -> Verfälsche ein Byte im Wert des letzten Records (device-5)")
+        size = os.path.getsize(log_path)
+        with open(log_path, "r+b") as log:
+            log.seek(size - log_record_len(len(values["device-5"])) + LOG_RECORD_HEADER_LEN)
+            byte = log.read(1)
+            log.seek(-1, os.SEEK_CUR)
+            log.write(bytes([byte[0] ^ 0xFF]))
+        node = start_persistent_node(data_dir, "store_restart_4")
+        expect("Restored 4 keys from 4 log records" in restored_line("store_restart_4"), "Record mit falscher CRC verworfen")
+        expect_values(values, names[:4], ["device-4", "device-5"])
+        stop_node(node)
+    finally:
+        shutil.rmtree(data_dir, ignore_errors=True)
+
+def test_store():
+    test_store_round_trip()
+    test_store_restart()
+    if failures:
+        print(f"\n[STORE] {len(failures)} Prüfung(en) fehlgeschlagen.")
+        return 1
+    print("\n[STORE] Alle Prüfungen bestanden.")
+    return 0
+
 def test_scenario():
     start_cluster()
 
@@ -195,6 +396,9 @@ def test_scenario():
 
 
 if __name__ == "__main__":
+    # python cluster_test.py store: only the store tests, exit code 1 on failures
+    if len(sys.argv) > 1 and sys.argv[1] == "store":
+        sys.exit(test_store())
     try:
         test_scenario()
         input("\nDrücke ENTER zum Beenden (Killt alle Nodes)...")
@@ -5,36 +5,40 @@ import sys
 
 MASTER_IP = "0.0.0.0"
 PORT = 5000
+PROTOCOL_VERSION = 6
+FMT_HEADER = '<B B B I I'
+HEADER_LEN = struct.calcsize(FMT_HEADER)
 
 MSG_GET_SUCLIST = 0x0A
 MSG_SUCLIST_RESP = 0x0B
 MSG_GET_CERT = 0x0C
 MSG_CERT_RESP = 0x0D
 
-def get_certificate(ip):
+def get_certificate(ip, port=PORT):
     try:
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.settimeout(1.0)
-        sock.connect((ip, PORT))
+        sock.connect((ip, port))
 
-        header = struct.pack('<B B I', 0xCC, MSG_GET_CERT, 0)
+        header = struct.pack(FMT_HEADER, 0xCC, PROTOCOL_VERSION, MSG_GET_CERT, 0, 0)
         sock.sendall(header)
 
-        resp_hdr = sock.recv(6)
-        if len(resp_hdr) < 6: return "ERR_HEADER"
+        resp_hdr = sock.recv(HEADER_LEN)
+        if len(resp_hdr) < HEADER_LEN: return "ERR_HEADER"
 
-        magic, msg_type, p_len = struct.unpack('<B B I', resp_hdr)
+        magic, _, msg_type, p_len, _ = struct.unpack(FMT_HEADER, resp_hdr)
 
         if msg_type == MSG_CERT_RESP:
             payload = sock.recv(p_len)
 
-            if len(payload) >= 4:
-                cert_len = struct.unpack('<I', payload[:4])[0]
-                cert_data = payload[4:4+cert_len].decode('utf-8', errors='ignore')
+            # version, SHA-1 of the data, data length, data
+            if len(payload) >= 32:
+                version, _, cert_len = struct.unpack('<Q 20s I', payload[:32])
+                cert_data = payload[32:32+cert_len].decode('utf-8', errors='ignore')
 
-                if cert_len == 0:
+                if version == 0:
                     return "[EMPTY]"
-                return cert_data
+                return f"v{version} {cert_data}"
 
         return "WRONG_MSG_TYPE"
     except Exception as e:
@@ -42,59 +46,68 @@ def get_certificate(ip):
     finally:
         sock.close()
 
-def get_successor(ip):
+def get_successor(ip, port=PORT):
     try:
         sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         sock.settimeout(1.0)
-        sock.connect((ip, PORT))
+        sock.connect((ip, port))
 
-        header = struct.pack('<B B I', 0xCC, MSG_GET_SUCLIST, 0)
+        header = struct.pack(FMT_HEADER, 0xCC, PROTOCOL_VERSION, MSG_GET_SUCLIST, 0, 0)
         sock.sendall(header)
 
-        resp_hdr = sock.recv(6)
-        magic, msg_type, p_len = struct.unpack('<B B I', resp_hdr)
+        resp_hdr = sock.recv(HEADER_LEN)
+        if len(resp_hdr) < HEADER_LEN: return None
+        magic, _, msg_type, p_len, _ = struct.unpack(FMT_HEADER, resp_hdr)
 
         if msg_type == MSG_SUCLIST_RESP:
             payload = sock.recv(p_len)
             next_node_ip_raw = payload[21:25]
-            return socket.inet_ntoa(next_node_ip_raw)
+            next_port = struct.unpack('<H', payload[25:27])[0]
+            return (socket.inet_ntoa(next_node_ip_raw), next_port)
         sock.close()
     except:
         return None
 
+def node_name(node):
+    ip, port = node
+    return ip if port == PORT else f"{ip}:{port}"
+
 def walk_ring(start_ip, num_nodes):
+    # With virtual nodes a host appears once per port, num_nodes counts ring positions.
     print(f"\n--- Starting Ring-Check & Cert-Audit at {start_ip} ---\n")
-    print(f"{'STEP':<5} | {'CURRENT IP':<15} | {'NEXT IP':<15}  | {'CERTIFICATE STATUS'}")
-    print("-" * 75)
+    print(f"{'STEP':<5} | {'CURRENT NODE':<21} | {'NEXT NODE':<21}  | {'CERTIFICATE STATUS'}")
+    print("-" * 87)
 
-    current_ip = start_ip
+    start = (start_ip, PORT)
+    current = start
     visited = []
 
     for i in range(num_nodes * 2):
-        visited.append(current_ip)
+        visited.append(current)
 
-        cert = get_certificate(current_ip)
+        cert = get_certificate(*current)
 
-        next_ip = get_successor(current_ip)
+        next_node = get_successor(*current)
 
         cert_display = (cert[:30] + '..') if len(cert) > 30 else cert
-        print(f"{i+1:<5} | {current_ip:<15} -> {str(next_ip):<15} | {cert_display}")
+        next_display = node_name(next_node) if next_node else "None"
+        print(f"{i+1:<5} | {node_name(current):<21} -> {next_display:<21} | {cert_display}")
 
-        if not next_ip:
-            print(f"\nCancel: Node {current_ip} is not responding.")
+        if not next_node:
+            print(f"\nCancel: Node {node_name(current)} is not responding.")
             return
 
-        if next_ip == start_ip:
-            print("-" * 75)
+        if next_node == start:
+            print("-" * 87)
             print(f"Ring closed! Found {len(visited)} nodes.")
             return
 
-        if next_ip in visited:
-            print("-" * 75)
-            print(f"Short circuit (Loop) found! Pointing to already found node {next_ip}.")
+        if next_node in visited:
+            print("-" * 87)
+            print(f"Short circuit (Loop) found! Pointing to already found node {node_name(next_node)}.")
             return
 
-        current_ip = next_ip
+        current = next_node
 
     print(f"\nRing not closed or too many moves needed (Limit: {num_nodes * 2}).")
 
@@ -1,41 +1,52 @@
 #include <iostream>
-#include <vector>
 #include <thread>
 #include <chrono>
 #include <csignal>
 #include <atomic>
+#include <cstdio>
 #include <cstring>
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <vector>
 
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#pragma comment(lib, "ws2_32.lib")
-#else
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <ifaddrs.h>
-#include <netdb.h>
-#define SOCKET int
-#define INVALID_SOCKET -1
-#define SOCKET_ERROR -1
-#define closesocket close
-#endif
+#include "Net.h"
 
 #define CHORD_PORT 5000
 #define DISCOVERY_PORT 5001
+#define HEARTBEAT_PORT 5002
+
+constexpr int LOAD_REPORT_INTERVAL_S = 30;
+constexpr int DISCOVERY_FIRST_WINDOW_MS = 100;  // doubled each round
+constexpr int DISCOVERY_ROUNDS = 3;
+constexpr size_t DISCOVERY_MAX_BOOTSTRAPS = 3;
 
 #include "Protocol.h"
 #include "ChordNode.hpp"
+#include "Config.hpp"
+#include "KVStore.hpp"
+#include "StoreLog.hpp"
+#include "ReadCache.hpp"
+#include "Reactor.hpp"
+#include "ChordService.hpp"
+#include "Workers.hpp"
 
 std::atomic<bool> g_running(true);
 void signalHandler(int) { g_running = false; }
 
+// Steady clock ms at which this host became part of a ring, 0 before.
+std::atomic<uint64_t> g_member_since(0);
+
+static uint64_t steadyMs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 #pragma pack(push, 1)
 struct DiscoveryPacket {
     uint32_t magic;
     uint32_t sender_id;
+    uint32_t member_ms;  // how long the sender has been part of a ring, 0: not yet
 };
 #pragma pack(pop)
 
@@ -87,7 +98,9 @@ void discovery_responder_thread(uint32_t my_id) {
 
         if (n == sizeof(DiscoveryPacket) && incoming.magic == DISCOVERY_MAGIC) {
             if (incoming.sender_id != my_id) {
-                DiscoveryPacket reply = {DISCOVERY_MAGIC, my_id};
+                uint64_t since = g_member_since.load();
+                uint32_t member_ms = since == 0 ? 0 : (uint32_t)std::max<uint64_t>(1, steadyMs() - since);
+                DiscoveryPacket reply = {DISCOVERY_MAGIC, my_id, member_ms};
                 sendto(sock, (const char*)&reply, sizeof(reply), 0, (struct sockaddr*)&client_addr, len);
             }
         }
@@ -95,93 +108,207 @@ void discovery_responder_thread(uint32_t my_id) {
     closesocket(sock);
 }
 
-uint32_t discover_neighbor_ip(uint32_t my_id) {
+struct DiscoveryReply {
+    uint32_t ip;
+    uint32_t member_ms;
+};
+
+/**
+* Broadcasts for other nodes and collects every reply within a window, repeated with a
+* doubled window while no ring member answered. Returns the bootstraps to join through,
+* best first, or nothing if we are to start the ring.
+*
+* Members are preferred, the longest standing first: after a split their ring is the one
+* everybody else joins. If only nodes that are still starting themselves answer, as after
+* a power cycle of the whole plant, the one with the lowest address starts the ring and
+* all others join through it. Every node sees about the same repliers, so they agree
+* without another round of messages.
+*/
+std::vector<uint32_t> discoverBootstraps(uint32_t my_id, uint32_t my_ip) {
+    std::vector<uint32_t> chosen;
     SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == INVALID_SOCKET) return chosen;
     int broadcast_opt = 1;
     setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (char*)&broadcast_opt, sizeof(broadcast_opt));
 
-    timeval tv = {0, 500000};
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(tv));
-
     sockaddr_in b_addr = {AF_INET, htons(DISCOVERY_PORT)};
     b_addr.sin_addr.s_addr = inet_addr("255.255.255.255");
-
-    DiscoveryPacket packet = {DISCOVERY_MAGIC, my_id};
-
-    uint32_t found_ip = 0;
-
-    sendto(sock, (char*)&packet, sizeof(packet), 0, (struct sockaddr*)&b_addr, sizeof(b_addr));
-
-    sockaddr_in resp_addr;
-    socklen_t resp_len = sizeof(resp_addr);
-    DiscoveryPacket recv_pkt;
-
-    int n = recvfrom(sock, (char*)&recv_pkt, sizeof(recv_pkt), 0, (struct sockaddr*)&resp_addr, &resp_len);
-
-    if (n == sizeof(DiscoveryPacket)) {
-        if (recv_pkt.magic == DISCOVERY_MAGIC) {
-            if (recv_pkt.sender_id != my_id) {
-                found_ip = resp_addr.sin_addr.s_addr;
-                std::cout << "[DISCOVERY] Real neighbor found at " << inet_ntoa(resp_addr.sin_addr) << std::endl;
-            } else {
-                std::cout << "[DISCOVERY] Loopback detected (my own ID " << my_id << "). Ignoring..." << std::endl;
+    DiscoveryPacket packet = {DISCOVERY_MAGIC, my_id, 0};
+
+    std::vector<DiscoveryReply> replies;
+    bool member_found = false;
+    int window_ms = DISCOVERY_FIRST_WINDOW_MS;
+    for (int round = 0; round < DISCOVERY_ROUNDS && !member_found; ++round, window_ms *= 2) {
+        sendto(sock, (char*)&packet, sizeof(packet), 0, (struct sockaddr*)&b_addr, sizeof(b_addr));
+        uint64_t deadline = steadyMs() + window_ms;
+        for (uint64_t now = steadyMs(); now < deadline; now = steadyMs()) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(sock, &readable);
+            uint64_t left = deadline - now;
+            timeval tv = {(long)(left / 1000), (long)(left % 1000) * 1000};
+            if (select((int)sock + 1, &readable, nullptr, nullptr, &tv) <= 0) break;
+
+            DiscoveryPacket recv_pkt;
+            sockaddr_in resp_addr;
+            socklen_t resp_len = sizeof(resp_addr);
+            int n = recvfrom(sock, (char*)&recv_pkt, sizeof(recv_pkt), 0, (struct sockaddr*)&resp_addr, &resp_len);
+            if (n != sizeof(DiscoveryPacket) || recv_pkt.magic != DISCOVERY_MAGIC || recv_pkt.sender_id == my_id) continue;
+            uint32_t ip = resp_addr.sin_addr.s_addr;
+            bool seen = false;
+            for (DiscoveryReply& r : replies) {
+                if (r.ip != ip) continue;
+                r.member_ms = std::max(r.member_ms, recv_pkt.member_ms);
+                seen = true;
             }
+            if (!seen) replies.push_back(DiscoveryReply{ip, recv_pkt.member_ms});
+            if (recv_pkt.member_ms > 0) member_found = true;
         }
     }
-
     closesocket(sock);
-    return found_ip;
+
+    if (member_found) {
+        std::sort(replies.begin(), replies.end(), [](const DiscoveryReply& a, const DiscoveryReply& b) {
+            return a.member_ms > b.member_ms;
+        });
+        for (const DiscoveryReply& r : replies) {
+            if (r.member_ms > 0 && chosen.size() < DISCOVERY_MAX_BOOTSTRAPS) chosen.push_back(r.ip);
+        }
+        LOG_INFO("[DISCOVERY] " << replies.size() << " node(s) answered, joining through ring members");
+        return chosen;
+    }
+    uint32_t lowest = my_ip;
+    for (const DiscoveryReply& r : replies) {
+        if (ntohl(r.ip) < ntohl(lowest)) lowest = r.ip;
+    }
+    if (lowest != my_ip) chosen.push_back(lowest);
+    if (!replies.empty()) {
+        LOG_INFO("[DISCOVERY] " << replies.size() << " starting node(s) answered, "
+                 << (chosen.empty() ? "lowest address, starting the ring" : "joining through the lowest address"));
+    }
+    return chosen;
 }
 
-void sendPacket(SOCKET sock, uint8_t type, const void* payload, uint32_t len) {
-    PacketHeader hdr;
-    hdr.magic = 0xCC;
-    hdr.type = type;
-    hdr.payload_len = len;
-    send(sock, (const char*)&hdr, sizeof(hdr), 0);
-    if (len > 0) send(sock, (const char*)payload, len, 0);
+/**
+* One position on the ring with its own routing state, key range and store, served on
+* its own port of the shared reactor.
+*/
+struct VirtualNode {
+    PortTransport transport;
+    ChordNode node;
+    KVStore store;
+    StoreLog log;
+    Replicator replicator;
+    Handoff handoff;
+    CertGossip certs;
+    ChordService service;
+
+    VirtualNode(Reactor& reactor, uint32_t ip, uint16_t port, const StoreConfig& store_cfg, int replicas)
+        : transport(reactor, port), node(ip, port), store(store_cfg), replicator(node, transport, store, replicas),
+          handoff(transport, store), certs(node, transport), service(node, transport, store, replicator, handoff, certs) {}
+};
+
+// Reads a certificate file, false if it cannot be read or does not fit into CERT_MAX_LEN.
+bool loadCertificate(const std::string& path, std::vector<uint8_t>* out) {
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+    out->resize(CERT_MAX_LEN + 1);
+    size_t len = std::fread(out->data(), 1, out->size(), f);
+    bool ok = !std::ferror(f) && len > 0 && len <= CERT_MAX_LEN;
+    std::fclose(f);
+    out->resize(len);
+    return ok;
 }
 
-bool sendRpc(NodeInfo target, uint8_t type, const void* payload, uint32_t len, PacketHeader* out_hdr, uint8_t* out_buffer, uint32_t max_buffer_len, uint16_t timeout_ms = 200) {
-    if (out_buffer && max_buffer_len > 0) std::memset(out_buffer, 0, max_buffer_len);
-    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == INVALID_SOCKET) return false;
+/**
+* Logs the share of the ring and of the keys each virtual node owns, and the requests it
+* served. Stored keys include the replicas held for other nodes.
+*/
+void printLoadReport(const std::vector<std::unique_ptr<VirtualNode>>& vnodes) {
+    std::vector<double> shares;
+    std::vector<uint32_t> owned;
+    double total_share = 0;
+    uint32_t total_owned = 0, total_stored = 0;
+    for (auto& v : vnodes) {
+        const ChordNode& n = v->node;
+        double share = n.isAlone() ? 1.0 : (n.hasPredecessor() ? ringFraction(n.getPredecessor().id, n.getMyself().id) : 0.0);
+        uint32_t keys = 0;
+        v->store.forEach([&](const Sha1ID& key, uint64_t, bool tombstone) {
+            if (!tombstone && n.isResponsibleFor(key)) ++keys;
+        });
+        shares.push_back(share);
+        owned.push_back(keys);
+        total_share += share;
+        total_owned += keys;
+        total_stored += v->store.size();
+    }
+    LOG_INFO("[LOAD] " << vnodes.size() << " virtual node(s) own " << std::fixed << std::setprecision(2) << total_share * 100
+                       << std::defaultfloat << "% of the ring, " << total_owned << " keys owned, " << total_stored << " stored");
+    if (vnodes.size() < 2) return;
+    for (size_t i = 0; i < vnodes.size(); ++i) {
+        const VirtualNode& v = *vnodes[i];
+        LOG_INFO("[LOAD]   port " << v.node.getMyself().port << " id " << v.node.getMyself().id << ": " << std::fixed
+                                  << std::setprecision(2) << shares[i] * 100 << "% of the ring, " << owned[i] << " keys owned, "
+                                  << v.store.size() << " stored, " << v.service.lookupsServed() << " lookups, "
+                                  << v.service.storeOpsServed() << " store requests");
+    }
+}
 
-#ifdef _WIN32
-    DWORD timeout = timeout_ms;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
-#else
-    struct timeval tv; tv.tv_sec = timeout_ms / 1000; tv.tv_usec = (timeout_ms % 1000) * 1000;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-#endif
+static void printPeerHealth(std::ostream& out, const FailureDetector& fd, uint16_t port, const char* role, const NodeInfo& peer, uint64_t now) {
+    out << "[HEALTH] port " << port << " " << role << " " << peer.id << ": ";
+    const PeerHealth* h = fd.get(peer);
+    if (!h || h->heartbeats == 0) {
+        out << "no heartbeat yet";
+        return;
+    }
+    if (h->rtt_samples > 0) out << "rtt " << h->srtt_ms << " ms (+-" << h->rttvar_ms << "), ";
+    out << "heartbeat every " << h->interval_mean_ms << " ms (+-"
+        << h->interval_var_ms << "), phi " << fd.phi(peer, now) << ", timeout " << fd.timeoutFor(peer) << " ms, "
+        << h->misses << " missed";
+}
 
-    sockaddr_in addr;
-    std::memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = target.ip;
-    addr.sin_port = htons(target.port);
-
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-        sendPacket(sock, type, payload, len);
-        if (out_hdr) {
-            if (recv(sock, (char*)out_hdr, sizeof(PacketHeader), 0) == sizeof(PacketHeader)) {
-                if (out_hdr->payload_len > 0 && out_buffer) {
-                    uint32_t to_read = std::min(out_hdr->payload_len, max_buffer_len);
-                    uint32_t received = 0;
-                    while (received < to_read) {
-                        int r = recv(sock, (char*)out_buffer + received, to_read - received, 0);
-                        if (r <= 0) break;
-                        received += r;
-                    }
-                }
-                closesocket(sock); return true;
-            }
-        } else { closesocket(sock); return true; }
+/**
+* Logs the heartbeat statistics of each virtual node's neighbours, the inputs to tune
+* --phi against.
+*/
+void printHealthReport(const std::vector<std::unique_ptr<VirtualNode>>& vnodes) {
+    if (!Logger::instance().enabled(LOG_LEVEL_INFO)) return;
+    for (auto& v : vnodes) {
+        const ChordNode& n = v->node;
+        if (n.isAlone()) continue;
+        const FailureDetector& fd = v->service.failureDetector();
+        uint64_t now = v->transport.nowMs();
+        {
+            LogLine line(LOG_LEVEL_INFO);
+            line << std::fixed << std::setprecision(2);
+            printPeerHealth(line, fd, n.getMyself().port, "successor", n.getSuccessor(), now);
+        }
+        if (n.hasPredecessor()) {
+            LogLine line(LOG_LEVEL_INFO);
+            line << std::fixed << std::setprecision(2);
+            printPeerHealth(line, fd, n.getMyself().port, "predecessor", n.getPredecessor(), now);
+        }
     }
-    closesocket(sock); return false;
+}
+
+/**
+* Logs message totals and RPC latencies of the host, all virtual nodes together. The full
+* counters are served through MSG_GET_STATS.
+*/
+void printRpcReport(const Reactor& reactor) {
+    const RpcMetrics& m = *reactor.rpcMetrics();
+    uint64_t in = 0, out = 0;
+    for (int t = 0; t < 256; ++t) {
+        in += m.requests_in[t].load(std::memory_order_relaxed);
+        out += m.requests_out[t].load(std::memory_order_relaxed);
+    }
+    LOG_INFO("[RPC] " << in << " requests served, handler p99 " << m.handle_us.percentile(0.99) << " us; " << out
+                      << " sent, rtt p50 " << m.rpc_us.percentile(0.5) << " us p99 " << m.rpc_us.percentile(0.99) << " us max "
+                      << m.rpc_us.maxUs() << " us, " << m.rpc_failures.load(std::memory_order_relaxed) << " failed");
 }
 
 int main(int argc, char* argv[]) {
+    uint64_t start_ms = steadyMs();
     signal(SIGINT, signalHandler);
 #ifndef _WIN32
     signal(SIGPIPE, SIG_IGN);
@@ -191,13 +318,18 @@ int main(int argc, char* argv[]) {
     WSADATA wsa; WSAStartup(MAKEWORD(2, 2), &wsa);
 #endif
 
+    NodeConfig config;
+    if (!parseArgs(argc, argv, &config)) return 1;
+    Logger::instance().setLevel(config.log_level);
+    Logger::instance().start();
+
     uint16_t discovery_port = 5001;
     uint16_t fixed_port = 5000;
     uint32_t bootstrap_ip = 0;
 
     uint32_t my_ip = get_local_ip();
     if (my_ip == 0) {
-        std::cerr << "[ERROR] Could not determine local IP. Loopback fallback." << std::endl;
+        LOG_ERROR("[ERROR] Could not determine local IP. Loopback fallback.");
         my_ip = inet_addr("127.0.0.1");
     }
 
@@ -207,167 +339,152 @@ int main(int argc, char* argv[]) {
     std::thread responder(discovery_responder_thread, my_discovery_id);
     responder.detach();
 
-    std::srand(my_ip);
-    std::this_thread::sleep_for(std::chrono::milliseconds(std::rand() % 2000));
+    Reactor reactor;
+    StoreConfig vnode_store = config.store;
+    vnode_store.max_keys = std::max<uint32_t>(1, config.store.max_keys / config.vnodes);
+    vnode_store.arena_bytes = config.store.arena_bytes / config.vnodes;
 
-    if (argc > 1) {
-        bootstrap_ip = inet_addr(argv[1]);
-    } else {
-        std::cout << "[DISCOVERY] Searching for neighbors via Broadcast..." << std::endl;
-        bootstrap_ip = discover_neighbor_ip(my_discovery_id);
+    if (config.udp_heartbeat && !reactor.enableHeartbeat(HEARTBEAT_PORT)) {
+        LOG_ERROR("[ERROR] Could not open UDP heartbeat port " << HEARTBEAT_PORT);
+        return 1;
     }
 
-    ChordNode node(my_ip, CHORD_PORT);
+    // One read cache per host, whichever of our ports a client asks.
+    std::unique_ptr<ReadCache> read_cache;
+    if (config.cache.max_keys > 0) read_cache.reset(new ReadCache(config.cache, config.cache_ttl_ms));
 
-    if (bootstrap_ip == 0) {
-        std::cout << "[SYSTEM] No neighbor found. I am the first node (Master)." << std::endl;
-        const char* root_secret = "TRUST-ME-I-AM-ROOT";
-        node.setCertificate((uint8_t*)root_secret, strlen(root_secret) + 1);
-    } else {
-        std::cout << "[SYSTEM] Found neighbor at " << inet_ntoa(*(in_addr*)&bootstrap_ip) << std::endl;
+    std::vector<std::unique_ptr<VirtualNode>> vnodes;
+    for (int v = 0; v < config.vnodes; ++v) {
+        uint16_t port = (uint16_t)(fixed_port + v);
+        if (!reactor.listen(port)) {
+            LOG_ERROR("[ERROR] Could not listen on port " << port);
+            return 1;
+        }
+        vnodes.emplace_back(new VirtualNode(reactor, my_ip, port, vnode_store, config.replicas));
+        vnodes.back()->service.setStartTime(start_ms);
+        if (config.recursive_lookups) vnodes.back()->service.setLookupMode(ChordService::LOOKUP_RECURSIVE);
+        vnodes.back()->service.setPhiThreshold(config.phi_threshold);
+        vnodes.back()->service.setReadCache(read_cache.get());
+    }
+    LOG_INFO("[STORE] Capacity " << config.store.max_keys << " keys, " << config.store.arena_bytes / 1024
+                                 << " KiB, split over " << config.vnodes << " virtual node(s)");
+    if (read_cache) {
+        LOG_INFO("[CACHE] Read cache of " << config.cache.max_keys << " keys, " << config.cache.arena_bytes / 1024
+                                          << " KiB, copies served for " << config.cache_ttl_ms << " ms");
     }
 
+    // Replayed before the discovery broadcast, which can take most of a second, so that
+    // a restarted node serves its keys as soon as the event loop runs.
+    if (!config.data_dir.empty()) {
+        auto load_start = std::chrono::steady_clock::now();
+        for (size_t v = 0; v < vnodes.size(); ++v) {
+            // store.log for the first virtual node keeps logs of single-node setups valid.
+            std::string file = v == 0 ? "/store.log" : "/store." + std::to_string(fixed_port + v) + ".log";
+            VirtualNode& vn = *vnodes[v];
+            if (!vn.log.open(config.data_dir + file)) {
+                LOG_ERROR("[ERROR] Could not open store log " << config.data_dir << file);
+                return 1;
+            }
+            uint32_t records = vn.log.replay(vn.store);
+            vn.store.attachJournal(&vn.log);
+            LOG_INFO("[STORE] Restored " << vn.store.size() << " keys from " << records << " log records of " << file.substr(1));
+        }
+        long load_ms = (long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - load_start).count();
+        LOG_INFO("[STORE] Logs loaded in " << load_ms << " ms");
+    }
 
-    SOCKET server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    sockaddr_in srv_addr;
-    std::memset(&srv_addr, 0, sizeof(srv_addr));
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_port = htons(fixed_port);
-    srv_addr.sin_addr.s_addr = INADDR_ANY;
-
-    int opt = 1; setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-    if (bind(server_fd, (struct sockaddr*)&srv_addr, sizeof(srv_addr)) == SOCKET_ERROR) return 1;
-    listen(server_fd, 10);
+    // No random delay before the broadcast: nodes that start together elect one of them.
+    std::vector<uint32_t> bootstrap_ips;
+    if (config.bootstrap_ip != 0) {
+        bootstrap_ips.push_back(config.bootstrap_ip);
+    } else {
+        LOG_INFO("[DISCOVERY] Searching for neighbors via Broadcast...");
+        bootstrap_ips = discoverBootstraps(my_discovery_id, my_ip);
+    }
+    if (!bootstrap_ips.empty()) bootstrap_ip = bootstrap_ips[0];
 
-#ifdef _WIN32
-    u_long mode = 1; ioctlsocket(server_fd, FIONBIO, &mode);
-#else
-    fcntl(server_fd, F_SETFL, O_NONBLOCK);
-#endif
+    if (bootstrap_ip == 0) {
+        LOG_INFO("[SYSTEM] No neighbor found. I am the first node (Master).");
+        g_member_since = steadyMs();
+    } else {
+        LOG_INFO("[SYSTEM] Found neighbor at " << inet_ntoa(*(in_addr*)&bootstrap_ip));
+    }
 
-    uint8_t rpc_buffer[4096];
-    auto last_stabilize = std::chrono::steady_clock::now();
-    auto last_join_attempt = std::chrono::steady_clock::now() - std::chrono::seconds(10);
+    // Other nodes get the certificate by gossip. One started with a newer version rotates it.
+    if (!config.cert_file.empty()) {
+        std::vector<uint8_t> cert;
+        if (!loadCertificate(config.cert_file, &cert)) {
+            LOG_ERROR("[ERROR] Could not read a certificate of at most " << CERT_MAX_LEN << " bytes from " << config.cert_file);
+            return 1;
+        }
+        for (auto& v : vnodes) v->certs.setCertificate(cert.data(), (uint32_t)cert.size(), config.cert_version);
+        LOG_INFO("[SECURITY] Loaded certificate version " << config.cert_version << " from " << config.cert_file);
+    } else if (bootstrap_ip == 0) {
+        const char* root_secret = "TRUST-ME-I-AM-ROOT";
+        for (auto& v : vnodes) v->certs.setCertificate((uint8_t*)root_secret, strlen(root_secret) + 1, config.cert_version);
+    }
 
-    while (g_running) {
-        fd_set readfds; FD_ZERO(&readfds); FD_SET(server_fd, &readfds);
-        timeval tv = {0, 20000};
-        if (select(server_fd + 1, &readfds, NULL, NULL, &tv) > 0) {
-            sockaddr_in c_addr; socklen_t c_len = sizeof(c_addr);
-            SOCKET client = accept(server_fd, (struct sockaddr*)&c_addr, &c_len);
-            if (client != INVALID_SOCKET) {
-                PacketHeader hdr;
-                if (recv(client, (char*)&hdr, sizeof(hdr), 0) == sizeof(hdr)) {
-                    std::vector<uint8_t> buf(hdr.payload_len);
-                    if (hdr.payload_len > 0) {
-                        uint32_t r = 0;
-                        while(r < hdr.payload_len) {
-                            int chunk = recv(client, (char*)buf.data()+r, hdr.payload_len-r, 0);
-                            if (chunk <= 0) break;
-                            r += chunk;
-                        }
-                    }
-
-                    if (hdr.type == MSG_FIND_SUCCESSOR) {
-                        FindSuccessorPayload* req = (FindSuccessorPayload*)buf.data();
-                        NodeInfo next = node.findSuccessorNextHop(req->target_id);
-                        NodeInfoPayload resp; resp.node = next;
-                        sendPacket(client, MSG_FIND_SUCCESSOR_RESPONSE, &resp, sizeof(resp));
-                    }
-                    else if (hdr.type == MSG_GET_PREDECESSOR) {
-                        if (node.hasPredecessor()) {
-                            NodeInfoPayload resp; resp.node = node.getPredecessor();
-                            sendPacket(client, MSG_GET_PREDECESSOR_RESPONSE, &resp, sizeof(resp));
-                        } else {
-                            PacketHeader err = hdr; err.payload_len = 0;
-                            send(client, (char*)&err, sizeof(err), 0);
-                        }
-                    }
-                    else if (hdr.type == MSG_NOTIFY) {
-                        node.handleNotify(((NodeInfoPayload*)buf.data())->node);
-                    }
-                    else if (hdr.type == MSG_GET_SUCLIST) {
-                        NodeListPayload resp;
-                        node.getMySuccessorList(resp.nodes, &resp.count);
-                        sendPacket(client, MSG_GET_SUCLIST_RESPONSE, &resp, sizeof(resp));
-                    }
-                    else if (hdr.type == MSG_GET_CERT) {
-                        CertPayload resp; resp.cert_len = node.getCertLen();
-                        std::memcpy(resp.data, node.getCertData(), resp.cert_len);
-                        sendPacket(client, MSG_CERT_RESPONSE, &resp, sizeof(uint32_t) + resp.cert_len);
-                    }
-                    else if (hdr.type == MSG_PING) {
-                        PacketHeader p_resp = hdr; p_resp.payload_len = 0;
-                        send(client, (char*)&p_resp, sizeof(p_resp), 0);
-                    }
-                }
-                closesocket(client);
+    // Local virtual nodes join through the remote bootstrap. Only on the first host do
+    // they join through our own first node, anything else could form a separate ring.
+    for (size_t v = 0; v < vnodes.size(); ++v) {
+        NodeInfo bootstrap;
+        std::memset(&bootstrap, 0, sizeof(bootstrap));
+        if (bootstrap_ip != 0 && bootstrap_ip != INADDR_NONE) {
+            // The alternatives are asked in parallel, whichever answers first wins.
+            for (uint32_t ip : bootstrap_ips) {
+                bootstrap.ip = ip;
+                bootstrap.port = fixed_port;
+                vnodes[v]->service.addBootstrap(bootstrap);
             }
+        } else if (v > 0) {
+            vnodes[v]->service.setBootstrap(vnodes[0]->node.getMyself());
         }
+    }
 
-        auto now = std::chrono::steady_clock::now();
-
-        // --- 2. JOIN LOGIC (IP BASED) ---
-        if (node.getSuccessor().ip == my_ip && (bootstrap_ip != 0 && bootstrap_ip != INADDR_NONE)) {
-            if (std::chrono::duration_cast<std::chrono::seconds>(now - last_join_attempt).count() > 2) {
-                NodeInfo target; target.ip = bootstrap_ip; target.port = fixed_port;
-                FindSuccessorPayload req; req.target_id = node.getMyself().id;
-                PacketHeader res_hdr;
-                if (sendRpc(target, MSG_FIND_SUCCESSOR, &req, sizeof(req), &res_hdr, rpc_buffer, 4096, 1000)) {
-                    if (res_hdr.type == MSG_FIND_SUCCESSOR_RESPONSE) {
-                        NodeInfo suc = ((NodeInfoPayload*)rpc_buffer)->node;
-                        node.setSuccessor(suc);
-                        std::cout << "[JOIN] Successor found: " << inet_ntoa(*(in_addr*)&suc.ip) << std::endl;
-
-                        if (sendRpc(suc, MSG_GET_CERT, nullptr, 0, &res_hdr, rpc_buffer, 4096, 500)) {
-                            if (res_hdr.type == MSG_CERT_RESPONSE) {
-                                CertPayload* cp = (CertPayload*)rpc_buffer;
-                                node.setCertificate(cp->data, cp->cert_len);
-
-                                if(cp->cert_len > 0) {
-                                    std::cout << "[SECURITY] Valid certificate received." << std::endl;
-                                } else {
-                                    std::cout << "[SECURITY] Warning! Empty certificate received!" << std::endl;
-                                }
-                            }
-                        }
-                    }
-                }
-                last_join_attempt = now;
-            }
+    std::unique_ptr<WorkerPool> workers;
+    if (config.workers > 0) {
+        workers.reset(new WorkerPool(reactor, config.workers));
+        for (auto& v : vnodes) workers->addNode(v->node.getMyself().port, v->node, v->service);
+        workers->start();
+        LOG_INFO("[SYSTEM] Serving lookups on " << config.workers << " worker thread(s)");
+    }
+
+    auto last_report = std::chrono::steady_clock::now();
+    while (g_running) {
+        reactor.poll(20);
+        for (auto& v : vnodes) {
+            v->service.tick();
+            v->log.maintain(v->store);
+        }
+        if (workers) workers->publish();
+        if (g_member_since == 0 && !vnodes[0]->node.isAlone()) g_member_since = steadyMs();
+        if (std::chrono::steady_clock::now() - last_report > std::chrono::seconds(LOAD_REPORT_INTERVAL_S)) {
+            last_report = std::chrono::steady_clock::now();
+            printLoadReport(vnodes);
+            printHealthReport(vnodes);
+            printRpcReport(reactor);
         }
+    }
 
-        // --- 3. STABILIZE LOGIC ---
-        if (std::chrono::duration_cast<std::chrono::milliseconds>(now - last_stabilize).count() > 200) {
-            NodeInfo suc = node.getSuccessor();
-            if (suc.ip != my_ip) {
-                PacketHeader h;
-                if (sendRpc(suc, MSG_GET_PREDECESSOR, nullptr, 0, &h, rpc_buffer, 4096)) {
-                    if (h.type == MSG_GET_PREDECESSOR_RESPONSE && h.payload_len >= sizeof(NodeInfoPayload)) {
-                        node.handleStabilizeResponse(((NodeInfoPayload*)rpc_buffer)->node);
-                    }
-                    if (sendRpc(suc, MSG_GET_SUCLIST, nullptr, 0, &h, rpc_buffer, 4096)) {
-                        if (h.type == MSG_GET_SUCLIST_RESPONSE) {
-                            NodeListPayload* lp = (NodeListPayload*)rpc_buffer;
-                            node.updateSuccessorList(lp->nodes, lp->count);
-                        }
-                    }
-                    NodeInfoPayload me; me.node = node.getMyself();
-                    sendRpc(suc, MSG_NOTIFY, &me, sizeof(me), nullptr, nullptr, 200);
-                } else {
-                    node.handleSuccessorFailure();
-                }
-            } else if (node.hasPredecessor() && node.getPredecessor().ip != my_ip) {
-                node.setSuccessor(node.getPredecessor());
-            }
-            last_stabilize = now;
+    // Hand our keys to the successor before going away, but do not hang on a dead one.
+    // Virtual nodes leave one after another, so one that takes over the range of another
+    // has learned its new predecessor before it hands everything on.
+    LOG_INFO("[SYSTEM] Leaving the ring...");
+    auto leave_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    for (auto& v : vnodes) {
+        bool left = false;
+        v->service.leave([&left]() { left = true; });
+        while (!left && std::chrono::steady_clock::now() < leave_deadline) {
+            reactor.poll(20);
+            if (workers) workers->publish();
         }
+        for (int i = 0; i < 5; ++i) reactor.poll(20);
     }
+    if (workers) workers->stop();
 
-    closesocket(server_fd);
+    Logger::instance().stop();
 #ifdef _WIN32
     WSACleanup();
 #endif
-    responder.join();
     return 0;
 }
\ No newline at end of file